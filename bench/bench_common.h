@@ -0,0 +1,79 @@
+// Helpers shared by the benchmark programs.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t now_in_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Parses a comma separated list of numbers like "4,8,16" into out, and returns
+// how many of them there were, or 0 if the list is not valid.
+static inline uint32_t parse_u64_list(const char* arg, uint64_t* out,
+                                      uint32_t max_count) {
+  uint32_t count = 0;
+  const char* pos = arg;
+  while (*pos && count < max_count) {
+    char* end = NULL;
+    out[count++] = strtoull(pos, &end, 10);
+    if (end == pos || (*end != ',' && *end != '\0')) {
+      return 0;
+    }
+    pos = *end == ',' ? end + 1 : end;
+  }
+
+  return *pos ? 0 : count;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double da = *(const double*)a;
+  double db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+// Sorts values in place.
+static inline double median_of(double* values, uint32_t count) {
+  qsort(values, count, sizeof(double), compare_doubles);
+  if (count % 2 == 1) {
+    return values[count / 2];
+  }
+  return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+// Fills a key buffer with the filler the longer keys end with, so that they
+// share long common suffixes like real world string keys tend to.
+static inline void init_key_buf(unsigned char* buf, uint32_t key_size) {
+  memset(buf, 'k', key_size);
+}
+
+// Writes the key number i into a buffer set up by 'init_key_buf'. The first 8
+// bytes (or all of them, for the shorter keys) hold i.
+static inline void make_key(unsigned char* buf, uint32_t key_size,
+                            uint64_t i) {
+  memcpy(buf, &i, key_size < sizeof(i) ? key_size : sizeof(i));
+}
+
+static inline uint64_t gcd_u64(uint64_t a, uint64_t b) {
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// A step that visits all of 0..n-1 in a scattered order when added up modulo
+// n, so the lookups don't walk the buckets in the order they got filled.
+static inline uint64_t scatter_step(uint64_t n) {
+  uint64_t step = n * 618 / 1000 + 1;
+  while (n > 1 && gcd_u64(step, n) != 1) {
+    ++step;
+  }
+  return step;
+}
@@ -0,0 +1,259 @@
+// Measures how much memory every entry takes, for every combination of the
+// given key sizes, value sizes and element counts. The map gets its memory
+// through counting allocator procs, which add up the sizes the map asked for,
+// and what malloc really handed out with malloc_usable_size. Printed as CSV,
+// per entry:
+//   allocs:    the live allocations,
+//   requested: the bytes the map asked for, the bucket array and the map
+//              itself included,
+//   actual:    the bytes malloc handed out for them,
+//   payload:   the key and value bytes,
+// and the ratio of actual to payload.
+//
+// Usage: ./bytes_per_entry [-k key_sizes] [-v val_sizes] [-n elem_counts]
+
+#include <chashmap.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+#define MAX_LIST_LEN 32
+
+#define INITIAL_SIZE_SLOTS 1024
+
+typedef struct alloc_counts {
+  uint64_t live_allocs;
+  uint64_t live_bytes;
+  uint64_t requested_bytes;
+} alloc_counts;
+
+static alloc_counts counts;
+
+// The sizes the map asked for, by the address they got allocated at, since a
+// free or a realloc only gets the address. Linear probing, with the entries
+// after a removed one shifted back to keep the probe sequences unbroken.
+typedef struct size_slot {
+  void* ptr;
+  size_t size;
+} size_slot;
+
+static size_slot* size_slots;
+static uint64_t size_slot_mask;
+static uint64_t size_slot_count;
+
+static inline uint64_t size_slot_index(const void* ptr) {
+  return (((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL) & size_slot_mask;
+}
+
+static void put_size(void* ptr, size_t size) {
+  uint64_t index = size_slot_index(ptr);
+  while (size_slots[index].ptr) {
+    index = (index + 1) & size_slot_mask;
+  }
+  size_slots[index] = (size_slot){.ptr = ptr, .size = size};
+  ++size_slot_count;
+}
+
+// Keeps the table at most half full, returns 0 if it can't.
+static int reserve_size_slot(void) {
+  if (size_slots && (size_slot_count + 1) * 2 <= size_slot_mask + 1) {
+    return 1;
+  }
+
+  uint64_t old_len = size_slots ? size_slot_mask + 1 : 0;
+  uint64_t new_len = old_len ? old_len * 2 : INITIAL_SIZE_SLOTS;
+  size_slot* old_slots = size_slots;
+  size_slots = calloc(new_len, sizeof(size_slot));
+  if (!size_slots) {
+    size_slots = old_slots;
+    return 0;
+  }
+  size_slot_mask = new_len - 1;
+  size_slot_count = 0;
+  for (uint64_t i = 0; i < old_len; ++i) {
+    if (old_slots[i].ptr) {
+      put_size(old_slots[i].ptr, old_slots[i].size);
+    }
+  }
+  free(old_slots);
+
+  return 1;
+}
+
+static size_t take_size(const void* ptr) {
+  uint64_t index = size_slot_index(ptr);
+  while (size_slots[index].ptr != ptr) {
+    index = (index + 1) & size_slot_mask;
+  }
+  size_t size = size_slots[index].size;
+
+  uint64_t next = index;
+  for (;;) {
+    next = (next + 1) & size_slot_mask;
+    if (!size_slots[next].ptr) {
+      break;
+    }
+    // Stays unless its probe sequence started at or before the hole
+    uint64_t home = size_slot_index(size_slots[next].ptr);
+    if (((next - home) & size_slot_mask) >= ((next - index) & size_slot_mask)) {
+      size_slots[index] = size_slots[next];
+      index = next;
+    }
+  }
+  size_slots[index].ptr = NULL;
+  --size_slot_count;
+
+  return size;
+}
+
+static void* count_alloc(void* ptr, size_t size) {
+  if (ptr) {
+    ++counts.live_allocs;
+    counts.live_bytes += malloc_usable_size(ptr);
+    counts.requested_bytes += size;
+    put_size(ptr, size);
+  }
+  return ptr;
+}
+
+static void* counting_malloc(size_t size) {
+  return reserve_size_slot() ? count_alloc(malloc(size), size) : NULL;
+}
+
+static void* counting_calloc(size_t elem_count, size_t elem_size) {
+  return reserve_size_slot()
+             ? count_alloc(calloc(elem_count, elem_size), elem_count * elem_size)
+             : NULL;
+}
+
+static void counting_free(void* ptr) {
+  if (ptr) {
+    --counts.live_allocs;
+    counts.live_bytes -= malloc_usable_size(ptr);
+    counts.requested_bytes -= take_size(ptr);
+  }
+  free(ptr);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+  if (!ptr) {
+    return counting_malloc(size);
+  }
+  size_t old_usable = malloc_usable_size(ptr);
+  size_t old_size = take_size(ptr);
+  void* new_ptr = realloc(ptr, size);
+  if (!new_ptr) {
+    // The old allocation is still there
+    put_size(ptr, old_size);
+    return NULL;
+  }
+  counts.live_bytes += malloc_usable_size(new_ptr) - old_usable;
+  counts.requested_bytes += size - old_size;
+  put_size(new_ptr, size);
+  return new_ptr;
+}
+
+static chashmap_memmgmt_procs_t counting_procs = {.malloc = counting_malloc,
+                                                  .free = counting_free,
+                                                  .calloc = counting_calloc,
+                                                  .realloc = counting_realloc};
+
+static int run_config(uint32_t key_size, uint32_t val_size,
+                      uint64_t elem_count) {
+  unsigned char* key = malloc(key_size);
+  unsigned char* val = malloc(val_size);
+  if (!key || !val) {
+    free(key);
+    free(val);
+    return 0;
+  }
+  init_key_buf(key, key_size);
+  memset(val, 'v', val_size);
+
+  alloc_counts before = counts;
+  chashmap* chmap = chmap_create_mp(1, &counting_procs, NULL);
+  int success = chmap != NULL;
+  chmap_pair key_pair = {.ptr = key, .size = key_size};
+  chmap_pair val_pair = {.ptr = val, .size = val_size};
+  for (uint64_t i = 0; i < elem_count && success; ++i) {
+    make_key(key, key_size, i);
+    success = chmap_insert_elem(chmap, &key_pair, &val_pair) == chm_success;
+  }
+
+  if (success) {
+    double allocs = counts.live_allocs - before.live_allocs;
+    double payload = (double)key_size + val_size;
+    double requested =
+        (double)(counts.requested_bytes - before.requested_bytes) / elem_count;
+    double actual =
+        (double)(counts.live_bytes - before.live_bytes) / elem_count;
+    printf("%u,%u,%lu,%.2f,%.1f,%.1f,%.0f,%.2f\n", key_size, val_size,
+           (unsigned long)elem_count, allocs / elem_count, requested, actual,
+           payload, actual / payload);
+    fflush(stdout);
+  }
+
+  if (chmap) {
+    chmap_destroy(chmap);
+  }
+  free(key);
+  free(val);
+
+  return success;
+}
+
+int main(int argc, char** argv) {
+  uint64_t key_sizes[MAX_LIST_LEN] = {8, 16, 64};
+  uint32_t key_size_count = 3;
+  uint64_t val_sizes[MAX_LIST_LEN] = {8, 64, 512};
+  uint32_t val_size_count = 3;
+  uint64_t elem_counts[MAX_LIST_LEN] = {100000};
+  uint32_t elem_count_count = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:v:n:")) != -1) {
+    switch (opt) {
+      case 'k':
+        key_size_count = parse_u64_list(optarg, key_sizes, MAX_LIST_LEN);
+        break;
+      case 'v':
+        val_size_count = parse_u64_list(optarg, val_sizes, MAX_LIST_LEN);
+        break;
+      case 'n':
+        elem_count_count = parse_u64_list(optarg, elem_counts, MAX_LIST_LEN);
+        break;
+      default:
+        key_size_count = 0;
+        break;
+    }
+  }
+
+  if (!key_size_count || !val_size_count || !elem_count_count) {
+    fprintf(stderr,
+            "Usage: %s [-k key_sizes] [-v val_sizes] [-n elem_counts]\n",
+            argv[0]);
+    return 1;
+  }
+
+  printf("key_size,val_size,elements,allocs,requested_bytes,actual_bytes,"
+         "payload_bytes,overhead_ratio\n");
+  for (uint32_t n = 0; n < elem_count_count; ++n) {
+    for (uint32_t k = 0; k < key_size_count; ++k) {
+      for (uint32_t v = 0; v < val_size_count; ++v) {
+        if (!key_sizes[k] || !val_sizes[v] || !elem_counts[n] ||
+            !run_config(key_sizes[k], val_sizes[v], elem_counts[n])) {
+          fprintf(stderr, "Failed to run %lu byte keys, %lu byte values, %lu "
+                          "elements\n",
+                  (unsigned long)key_sizes[k], (unsigned long)val_sizes[v],
+                  (unsigned long)elem_counts[n]);
+          return 1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
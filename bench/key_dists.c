@@ -0,0 +1,160 @@
+// Measures the inserts and the lookups with every key set of workloads.h,
+// looked up both uniformly and with a Zipf distribution, and prints how
+// evenly the keys got spread over the buckets next to the timings, as CSV.
+// The colliding DJB2 keys all land in a single chain, so there are fewer of
+// them to keep the run time in check.
+//
+// Usage: ./key_dists [-n elem_count] [-l lookup_count] [-s stride]
+//                    [-z zipf_skew] [-c collision_count] [-r reps]
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "workloads.h"
+
+#define MAX_REPS 101
+
+typedef struct bench_params {
+  uint64_t elem_count;
+  uint64_t lookup_count;
+  uint64_t stride;
+  double zipf_skew;
+  uint64_t collision_count;
+  uint32_t reps;
+} bench_params;
+
+typedef struct round_result {
+  double insert_ns;
+  double lookup_ns;
+  chmap_stats stats;
+} round_result;
+
+static int run_round(const key_set* set, access_dist* dist,
+                     uint64_t lookup_count, round_result* result) {
+  unsigned char key[WORKLOAD_MAX_KEY_SIZE];
+  uint64_t val = 0;
+  chmap_pair key_pair = {.ptr = key};
+  chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+
+  chashmap* chmap = chmap_create(1, NULL);
+  if (!chmap) {
+    return 0;
+  }
+
+  int success = 1;
+  uint64_t start = now_in_ns();
+  for (uint64_t i = 0; i < set->key_count && success; ++i) {
+    key_pair.size = key_set_key(set, i, key);
+    success = chmap_insert_elem(chmap, &key_pair, &val_pair) == chm_success;
+  }
+  result->insert_ns = (double)(now_in_ns() - start) / set->key_count;
+
+  start = now_in_ns();
+  for (uint64_t i = 0; i < lookup_count && success; ++i) {
+    chmap_pair* val_ref = NULL;
+    key_pair.size = key_set_key(set, access_dist_next(dist), key);
+    success = chmap_get_elem_ref(chmap, &key_pair, &val_ref) == chm_success;
+  }
+  result->lookup_ns = (double)(now_in_ns() - start) / lookup_count;
+
+  success = success && chmap_get_stats(chmap, &result->stats) == chm_success &&
+            result->stats.elem_count == set->key_count;
+
+  chmap_destroy(chmap);
+
+  return success;
+}
+
+static int run_workload(key_set_kind set_kind, access_kind access,
+                        const bench_params* params) {
+  uint64_t key_count = set_kind == key_set_djb2_collisions
+                           ? params->collision_count
+                           : params->elem_count;
+  key_set set;
+  key_set_init(&set, set_kind, key_count, params->stride);
+  access_dist dist;
+  access_dist_init(&dist, access, key_count, params->zipf_skew, 42);
+
+  double insert_ns[MAX_REPS];
+  double lookup_ns[MAX_REPS];
+  round_result result = {0};
+  for (uint32_t rep = 0; rep < params->reps; ++rep) {
+    if (!run_round(&set, &dist, params->lookup_count, &result)) {
+      return 0;
+    }
+    insert_ns[rep] = result.insert_ns;
+    lookup_ns[rep] = result.lookup_ns;
+  }
+
+  printf("%s,%s,%lu,%.2f,%.2f,%u,%.2f,%.3f\n", key_set_names[set_kind],
+         access_names[access], (unsigned long)key_count,
+         median_of(insert_ns, params->reps), median_of(lookup_ns, params->reps),
+         result.stats.max_chain_len, result.stats.mean_chain_len,
+         result.stats.empty_bucket_ratio);
+  fflush(stdout);
+
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  bench_params params = {.elem_count = 1000000,
+                         .lookup_count = 1000000,
+                         .stride = 64,
+                         .zipf_skew = 0.99,
+                         .collision_count = 2000,
+                         .reps = 3};
+
+  int valid = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:s:z:c:r:")) != -1) {
+    switch (opt) {
+      case 'n':
+        params.elem_count = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        params.lookup_count = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        params.stride = strtoull(optarg, NULL, 10);
+        break;
+      case 'z':
+        params.zipf_skew = strtod(optarg, NULL);
+        break;
+      case 'c':
+        params.collision_count = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        params.reps = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        valid = 0;
+        break;
+    }
+  }
+
+  if (!valid || params.elem_count < 2 || params.collision_count < 2 ||
+      params.lookup_count == 0 || params.zipf_skew <= 0 ||
+      params.zipf_skew >= 1 || params.reps == 0 || params.reps > MAX_REPS) {
+    fprintf(stderr,
+            "Usage: %s [-n elem_count] [-l lookup_count] [-s stride] "
+            "[-z zipf_skew (0 < skew < 1)] [-c collision_count] [-r reps]\n",
+            argv[0]);
+    return 1;
+  }
+
+  printf("key_set,access,elements,insert_ns,lookup_ns,max_chain,"
+         "mean_chain,empty_bucket_ratio\n");
+  for (uint32_t set_kind = 0; set_kind < key_set_kind_count; ++set_kind) {
+    for (uint32_t access = 0; access < access_kind_count; ++access) {
+      if (!run_workload(set_kind, access, &params)) {
+        fprintf(stderr, "Failed to run the %s keys\n", key_set_names[set_kind]);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,290 @@
+// Measures the throughput of the core operations (insert, lookups that hit
+// and miss, iteration, delete and reset) for every combination of the given
+// key sizes, value sizes and element counts. Every combination gets run
+// warmup times unmeasured and reps times measured, and the median and the
+// best of the measured rounds get printed as CSV, in nanoseconds per element.
+// With -p, the medians of the hardware counters of perf_counters.h get printed
+// per element too.
+//
+// Usage: ./ops [-k key_sizes] [-v val_sizes] [-n elem_counts] [-r reps]
+//              [-w warmup_rounds] [-p]
+//   The sizes and counts are comma separated lists, e.g.
+//   ./ops -k 8,64 -v 8,4096 -n 1000,1000000,100000000 -r 7
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "perf_counters.h"
+
+#define MAX_LIST_LEN 32
+#define MAX_REPS 101
+
+enum {
+  op_insert,
+  op_hit_lookup,
+  op_miss_lookup,
+  op_iterate,
+  op_delete,
+  op_reset,
+  op_count
+};
+
+static const char* op_names[op_count] = {
+    "insert", "hit_lookup", "miss_lookup", "iterate", "delete", "reset"};
+
+typedef struct bench_config {
+  uint32_t key_size;
+  uint32_t val_size;
+  uint64_t elem_count;
+  // NULL unless the hardware counters got asked for
+  perf_counters* counters;
+} bench_config;
+
+// What a single round measured, per element.
+typedef struct round_result {
+  double ns[op_count];
+  double events[op_count][perf_counter_count];
+} round_result;
+
+typedef struct op_meter {
+  const bench_config* config;
+  round_result* result;
+  uint64_t start;
+} op_meter;
+
+static void begin_op(op_meter* meter) {
+  if (meter->config->counters) {
+    perf_counters_start(meter->config->counters);
+  }
+  meter->start = now_in_ns();
+}
+
+static void end_op(op_meter* meter, uint32_t op) {
+  uint64_t elapsed = now_in_ns() - meter->start;
+  double n = meter->config->elem_count;
+  meter->result->ns[op] = elapsed / n;
+  if (meter->config->counters) {
+    double* events = meter->result->events[op];
+    perf_counters_stop(meter->config->counters, events);
+    for (uint32_t i = 0; i < perf_counter_count; ++i) {
+      events[i] /= n;
+    }
+  }
+}
+
+static void count_elem(const chmap_pair* key_pair, chmap_pair* val_pair,
+                       void* args) {
+  (void)key_pair;
+  *(uint64_t*)args += val_pair->size;
+}
+
+static int fill_map(chashmap* chmap, const bench_config* config,
+                    unsigned char* key, unsigned char* val) {
+  chmap_pair key_pair = {.ptr = key, .size = config->key_size};
+  chmap_pair val_pair = {.ptr = val, .size = config->val_size};
+  for (uint64_t i = 0; i < config->elem_count; ++i) {
+    make_key(key, config->key_size, i);
+    if (chmap_insert_elem(chmap, &key_pair, &val_pair) != chm_success) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Looks the keys first + 0..elem_count-1 up in a scattered order, and returns
+// how many of them were found.
+static uint64_t look_up_keys(chashmap* chmap, const bench_config* config,
+                             unsigned char* key, uint64_t first) {
+  chmap_pair key_pair = {.ptr = key, .size = config->key_size};
+  uint64_t n = config->elem_count;
+  uint64_t step = scatter_step(n);
+  uint64_t found = 0;
+  for (uint64_t i = 0, j = 0; i < n; ++i, j = (j + step) % n) {
+    chmap_pair* val_ref = NULL;
+    make_key(key, config->key_size, first + j);
+    found += chmap_get_elem_ref(chmap, &key_pair, &val_ref) == chm_success;
+  }
+  return found;
+}
+
+// Runs every operation once on a fresh map, and stores what each of them took
+// per element into result.
+static int run_round(const bench_config* config, unsigned char* key,
+                     unsigned char* val, round_result* result) {
+  uint64_t n = config->elem_count;
+  chashmap* chmap = chmap_create(1, NULL);
+  if (!chmap) {
+    return 0;
+  }
+
+  op_meter meter = {.config = config, .result = result};
+  begin_op(&meter);
+  int success = fill_map(chmap, config, key, val);
+  end_op(&meter, op_insert);
+
+  begin_op(&meter);
+  success = success && look_up_keys(chmap, config, key, 0) == n;
+  end_op(&meter, op_hit_lookup);
+
+  begin_op(&meter);
+  success = success && look_up_keys(chmap, config, key, n) == 0;
+  end_op(&meter, op_miss_lookup);
+
+  uint64_t total_size = 0;
+  begin_op(&meter);
+  chmap_for_each_elem(chmap, count_elem, &total_size);
+  end_op(&meter, op_iterate);
+  success = success && total_size == n * config->val_size;
+
+  chmap_pair key_pair = {.ptr = key, .size = config->key_size};
+  uint64_t step = scatter_step(n);
+  begin_op(&meter);
+  for (uint64_t i = 0, j = 0; i < n; ++i, j = (j + step) % n) {
+    make_key(key, config->key_size, j);
+    success = success && chmap_delete_elem(chmap, &key_pair) == chm_success;
+  }
+  end_op(&meter, op_delete);
+
+  success = success && fill_map(chmap, config, key, val);
+  begin_op(&meter);
+  success = success && chmap_reset(chmap, 0) == chm_success;
+  end_op(&meter, op_reset);
+
+  chmap_destroy(chmap);
+
+  return success;
+}
+
+static int run_config(const bench_config* config, uint32_t warmup_rounds,
+                      uint32_t reps) {
+  unsigned char* key = malloc(config->key_size);
+  unsigned char* val = malloc(config->val_size);
+  if (!key || !val) {
+    free(key);
+    free(val);
+    return 0;
+  }
+  init_key_buf(key, config->key_size);
+  memset(val, 'v', config->val_size);
+
+  double results[op_count][MAX_REPS];
+  double events[op_count][perf_counter_count][MAX_REPS];
+  round_result result = {0};
+  int success = 1;
+  for (uint32_t round = 0; round < warmup_rounds + reps && success; ++round) {
+    success = run_round(config, key, val, &result);
+    if (round >= warmup_rounds) {
+      for (uint32_t op = 0; op < op_count; ++op) {
+        results[op][round - warmup_rounds] = result.ns[op];
+        for (uint32_t i = 0; i < perf_counter_count; ++i) {
+          events[op][i][round - warmup_rounds] = result.events[op][i];
+        }
+      }
+    }
+  }
+
+  for (uint32_t op = 0; op < op_count && success; ++op) {
+    double median = median_of(results[op], reps);
+    printf("%s,%u,%u,%lu,%u,%.2f,%.2f,%.3f", op_names[op], config->key_size,
+           config->val_size, (unsigned long)config->elem_count, reps, median,
+           results[op][0], 1e3 / median);
+    for (uint32_t i = 0; i < perf_counter_count && config->counters; ++i) {
+      printf(",%.3f", median_of(events[op][i], reps));
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+
+  free(key);
+  free(val);
+
+  return success;
+}
+
+int main(int argc, char** argv) {
+  uint64_t key_sizes[MAX_LIST_LEN] = {4, 8, 16, 64, 256};
+  uint32_t key_size_count = 5;
+  uint64_t val_sizes[MAX_LIST_LEN] = {4, 64, 512, 4096};
+  uint32_t val_size_count = 4;
+  uint64_t elem_counts[MAX_LIST_LEN] = {1000, 100000};
+  uint32_t elem_count_count = 2;
+  uint32_t reps = 5;
+  uint32_t warmup_rounds = 1;
+  int count_events = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:v:n:r:w:p")) != -1) {
+    switch (opt) {
+      case 'k':
+        key_size_count = parse_u64_list(optarg, key_sizes, MAX_LIST_LEN);
+        break;
+      case 'v':
+        val_size_count = parse_u64_list(optarg, val_sizes, MAX_LIST_LEN);
+        break;
+      case 'n':
+        elem_count_count = parse_u64_list(optarg, elem_counts, MAX_LIST_LEN);
+        break;
+      case 'r':
+        reps = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        warmup_rounds = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        count_events = 1;
+        break;
+      default:
+        key_size_count = 0;
+        break;
+    }
+  }
+
+  if (!key_size_count || !val_size_count || !elem_count_count || reps == 0 ||
+      reps > MAX_REPS) {
+    fprintf(stderr,
+            "Usage: %s [-k key_sizes] [-v val_sizes] [-n elem_counts] "
+            "[-r reps] [-w warmup_rounds] [-p]\n",
+            argv[0]);
+    return 1;
+  }
+
+  perf_counters counters;
+  if (count_events && !perf_counters_open(&counters)) {
+    fprintf(stderr, "Failed to open any of the hardware counters, check "
+                    "/proc/sys/kernel/perf_event_paranoid\n");
+    return 1;
+  }
+
+  printf("op,key_size,val_size,elements,reps,median_ns,best_ns,median_mops");
+  for (uint32_t i = 0; i < perf_counter_count && count_events; ++i) {
+    printf(",%s", perf_counter_names[i]);
+  }
+  printf("\n");
+  for (uint32_t n = 0; n < elem_count_count; ++n) {
+    for (uint32_t k = 0; k < key_size_count; ++k) {
+      for (uint32_t v = 0; v < val_size_count; ++v) {
+        bench_config config = {.key_size = key_sizes[k],
+                               .val_size = val_sizes[v],
+                               .elem_count = elem_counts[n],
+                               .counters = count_events ? &counters : NULL};
+        if (!config.key_size || !config.val_size || !config.elem_count ||
+            !run_config(&config, warmup_rounds, reps)) {
+          fprintf(stderr, "Failed to run %u byte keys, %u byte values, %lu "
+                          "elements\n",
+                  config.key_size, config.val_size,
+                  (unsigned long)config.elem_count);
+          return 1;
+        }
+      }
+    }
+  }
+
+  if (count_events) {
+    perf_counters_close(&counters);
+  }
+
+  return 0;
+}
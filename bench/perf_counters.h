@@ -0,0 +1,111 @@
+// Hardware performance counters through perf_event_open, for the benchmarks
+// that want to tell where the nanoseconds went. The counters count the calling
+// thread in user space, and every one of them is opened on its own so that the
+// kernel can multiplex them when there are fewer hardware counters than
+// events; the counts get scaled up to the time they were enabled for. The ones
+// the machine or the perf_event_paranoid setting don't allow are reported as
+// NAN.
+
+#pragma once
+
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef enum perf_counter_kind {
+  perf_cycles,
+  perf_instructions,
+  perf_l1d_misses,
+  perf_llc_misses,
+  perf_dtlb_misses,
+  perf_branch_misses,
+  perf_counter_count
+} perf_counter_kind;
+
+static const char* const perf_counter_names[perf_counter_count] = {
+    "cycles",     "instructions", "l1d_misses",
+    "llc_misses", "dtlb_misses",  "branch_misses"};
+
+typedef struct perf_counters {
+  int fds[perf_counter_count];
+} perf_counters;
+
+#define PERF_CACHE_MISS_CONFIG(cache)                                  \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                      \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+// Returns how many of the counters could be opened.
+static inline uint32_t perf_counters_open(perf_counters* counters) {
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[perf_counter_count] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_L1D)},
+      {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_LL)},
+      {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_DTLB)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+
+  uint32_t opened = 0;
+  for (uint32_t i = 0; i < perf_counter_count; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    opened += counters->fds[i] >= 0;
+  }
+
+  return opened;
+}
+
+static inline void perf_counters_start(perf_counters* counters) {
+  for (uint32_t i = 0; i < perf_counter_count; ++i) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+// Stops the counters and stores what they counted since
+// 'perf_counters_start' into counts, which should hold perf_counter_count
+// values.
+static inline void perf_counters_stop(perf_counters* counters,
+                                      double* counts) {
+  for (uint32_t i = 0; i < perf_counter_count; ++i) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  for (uint32_t i = 0; i < perf_counter_count; ++i) {
+    // The value, the time enabled and the time running
+    uint64_t values[3];
+    counts[i] = NAN;
+    if (counters->fds[i] >= 0 &&
+        read(counters->fds[i], values, sizeof(values)) == sizeof(values) &&
+        values[2]) {
+      counts[i] = (double)values[0] * values[1] / values[2];
+    }
+  }
+}
+
+static inline void perf_counters_close(perf_counters* counters) {
+  for (uint32_t i = 0; i < perf_counter_count; ++i) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+    }
+  }
+}
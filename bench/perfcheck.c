@@ -0,0 +1,307 @@
+// The performance regression gate behind 'make perfcheck' in test/. Runs a
+// short, fixed set of measurements reps times, and compares their medians to
+// a baseline file of the form
+//   {
+//     "insert_8b_ns": {"value": 110.0, "tolerance": 0.30},
+//     ...
+//   }
+// Every metric is lower-is-better, and a median over value * (1 + tolerance)
+// is a regression, which makes the program exit with 1. A metric missing
+// from the baseline is reported but not checked. With -w, the medians get
+// written out as a new baseline instead, with the default tolerances.
+//
+// Usage: ./perfcheck [-r reps] [-w] baseline_file
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+#define MAX_REPS 101
+#define ELEM_COUNT 200000
+#define LONG_KEY_SIZE 32
+// The timings are noisy, the memory numbers are not.
+#define TIME_TOLERANCE 0.30
+#define MEMORY_TOLERANCE 0.02
+
+enum {
+  metric_insert_8b_ns,
+  metric_hit_lookup_8b_ns,
+  metric_miss_lookup_8b_ns,
+  metric_insert_32b_ns,
+  metric_hit_lookup_32b_ns,
+  metric_bytes_per_entry_8b,
+  metric_count
+};
+
+static const char* const metric_names[metric_count] = {
+    "insert_8b_ns",     "hit_lookup_8b_ns",  "miss_lookup_8b_ns",
+    "insert_32b_ns",    "hit_lookup_32b_ns", "bytes_per_entry_8b"};
+
+static const double default_tolerances[metric_count] = {
+    TIME_TOLERANCE, TIME_TOLERANCE, TIME_TOLERANCE,
+    TIME_TOLERANCE, TIME_TOLERANCE, MEMORY_TOLERANCE};
+
+typedef struct baseline_entry {
+  int present;
+  double value;
+  double tolerance;
+} baseline_entry;
+
+// Measures the inserts and the hit lookups of ELEM_COUNT keys of key_size
+// bytes with 8 byte values, in ns per operation, into metrics[insert_metric]
+// and metrics[hit_metric]. The 8 byte keys get their misses and the bytes per
+// entry measured as well.
+static int measure_map(uint32_t key_size, uint32_t insert_metric,
+                       uint32_t hit_metric, double* metrics) {
+  unsigned char key[LONG_KEY_SIZE];
+  uint64_t val = 0;
+  chmap_pair key_pair = {.ptr = key, .size = key_size};
+  chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+  init_key_buf(key, key_size);
+
+  chashmap* chmap = chmap_create(1, NULL);
+  if (!chmap) {
+    return 0;
+  }
+
+  int success = 1;
+  uint64_t start = now_in_ns();
+  for (uint64_t i = 0; i < ELEM_COUNT && success; ++i) {
+    make_key(key, key_size, i);
+    success = chmap_insert_elem(chmap, &key_pair, &val_pair) == chm_success;
+  }
+  metrics[insert_metric] = (double)(now_in_ns() - start) / ELEM_COUNT;
+
+  uint64_t step = scatter_step(ELEM_COUNT);
+  start = now_in_ns();
+  for (uint64_t i = 0, j = 0; i < ELEM_COUNT && success;
+       ++i, j = (j + step) % ELEM_COUNT) {
+    chmap_pair* val_ref = NULL;
+    make_key(key, key_size, j);
+    success = chmap_get_elem_ref(chmap, &key_pair, &val_ref) == chm_success;
+  }
+  metrics[hit_metric] = (double)(now_in_ns() - start) / ELEM_COUNT;
+
+  if (key_size == sizeof(uint64_t)) {
+    start = now_in_ns();
+    for (uint64_t i = 0, j = 0; i < ELEM_COUNT && success;
+         ++i, j = (j + step) % ELEM_COUNT) {
+      chmap_pair* val_ref = NULL;
+      make_key(key, key_size, ELEM_COUNT + j);
+      success = chmap_get_elem_ref(chmap, &key_pair, &val_ref) ==
+                chm_key_not_found;
+    }
+    metrics[metric_miss_lookup_8b_ns] =
+        (double)(now_in_ns() - start) / ELEM_COUNT;
+
+    chmap_mem_stats stats;
+    success = success && chmap_memory_usage(chmap, &stats) == chm_success;
+    metrics[metric_bytes_per_entry_8b] =
+        (double)stats.total_bytes / ELEM_COUNT;
+  }
+
+  chmap_destroy(chmap);
+
+  return success;
+}
+
+static const char* skip_space(const char* pos) {
+  while (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r') {
+    ++pos;
+  }
+  return pos;
+}
+
+// Reads a JSON string without escapes into buf, returns NULL if there is none.
+static const char* parse_string(const char* pos, char* buf, size_t buf_size) {
+  pos = skip_space(pos);
+  if (*pos != '"') {
+    return NULL;
+  }
+  const char* end = strchr(++pos, '"');
+  if (!end || (size_t)(end - pos) >= buf_size) {
+    return NULL;
+  }
+  memcpy(buf, pos, end - pos);
+  buf[end - pos] = '\0';
+  return end + 1;
+}
+
+static const char* expect_char(const char* pos, char c) {
+  pos = skip_space(pos);
+  return *pos == c ? pos + 1 : NULL;
+}
+
+// Parses the object of a metric, {"value": x, "tolerance": y}.
+static const char* parse_entry(const char* pos, baseline_entry* entry) {
+  pos = expect_char(pos, '{');
+  entry->value = -1;
+  entry->tolerance = -1;
+  while (pos) {
+    char field[32];
+    char* end = NULL;
+    pos = parse_string(pos, field, sizeof(field));
+    pos = pos ? expect_char(pos, ':') : NULL;
+    if (!pos) {
+      break;
+    }
+    double number = strtod(pos, &end);
+    if (end == pos) {
+      return NULL;
+    }
+    if (strcmp(field, "value") == 0) {
+      entry->value = number;
+    } else if (strcmp(field, "tolerance") == 0) {
+      entry->tolerance = number;
+    }
+    pos = skip_space(end);
+    if (*pos == '}') {
+      entry->present = entry->value >= 0 && entry->tolerance >= 0;
+      return entry->present ? pos + 1 : NULL;
+    }
+    pos = expect_char(pos, ',');
+  }
+  return NULL;
+}
+
+static int load_baseline(const char* path, baseline_entry* baseline) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  char text[8192];
+  size_t len = fread(text, 1, sizeof(text) - 1, file);
+  int complete = feof(file);
+  fclose(file);
+  if (!complete) {
+    return 0;
+  }
+  text[len] = '\0';
+
+  const char* pos = expect_char(text, '{');
+  while (pos) {
+    char name[64];
+    baseline_entry entry = {0};
+    pos = parse_string(pos, name, sizeof(name));
+    pos = pos ? expect_char(pos, ':') : NULL;
+    pos = pos ? parse_entry(pos, &entry) : NULL;
+    if (!pos) {
+      break;
+    }
+    for (uint32_t i = 0; i < metric_count; ++i) {
+      if (strcmp(name, metric_names[i]) == 0) {
+        baseline[i] = entry;
+      }
+    }
+    pos = skip_space(pos);
+    if (*pos == '}') {
+      return 1;
+    }
+    pos = expect_char(pos, ',');
+  }
+
+  return 0;
+}
+
+static int write_baseline(const char* path, const double* medians) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return 0;
+  }
+  fprintf(file, "{\n");
+  for (uint32_t i = 0; i < metric_count; ++i) {
+    fprintf(file, "  \"%s\": {\"value\": %.1f, \"tolerance\": %.2f}%s\n",
+            metric_names[i], medians[i], default_tolerances[i],
+            i + 1 < metric_count ? "," : "");
+  }
+  fprintf(file, "}\n");
+  return fclose(file) == 0;
+}
+
+int main(int argc, char** argv) {
+  uint32_t reps = 7;
+  int write_mode = 0;
+
+  int valid = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w")) != -1) {
+    switch (opt) {
+      case 'r':
+        reps = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        write_mode = 1;
+        break;
+      default:
+        valid = 0;
+        break;
+    }
+  }
+
+  if (!valid || optind != argc - 1 || reps == 0 || reps > MAX_REPS) {
+    fprintf(stderr, "Usage: %s [-r reps] [-w] baseline_file\n", argv[0]);
+    return 2;
+  }
+  const char* path = argv[optind];
+
+  baseline_entry baseline[metric_count] = {{0}};
+  if (!write_mode && !load_baseline(path, baseline)) {
+    fprintf(stderr, "Failed to read the baseline %s\n", path);
+    return 2;
+  }
+
+  double runs[metric_count][MAX_REPS];
+  for (uint32_t rep = 0; rep < reps; ++rep) {
+    double metrics[metric_count] = {0};
+    if (!measure_map(sizeof(uint64_t), metric_insert_8b_ns,
+                     metric_hit_lookup_8b_ns, metrics) ||
+        !measure_map(LONG_KEY_SIZE, metric_insert_32b_ns,
+                     metric_hit_lookup_32b_ns, metrics)) {
+      fprintf(stderr, "Failed to run the benchmarks\n");
+      return 2;
+    }
+    for (uint32_t i = 0; i < metric_count; ++i) {
+      runs[i][rep] = metrics[i];
+    }
+  }
+
+  double medians[metric_count];
+  for (uint32_t i = 0; i < metric_count; ++i) {
+    medians[i] = median_of(runs[i], reps);
+  }
+
+  if (write_mode) {
+    if (!write_baseline(path, medians)) {
+      fprintf(stderr, "Failed to write the baseline %s\n", path);
+      return 2;
+    }
+    return 0;
+  }
+
+  int regressions = 0;
+  printf("%-20s %12s %12s %8s  %s\n", "metric", "baseline", "median",
+         "change", "status");
+  for (uint32_t i = 0; i < metric_count; ++i) {
+    const baseline_entry* entry = &baseline[i];
+    if (!entry->present) {
+      printf("%-20s %12s %12.1f %8s  not in the baseline\n", metric_names[i],
+             "-", medians[i], "-");
+      continue;
+    }
+    double change = entry->value ? medians[i] / entry->value - 1 : 0;
+    int regressed = medians[i] > entry->value * (1 + entry->tolerance);
+    regressions += regressed;
+    printf("%-20s %12.1f %12.1f %+7.1f%%  %s\n", metric_names[i],
+           entry->value, medians[i], change * 100,
+           regressed ? "REGRESSION" : "ok");
+  }
+
+  if (regressions) {
+    printf("%d metric(s) regressed beyond their tolerance\n", regressions);
+  }
+
+  return regressions ? 1 : 0;
+}
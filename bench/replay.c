@@ -0,0 +1,231 @@
+// Replays a trace recorded with 'chmap_start_trace' against a fresh map, as
+// fast as it can rather than at the recorded pace, and prints the median time
+// every kind of call took over reps rounds as CSV. The keys get rebuilt from
+// their hashes: the first 8 bytes of a key hold the hash (or as much of it as
+// fits), and the rest is filler. The calls that return something else than
+// they did when recorded are counted as mismatches, which can only happen when
+// two keys shorter than 8 bytes end up the same.
+//
+// Usage: ./replay [-b initial_bucket_count] [-t resize_threads] [-o]
+//                 [-r reps] trace_file
+//   -o replays with the optimistic reads enabled.
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+#define MAX_REPS 101
+
+static const char* const op_names[chmap_trace_op_count] = {
+    "insert", "get_copy", "get_ref", "delete", "reset"};
+
+typedef struct replay_config {
+  uint32_t initial_bucket_count;
+  uint32_t resize_threads;
+  int optimistic;
+} replay_config;
+
+typedef struct replay_result {
+  uint64_t calls[chmap_trace_op_count];
+  uint64_t nsec[chmap_trace_op_count];
+  uint64_t mismatches[chmap_trace_op_count];
+} replay_result;
+
+typedef struct trace {
+  chmap_trace_record* records;
+  uint64_t record_count;
+  uint32_t max_key_size;
+  uint32_t max_val_size;
+} trace;
+
+static int load_trace(const char* path, trace* tr) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+
+  chmap_trace_header header;
+  int valid = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, CHMAP_TRACE_MAGIC, sizeof(header.magic)) ==
+                  0 &&
+              header.version == CHMAP_TRACE_VERSION &&
+              header.record_size == sizeof(chmap_trace_record);
+
+  uint64_t capacity = 1024;
+  tr->records = NULL;
+  tr->record_count = 0;
+  while (valid) {
+    if (!tr->records || tr->record_count == capacity) {
+      capacity *= 2;
+      chmap_trace_record* records =
+          realloc(tr->records, capacity * sizeof(chmap_trace_record));
+      if (!records) {
+        valid = 0;
+        break;
+      }
+      tr->records = records;
+    }
+    size_t read = fread(tr->records + tr->record_count,
+                        sizeof(chmap_trace_record),
+                        capacity - tr->record_count, file);
+    tr->record_count += read;
+    if (tr->record_count < capacity) {
+      // A record cut short at the end gets dropped.
+      valid = !ferror(file);
+      break;
+    }
+  }
+  fclose(file);
+
+  tr->max_key_size = sizeof(uint64_t);
+  tr->max_val_size = 1;
+  for (uint64_t i = 0; i < tr->record_count && valid; ++i) {
+    const chmap_trace_record* record = &tr->records[i];
+    valid = record->op < chmap_trace_op_count;
+    if (record->op == chmap_trace_reset) {
+      continue;
+    }
+    if (record->key_size > tr->max_key_size) {
+      tr->max_key_size = record->key_size;
+    }
+    if (record->val_size > tr->max_val_size) {
+      tr->max_val_size = record->val_size;
+    }
+  }
+
+  if (!valid) {
+    free(tr->records);
+  }
+  return valid;
+}
+
+static int replay_round(const trace* tr, const replay_config* config,
+                        unsigned char* key, unsigned char* val,
+                        replay_result* result) {
+  chashmap* chmap = chmap_create(config->initial_bucket_count, NULL);
+  if (!chmap ||
+      chmap_set_resize_threads(chmap, config->resize_threads) != chm_success ||
+      (config->optimistic &&
+       chmap_enable_optimistic_reads(chmap) != chm_success)) {
+    if (chmap) {
+      chmap_destroy(chmap);
+    }
+    return 0;
+  }
+
+  memset(result, 0, sizeof(*result));
+  for (uint64_t i = 0; i < tr->record_count; ++i) {
+    const chmap_trace_record* record = &tr->records[i];
+    chmap_pair key_pair = {.ptr = key, .size = record->key_size};
+    chmap_pair val_pair = {.ptr = val, .size = record->val_size};
+    chmap_pair* val_ref = NULL;
+    memcpy(key, &record->key_hash,
+           record->key_size < sizeof(uint64_t) ? record->key_size
+                                               : sizeof(uint64_t));
+
+    chashmap_retval_t retval = chm_success;
+    uint64_t start = now_in_ns();
+    switch (record->op) {
+      case chmap_trace_insert:
+        retval = chmap_insert_elem(chmap, &key_pair, &val_pair);
+        break;
+      case chmap_trace_get_copy:
+        retval = chmap_get_elem_copy(chmap, &key_pair, val, record->val_size);
+        break;
+      case chmap_trace_get_ref:
+        retval = chmap_get_elem_ref(chmap, &key_pair, &val_ref);
+        break;
+      case chmap_trace_delete:
+        retval = chmap_delete_elem(chmap, &key_pair);
+        break;
+      case chmap_trace_reset:
+        retval = chmap_reset(chmap, record->val_size);
+        break;
+    }
+    result->nsec[record->op] += now_in_ns() - start;
+    ++result->calls[record->op];
+    result->mismatches[record->op] += retval != record->result;
+  }
+
+  chmap_destroy(chmap);
+
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  replay_config config = {.initial_bucket_count = 1, .resize_threads = 1};
+  uint32_t reps = 3;
+
+  int valid = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:t:or:")) != -1) {
+    switch (opt) {
+      case 'b':
+        config.initial_bucket_count = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        config.resize_threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'o':
+        config.optimistic = 1;
+        break;
+      case 'r':
+        reps = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        valid = 0;
+        break;
+    }
+  }
+
+  if (!valid || optind != argc - 1 || !config.resize_threads || reps == 0 ||
+      reps > MAX_REPS) {
+    fprintf(stderr, "Usage: %s [-b initial_bucket_count] [-t resize_threads] "
+                    "[-o] [-r reps] trace_file\n",
+            argv[0]);
+    return 1;
+  }
+
+  trace tr;
+  if (!load_trace(argv[optind], &tr)) {
+    fprintf(stderr, "Failed to load the trace %s\n", argv[optind]);
+    return 1;
+  }
+
+  unsigned char* key = malloc(tr.max_key_size);
+  unsigned char* val = malloc(tr.max_val_size);
+  double mean_ns[chmap_trace_op_count][MAX_REPS];
+  replay_result result = {0};
+  int success = key && val;
+  if (success) {
+    init_key_buf(key, tr.max_key_size);
+    memset(val, 'v', tr.max_val_size);
+  }
+  for (uint32_t rep = 0; rep < reps && success; ++rep) {
+    success = replay_round(&tr, &config, key, val, &result);
+    for (uint32_t op = 0; op < chmap_trace_op_count; ++op) {
+      mean_ns[op][rep] =
+          result.calls[op] ? (double)result.nsec[op] / result.calls[op] : 0;
+    }
+  }
+
+  if (success) {
+    printf("op,calls,median_ns,mismatches\n");
+    for (uint32_t op = 0; op < chmap_trace_op_count; ++op) {
+      printf("%s,%lu,%.2f,%lu\n", op_names[op],
+             (unsigned long)result.calls[op], median_of(mean_ns[op], reps),
+             (unsigned long)result.mismatches[op]);
+    }
+  } else {
+    fprintf(stderr, "Failed to replay the trace\n");
+  }
+
+  free(key);
+  free(val);
+  free(tr.records);
+
+  return success ? 0 : 1;
+}
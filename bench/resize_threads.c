@@ -0,0 +1,56 @@
+// Measures how long a single scale up takes for a given element count, using
+// a varying number of resize threads.
+//
+// Usage: ./resize_threads [initial_bucket_count] [max_thread_count]
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_in_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static chashmap_retval_t insert_u64(chashmap* chmap, uint64_t key) {
+  return chmap_insert_elem(chmap,
+                           &(chmap_pair){.ptr = &key, .size = sizeof(key)},
+                           &(chmap_pair){.ptr = &key, .size = sizeof(key)});
+}
+
+int main(int argc, char** argv) {
+  uint32_t bucket_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 22;
+  uint32_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+
+  // The map scales up once the element count reaches 1.5 times the bucket
+  // count, that's the insert we are timing.
+  uint64_t elem_count = (uint64_t)bucket_count * 6 / 4;
+
+  printf("threads,elements,resize_ms\n");
+  for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+    chashmap* chmap = chmap_create(bucket_count, NULL);
+    if (!chmap || chmap_set_resize_threads(chmap, threads) != chm_success) {
+      fprintf(stderr, "Failed to create the map\n");
+      return 1;
+    }
+
+    for (uint64_t i = 0; i < elem_count - 1; ++i) {
+      if (insert_u64(chmap, i) != chm_success) {
+        fprintf(stderr, "Failed to insert\n");
+        return 1;
+      }
+    }
+
+    double start = now_in_ms();
+    insert_u64(chmap, elem_count - 1);
+    double elapsed = now_in_ms() - start;
+
+    printf("%u,%lu,%.2f\n", threads, (unsigned long)elem_count, elapsed);
+
+    chmap_destroy(chmap);
+  }
+
+  return 0;
+}
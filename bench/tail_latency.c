@@ -0,0 +1,221 @@
+// Times every single operation of three phases and prints the tail of the
+// latencies, since the averages hide the stalls of the resizes:
+//   grow:   inserts elem_count keys into a map created with the smallest bucket
+//           array, so it scales up over and over,
+//   shrink: deletes all of them again, so it scales down over and over,
+//   reset:  fills the map up and resets it, RESET_ROUNDS times.
+// The first CSV table has a row per phase, the second one a row per operation
+// that triggered a resize, with its latency. An operation triggered a resize
+// if the bucket count of the map changed across it.
+//
+// Usage: ./tail_latency [-n elem_count] [-v val_size] [-t resize_threads]
+
+#include <chashmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "workloads.h"
+
+#define RESET_ROUNDS 32
+
+typedef struct resize_event {
+  const char* phase;
+  uint64_t op_index;
+  uint32_t elem_count;
+  uint32_t bucket_count;
+  uint64_t latency_ns;
+} resize_event;
+
+typedef struct tail_bench {
+  uint64_t elem_count;
+  uint32_t val_size;
+  uint32_t resize_threads;
+  uint64_t* latencies;
+  resize_event* events;
+  uint32_t event_count;
+  uint32_t max_event_count;
+} tail_bench;
+
+static int compare_u64s(const void* a, const void* b) {
+  uint64_t ua = *(const uint64_t*)a;
+  uint64_t ub = *(const uint64_t*)b;
+  return (ua > ub) - (ua < ub);
+}
+
+// values should be sorted.
+static uint64_t percentile_of(const uint64_t* values, uint64_t count,
+                              double percentile) {
+  uint64_t rank = (uint64_t)(percentile / 100 * count);
+  return values[rank < count ? rank : count - 1];
+}
+
+static void note_resize(tail_bench* bench, chashmap* chmap, const char* phase,
+                        uint64_t op_index, uint64_t latency_ns) {
+  if (bench->event_count == bench->max_event_count) {
+    return;
+  }
+  bench->events[bench->event_count++] =
+      (resize_event){.phase = phase,
+                     .op_index = op_index,
+                     .elem_count = chmap_elem_count(chmap),
+                     .bucket_count = chmap_get_bucket_arr_size(chmap),
+                     .latency_ns = latency_ns};
+}
+
+// Sorts the latencies of the phase and prints its summary.
+static void print_phase(const char* phase, uint64_t* latencies, uint64_t count,
+                        uint32_t resizes) {
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    total += latencies[i];
+  }
+  qsort(latencies, count, sizeof(uint64_t), compare_u64s);
+  printf("%s,%lu,%.1f,%lu,%lu,%lu,%lu,%u\n", phase, (unsigned long)count,
+         (double)total / count,
+         (unsigned long)percentile_of(latencies, count, 50),
+         (unsigned long)percentile_of(latencies, count, 99),
+         (unsigned long)percentile_of(latencies, count, 99.99),
+         (unsigned long)latencies[count - 1], resizes);
+}
+
+static int run_grow_and_shrink(tail_bench* bench, chashmap* chmap,
+                               unsigned char* val) {
+  unsigned char key[WORKLOAD_MAX_KEY_SIZE];
+  chmap_pair key_pair = {.ptr = key};
+  chmap_pair val_pair = {.ptr = val, .size = bench->val_size};
+  key_set set;
+  key_set_init(&set, key_set_random, bench->elem_count, 0);
+  uint64_t n = bench->elem_count;
+
+  uint32_t first_event = bench->event_count;
+  uint32_t bucket_count = chmap_get_bucket_arr_size(chmap);
+  for (uint64_t i = 0; i < n; ++i) {
+    key_pair.size = key_set_key(&set, i, key);
+    uint64_t start = now_in_ns();
+    chashmap_retval_t result = chmap_insert_elem(chmap, &key_pair, &val_pair);
+    bench->latencies[i] = now_in_ns() - start;
+    if (result != chm_success) {
+      return 0;
+    }
+    if (chmap_get_bucket_arr_size(chmap) != bucket_count) {
+      bucket_count = chmap_get_bucket_arr_size(chmap);
+      note_resize(bench, chmap, "grow", i, bench->latencies[i]);
+    }
+  }
+  print_phase("grow", bench->latencies, n, bench->event_count - first_event);
+
+  first_event = bench->event_count;
+  uint64_t step = scatter_step(n);
+  for (uint64_t i = 0, j = 0; i < n; ++i, j = (j + step) % n) {
+    key_pair.size = key_set_key(&set, j, key);
+    uint64_t start = now_in_ns();
+    chashmap_retval_t result = chmap_delete_elem(chmap, &key_pair);
+    bench->latencies[i] = now_in_ns() - start;
+    if (result != chm_success) {
+      return 0;
+    }
+    if (chmap_get_bucket_arr_size(chmap) != bucket_count) {
+      bucket_count = chmap_get_bucket_arr_size(chmap);
+      note_resize(bench, chmap, "shrink", i, bench->latencies[i]);
+    }
+  }
+  print_phase("shrink", bench->latencies, n, bench->event_count - first_event);
+
+  return 1;
+}
+
+static int run_resets(tail_bench* bench, chashmap* chmap, unsigned char* val) {
+  uint64_t key = 0;
+  chmap_pair key_pair = {.ptr = &key, .size = sizeof(key)};
+  chmap_pair val_pair = {.ptr = val, .size = bench->val_size};
+
+  for (uint32_t round = 0; round < RESET_ROUNDS; ++round) {
+    for (key = 0; key < bench->elem_count; ++key) {
+      if (chmap_insert_elem(chmap, &key_pair, &val_pair) != chm_success) {
+        return 0;
+      }
+    }
+    uint64_t start = now_in_ns();
+    chashmap_retval_t result = chmap_reset(chmap, 0);
+    bench->latencies[round] = now_in_ns() - start;
+    if (result != chm_success) {
+      return 0;
+    }
+  }
+  print_phase("reset", bench->latencies, RESET_ROUNDS, 0);
+
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  tail_bench bench = {
+      .elem_count = 1000000, .val_size = 8, .resize_threads = 1};
+
+  int valid = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:v:t:")) != -1) {
+    switch (opt) {
+      case 'n':
+        bench.elem_count = strtoull(optarg, NULL, 10);
+        break;
+      case 'v':
+        bench.val_size = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        bench.resize_threads = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        valid = 0;
+        break;
+    }
+  }
+
+  if (!valid || bench.elem_count < RESET_ROUNDS ||
+      bench.elem_count > UINT32_MAX || !bench.val_size ||
+      !bench.resize_threads) {
+    fprintf(stderr, "Usage: %s [-n elem_count] [-v val_size] "
+                    "[-t resize_threads]\n",
+            argv[0]);
+    return 1;
+  }
+
+  // Every resize multiplies or divides the bucket count by 4, so a 32 bit
+  // bucket count can't go through more than 16 of each.
+  bench.max_event_count = 64;
+  bench.latencies = malloc(bench.elem_count * sizeof(uint64_t));
+  bench.events = malloc(bench.max_event_count * sizeof(resize_event));
+  unsigned char* val = malloc(bench.val_size);
+  chashmap* chmap = chmap_create(1, NULL);
+  int success = bench.latencies && bench.events && val && chmap &&
+                chmap_set_resize_threads(chmap, bench.resize_threads) ==
+                    chm_success;
+  if (success) {
+    memset(val, 'v', bench.val_size);
+    printf("phase,ops,mean_ns,p50_ns,p99_ns,p9999_ns,max_ns,resizes\n");
+    success = run_grow_and_shrink(&bench, chmap, val) &&
+              run_resets(&bench, chmap, val);
+  }
+
+  if (success) {
+    printf("\nphase,op_index,elements,buckets,latency_ns\n");
+    for (uint32_t i = 0; i < bench.event_count; ++i) {
+      const resize_event* event = &bench.events[i];
+      printf("%s,%lu,%u,%u,%lu\n", event->phase,
+             (unsigned long)event->op_index, event->elem_count,
+             event->bucket_count, (unsigned long)event->latency_ns);
+    }
+  } else {
+    fprintf(stderr, "Failed to run the benchmark\n");
+  }
+
+  if (chmap) {
+    chmap_destroy(chmap);
+  }
+  free(bench.latencies);
+  free(bench.events);
+  free(val);
+
+  return success ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+// Key sets and access distributions for the benchmarks. A key set decides
+// what the keys look like, which matters a lot since the keys of up to 8 bytes
+// are their own hash, and the longer ones go through DJB2. An access
+// distribution decides which of the keys get looked up, and how often.
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WORKLOAD_MAX_KEY_SIZE 128
+
+typedef enum key_set_kind {
+  // 0, 1, 2, ... as 8 byte integers
+  key_set_sequential,
+  // 0, stride, 2 * stride, ... as 8 byte integers, the way the IDs derived
+  // from addresses or page numbers tend to look
+  key_set_strided,
+  // Random (but distinct) 8 byte integers
+  key_set_random,
+  // UUID strings of 36 characters
+  key_set_uuid,
+  // URL like strings that share long prefixes
+  key_set_url,
+  // Strings that all have the same DJB2 hash
+  key_set_djb2_collisions,
+  key_set_kind_count
+} key_set_kind;
+
+static const char* const key_set_names[key_set_kind_count] = {
+    "sequential", "strided", "random", "uuid", "url", "djb2_collisions"};
+
+typedef enum access_kind {
+  access_uniform,
+  // A few keys get most of the accesses
+  access_zipf,
+  access_kind_count
+} access_kind;
+
+static const char* const access_names[access_kind_count] = {"uniform", "zipf"};
+
+typedef struct key_set {
+  key_set_kind kind;
+  uint64_t key_count;
+  uint64_t stride;
+  // The number of two character blocks of the colliding keys
+  uint32_t block_count;
+} key_set;
+
+typedef struct access_dist {
+  access_kind kind;
+  uint64_t key_count;
+  uint64_t rng_state;
+  // The state of the Zipf generator of Gray et al. ("Quickly generating
+  // billion-record synthetic databases"), the one YCSB uses.
+  double skew;
+  double zeta_n;
+  double alpha;
+  double eta;
+  double half_pow_skew;
+} access_dist;
+
+// splitmix64, it's a bijection, so distinct inputs give distinct outputs.
+static inline uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static inline uint64_t next_random(uint64_t* state) {
+  *state += 1;
+  return mix64(*state);
+}
+
+// A random number in [0, 1)
+static inline double next_random_double(uint64_t* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline void key_set_init(key_set* set, key_set_kind kind,
+                                uint64_t key_count, uint64_t stride) {
+  set->kind = kind;
+  set->key_count = key_count;
+  set->stride = stride ? stride : 64;
+  // Enough blocks to tell the keys apart, and more than 8 bytes so that the
+  // keys get hashed with DJB2 rather than used as numbers.
+  set->block_count = 5;
+  while (set->block_count < 64 &&
+         (1ULL << set->block_count) < set->key_count) {
+    ++set->block_count;
+  }
+}
+
+// Writes the key number i (0 <= i < key_count) into buf, which should hold
+// WORKLOAD_MAX_KEY_SIZE bytes, and returns its size.
+static inline uint32_t key_set_key(const key_set* set, uint64_t i,
+                                   unsigned char* buf) {
+  uint64_t num;
+  switch (set->kind) {
+    case key_set_sequential:
+      num = i;
+      break;
+    case key_set_strided:
+      num = i * set->stride;
+      break;
+    case key_set_random:
+      num = mix64(i);
+      break;
+    case key_set_uuid: {
+      uint64_t high = mix64(2 * i);
+      uint64_t low = mix64(2 * i + 1);
+      snprintf((char*)buf, WORKLOAD_MAX_KEY_SIZE,
+               "%08x-%04x-4%03x-%04x-%012llx", (uint32_t)(high >> 32),
+               (uint32_t)(high >> 16) & 0xffff, (uint32_t)high & 0xfff,
+               ((uint32_t)(low >> 48) & 0x3fff) | 0x8000,
+               (unsigned long long)(low & 0xffffffffffffULL));
+      return 36;
+    }
+    case key_set_url: {
+      static const char* prefixes[] = {
+          "https://www.example.com/api/v1/users/",
+          "https://www.example.com/api/v1/orders/",
+          "https://cdn.example.com/static/images/products/",
+          "https://www.example.com/blog/2024/posts/"};
+      return snprintf((char*)buf, WORKLOAD_MAX_KEY_SIZE, "%s%llu/details",
+                      prefixes[i % 4], (unsigned long long)(i / 4));
+    }
+    case key_set_djb2_collisions:
+      // 33 * 'e' + 'z' == 33 * 'f' + 'Y', so every string made of these two
+      // blocks has the same DJB2 hash as all the others of its length.
+      for (uint32_t b = 0; b < set->block_count; ++b) {
+        memcpy(buf + 2 * b, (i >> b) & 1 ? "fY" : "ez", 2);
+      }
+      return 2 * set->block_count;
+    default:
+      return 0;
+  }
+
+  memcpy(buf, &num, sizeof(num));
+  return sizeof(num);
+}
+
+// The skew of the Zipf distribution should be in (0, 1), 0.99 is the usual
+// choice.
+static inline void access_dist_init(access_dist* dist, access_kind kind,
+                                    uint64_t key_count, double skew,
+                                    uint64_t seed) {
+  memset(dist, 0, sizeof(*dist));
+  dist->kind = kind;
+  dist->key_count = key_count;
+  dist->rng_state = seed;
+
+  if (kind != access_zipf) {
+    return;
+  }
+
+  double zeta_2 = 1.0 + pow(0.5, skew);
+  dist->skew = skew;
+  for (uint64_t i = 1; i <= key_count; ++i) {
+    dist->zeta_n += pow((double)i, -skew);
+  }
+  dist->alpha = 1.0 / (1.0 - skew);
+  dist->eta = (1.0 - pow(2.0 / key_count, 1.0 - skew)) /
+              (1.0 - zeta_2 / dist->zeta_n);
+  dist->half_pow_skew = pow(0.5, skew);
+}
+
+// The number of the next key to access. With Zipf, the key 0 is the most
+// popular one, then comes 1 and so on.
+static inline uint64_t access_dist_next(access_dist* dist) {
+  if (dist->kind == access_uniform) {
+    return next_random(&dist->rng_state) % dist->key_count;
+  }
+
+  double u = next_random_double(&dist->rng_state);
+  double uz = u * dist->zeta_n;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + dist->half_pow_skew) {
+    return 1;
+  }
+  uint64_t i = (uint64_t)(dist->key_count *
+                          pow(dist->eta * u - dist->eta + 1.0, dist->alpha));
+  return i < dist->key_count ? i : dist->key_count - 1;
+}
@@ -36,6 +36,11 @@ SOFTWARE.
 #include <stdint.h>
 
 typedef struct chashmap chashmap;
+typedef struct chashmap_snapshot chashmap_snapshot;
+typedef struct chmap_ro chmap_ro;
+typedef struct chmap_frozen chmap_frozen;
+typedef struct chmap_shm chmap_shm;
+typedef struct chmap_wal chmap_wal;
 
 typedef struct chashmap_memmgmt_procs_t {
   void* (*malloc)(size_t size);
@@ -50,6 +55,10 @@ typedef struct chmap_pair {
 } chmap_pair;
 
 typedef enum chashmap_retval_t {
+  // The value lives in the value log, so there is no reference to it
+  chm_value_spilled = -5,
+  // Reading from or writing to a file failed
+  chm_io_error = -4,
   // The provided arguments are not valid
   chm_invalid_arguments = -3,
   // The provided key was not found
@@ -74,6 +83,11 @@ chashmap* chmap_create_mp(uint32_t initial_bucket_array_size,
 // in it. If chmap is NULL, this function will return 0;
 uint32_t chmap_elem_count(chashmap* chmap);
 
+// The function 'chmap_get_bucket_arr_size' returns the number of buckets the
+// map has at the moment, which changes as it scales up and down. If chmap is
+// NULL, this function will return 0.
+uint32_t chmap_get_bucket_arr_size(chashmap* chmap);
+
 // The function 'chmap_reset' can be used to clear a map by deleting the
 // existing elements from it. If the new_bucket_array_size is 0, the
 // bucket array size will not change, otherwise, the bucket array will
@@ -100,6 +114,7 @@ chashmap_retval_t chmap_get_elem_copy(chashmap* chmap,
 
 // This function gets a pointer to the element's value pair and stores it into
 // the pointer-to-pointer val_pair. Here, naturally, val_pair gets overwritten.
+// It returns chm_value_spilled if the value lives in the value log.
 chashmap_retval_t chmap_get_elem_ref(chashmap* chmap,
                                      const chmap_pair* key_pair,
                                      chmap_pair** val_pair);
@@ -118,6 +133,610 @@ void chmap_for_each_elem(chashmap* chmap,
                                           chmap_pair* val_pair, void* args),
                          void* args);
 
+// The function 'chmap_for_each_elem_parallel' does what 'chmap_for_each_elem'
+// does, using 'thread_count' threads (the calling thread included). The
+// bucket array gets split into small chunks, and every thread keeps grabbing
+// the next unprocessed chunk until none is left, so a few long chains don't
+// leave the rest of the threads idle. The callback gets called concurrently
+// for different elements, and the order is not defined. The map should not be
+// modified until this function returns.
+chashmap_retval_t chmap_for_each_elem_parallel(
+    chashmap* chmap, uint32_t thread_count,
+    void (*callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                    void* args),
+    void* args);
+
+// The per thread reduction hooks of 'chmap_for_each_elem_parallel_reduce'.
+// Every thread gets its own zero initialized accumulator of 'local_size'
+// bytes, which is passed to the callback as 'local'. If 'init' is not NULL,
+// it gets called on every accumulator before the walk starts. Once all the
+// threads are done, 'combine' gets called on every accumulator one by one,
+// on the calling thread, so that the results can be merged into 'args'
+// without any synchronization.
+typedef struct chmap_reducer {
+  size_t local_size;
+  void (*init)(void* local, void* args);
+  void (*combine)(void* local, void* args);
+} chmap_reducer;
+
+// The function 'chmap_for_each_elem_parallel_reduce' is the aggregating
+// flavour of 'chmap_for_each_elem_parallel', please see 'chmap_reducer'.
+chashmap_retval_t chmap_for_each_elem_parallel_reduce(
+    chashmap* chmap, uint32_t thread_count,
+    void (*callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                     void* local, void* args),
+    const chmap_reducer* reducer, void* args);
+
+// The function 'chmap_set_resize_threads' sets the number of threads (the
+// calling thread included) that relink the nodes when the map scales its
+// bucket array up or down. Large tables get split into disjoint bucket ranges
+// that the threads process independently, small ones are always relinked on
+// the calling thread. The default is 1, thread_count should not be 0.
+chashmap_retval_t chmap_set_resize_threads(chashmap* chmap,
+                                           uint32_t thread_count);
+
+// The function 'chmap_enable_optimistic_reads' switches the map into the
+// optimistic read mode, in which 'chmap_get_elem_copy' can be called from any
+// number of threads without any locks, while other threads keep calling
+// 'chmap_insert_elem', 'chmap_delete_elem' and 'chmap_reset'. The writers get
+// serialized by an internal mutex, and bump sequence counters around their
+// mutations. A reader validates those counters after copying the value out,
+// and retries if a writer got in its way. The rest of the functions
+// (e.g. 'chmap_get_elem_ref' and 'chmap_for_each_elem') are NOT covered, they
+// still need to be protected against the writers by the caller. This function
+// should be called before the map gets shared between threads.
+chashmap_retval_t chmap_enable_optimistic_reads(chashmap* chmap);
+
+// In the optimistic read mode, the memory areas that the readers might still
+// be looking at (deleted elements, replaced values, old bucket arrays) are
+// not freed right away. The function 'chmap_reclaim_retired' frees them, and
+// it should only be called when no 'chmap_get_elem_copy' call is in flight,
+// e.g. once per configuration reload. They are freed by 'chmap_destroy' too.
+void chmap_reclaim_retired(chashmap* chmap);
+
+// The function 'chmap_snapshot' returns a read-only view of the map, frozen
+// at the time of the call, while the map itself stays writable. Taking a
+// snapshot is O(1), nothing gets copied at that point. The entries are shared
+// between the map and its snapshots, and an entry that a snapshot can see is
+// copied (or kept aside, if it gets deleted) the first time the map modifies
+// it. The snapshots are not thread-safe with respect to the map, the caller
+// should not use a snapshot while another thread is modifying the map.
+// Modifying a value in place through 'chmap_get_elem_ref' or
+// 'chmap_for_each_elem' bypasses the copy-on-write, and WILL be visible to the
+// snapshots. Returns NULL on failure.
+chashmap_snapshot* chmap_snapshot(chashmap* chmap);
+
+// The function 'chmap_snapshot_elem_count' returns the number of elements the
+// map had when the snapshot was taken.
+uint32_t chmap_snapshot_elem_count(chashmap_snapshot* snap);
+
+// The function 'chmap_snapshot_get_elem_copy' is the snapshot flavour of
+// 'chmap_get_elem_copy'.
+chashmap_retval_t chmap_snapshot_get_elem_copy(chashmap_snapshot* snap,
+                                               const chmap_pair* key_pair,
+                                               void* target_buf,
+                                               uint32_t target_buf_size);
+
+// The function 'chmap_snapshot_for_each_elem' is the snapshot flavour of
+// 'chmap_for_each_elem'. The values are read-only this time.
+void chmap_snapshot_for_each_elem(chashmap_snapshot* snap,
+                                  void (*callback)(const chmap_pair* key_pair,
+                                                   const chmap_pair* val_pair,
+                                                  void* args),
+                                  void* args);
+
+// The function '__chmap_snapshot_release' is not meant to be used directly,
+// please use the macro 'chmap_snapshot_release' instead.
+void __chmap_snapshot_release(chashmap_snapshot* snap);
+
+// The macro 'chmap_snapshot_release' releases a snapshot, along with the
+// entries only it was keeping alive. The pointer then gets set to NULL. All
+// the snapshots of a map should be released before the map gets destroyed.
+#define chmap_snapshot_release(snap) \
+  do {                               \
+    __chmap_snapshot_release(snap);  \
+    snap = NULL;                     \
+  } while (0)
+
+// A published map is a wrapper for read-mostly tables, where a writer
+// rebuilds the contents off to the side from time to time, and many threads
+// look them up. The readers always see a complete map, and they never wait
+// for the writer. A map that gets published is owned by the wrapper, and it
+// SHOULD NOT be modified afterwards.
+typedef struct chmap_published chmap_published;
+typedef struct chmap_pub_reader chmap_pub_reader;
+
+// The function 'chmap_pub_create' wraps the initial map, and returns NULL on
+// failure. The err parameter works the same way it does for 'chmap_create'.
+chmap_published* chmap_pub_create(chashmap* initial, char** err);
+
+// Every reader thread should register itself once, and use the returned
+// handle for its reads. The handle should not be shared between threads.
+chmap_pub_reader* chmap_pub_register_reader(chmap_published* pub);
+void chmap_pub_unregister_reader(chmap_pub_reader* reader);
+
+// The function 'chmap_pub_read_lock' returns the current map, which stays
+// valid until 'chmap_pub_read_unlock' gets called. Only the read functions
+// (e.g. 'chmap_get_elem_copy') should be called on it. The reader only
+// writes to its own handle, and never blocks.
+chashmap* chmap_pub_read_lock(chmap_pub_reader* reader);
+void chmap_pub_read_unlock(chmap_pub_reader* reader);
+
+// The function 'chmap_pub_publish' atomically replaces the current map with
+// the next one, waits until no reader can be looking at the previous map
+// any more, and destroys it. The readers that lock after the swap get the
+// next map right away.
+chashmap_retval_t chmap_pub_publish(chmap_published* pub, chashmap* next);
+
+// The function '__chmap_pub_destroy' is not meant to be used directly,
+// please use the macro 'chmap_pub_destroy' instead. No reader should be
+// reading at that point, and the reader handles get freed too.
+void __chmap_pub_destroy(chmap_published* pub);
+
+// The macro 'chmap_pub_destroy' destroys a published map along with the map
+// it holds. The pointer then gets set to NULL.
+#define chmap_pub_destroy(pub) \
+  do {                         \
+    __chmap_pub_destroy(pub);  \
+    pub = NULL;                \
+  } while (0)
+
+// The function 'chmap_save' writes all the elements of the hash map to the
+// given file descriptor, along with a checksum. The descriptor does not need
+// to be seekable, so pipes and sockets work too. It returns chm_io_error if
+// a write fails.
+chashmap_retval_t chmap_save(chashmap* chmap, int fd);
+
+// The function 'chmap_load' creates a new hash map out of a stream written
+// by 'chmap_save'. The map gets sized for the stored element count up front,
+// and the stored hashes get reused, so no rehashing happens while loading.
+// It returns NULL if the stream is truncated, corrupted, or was written by
+// an incompatible build, and err points to the reason if it is not NULL.
+chashmap* chmap_load(int fd, chashmap_memmgmt_procs_t* mmgmt_procs,
+                     char** err);
+
+// The function 'chmap_load_parallel' loads the snapshot file at path like
+// 'chmap_load' does, using thread_count threads (the calling thread
+// included). The file gets mapped and split up by its chunks, the threads
+// parse the chunks and then link the nodes into disjoint ranges of the
+// bucket array. The allocator in mmgmt_procs, if any, gets called from all
+// the threads. The snapshots written before the format got chunked are
+// loaded on the calling thread. thread_count should not be 0.
+chashmap* chmap_load_parallel(const char* path, uint32_t thread_count,
+                              chashmap_memmgmt_procs_t* mmgmt_procs,
+                              char** err);
+
+// The function 'chmap_freeze_to_file' writes the hash map to the file at
+// path in a flat, offset based layout which 'chmap_ro_open' can map as is.
+// Nothing in the file is a pointer, so the file can be shared by any number
+// of processes through the page cache. The file gets written under path.tmp
+// and renamed over path, so a failed call leaves the previous file intact.
+chashmap_retval_t chmap_freeze_to_file(chashmap* chmap, const char* path);
+
+// The function 'chmap_ro_open' maps a file written by 'chmap_freeze_to_file'
+// and returns a read-only handle on it, NULL on failure. Only the header
+// gets checked, so opening takes the same time regardless of the file size.
+chmap_ro* chmap_ro_open(const char* path, char** err);
+
+// The function 'chmap_ro_elem_count' returns the number of elements in the
+// read-only map.
+uint64_t chmap_ro_elem_count(chmap_ro* ro);
+
+// The function 'chmap_ro_get_elem_ref' points val_pair into the mapping, so
+// nothing gets allocated or copied. The value stays valid until the handle
+// gets closed, and it SHOULD NOT be modified.
+chashmap_retval_t chmap_ro_get_elem_ref(chmap_ro* ro,
+                                        const chmap_pair* key_pair,
+                                        chmap_pair* val_pair);
+
+// The function 'chmap_ro_get_elem_copy' works the same way
+// 'chmap_get_elem_copy' does, on a read-only map.
+chashmap_retval_t chmap_ro_get_elem_copy(chmap_ro* ro,
+                                         const chmap_pair* key_pair,
+                                         void* target_buf,
+                                         uint32_t target_buf_size);
+
+// The function '__chmap_ro_close' is not meant to be used directly, please
+// use the macro 'chmap_ro_close' instead.
+void __chmap_ro_close(chmap_ro* ro);
+
+// The macro 'chmap_ro_close' unmaps a read-only map. The pointer then gets
+// set to NULL.
+#define chmap_ro_close(ro) \
+  do {                     \
+    __chmap_ro_close(ro);  \
+    ro = NULL;             \
+  } while (0)
+
+// The function 'chmap_freeze' builds an immutable copy of the hash map on a
+// minimal perfect hash, with the keys and the values packed one after the
+// other. Every lookup on it probes a single slot and compares a single key.
+// The source map is left untouched, and can be destroyed afterwards. It
+// returns NULL on failure, and err points to the reason if it is not NULL.
+chmap_frozen* chmap_freeze(chashmap* chmap, char** err);
+
+// The function 'chmap_frozen_elem_count' returns the number of elements in
+// the frozen map.
+uint32_t chmap_frozen_elem_count(chmap_frozen* frozen);
+
+// The function 'chmap_frozen_get_elem_ref' points val_pair to the value
+// stored in the frozen map. The value stays valid until the frozen map gets
+// destroyed, and it SHOULD NOT be modified.
+chashmap_retval_t chmap_frozen_get_elem_ref(chmap_frozen* frozen,
+                                            const chmap_pair* key_pair,
+                                            chmap_pair* val_pair);
+
+// The function 'chmap_frozen_get_elem_copy' works the same way
+// 'chmap_get_elem_copy' does, on a frozen map.
+chashmap_retval_t chmap_frozen_get_elem_copy(chmap_frozen* frozen,
+                                             const chmap_pair* key_pair,
+                                             void* target_buf,
+                                             uint32_t target_buf_size);
+
+typedef struct chmap_frozen_stats {
+  uint64_t elem_count;
+  // The bytes held by the frozen map
+  uint64_t frozen_bytes;
+  // The bytes the source map held when it got frozen, its buckets, nodes,
+  // pairs, keys and values
+  uint64_t source_bytes;
+  double frozen_bytes_per_entry;
+  double source_bytes_per_entry;
+} chmap_frozen_stats;
+
+// The function 'chmap_frozen_get_stats' compares the memory footprint of the
+// frozen map with the one of the map it got built from.
+chashmap_retval_t chmap_frozen_get_stats(chmap_frozen* frozen,
+                                         chmap_frozen_stats* stats);
+
+// The function '__chmap_frozen_destroy' is not meant to be used directly,
+// please use the macro 'chmap_frozen_destroy' instead.
+void __chmap_frozen_destroy(chmap_frozen* frozen);
+
+// The macro 'chmap_frozen_destroy' destroys a frozen map. The pointer then
+// gets set to NULL.
+#define chmap_frozen_destroy(frozen) \
+  do {                               \
+    __chmap_frozen_destroy(frozen);  \
+    frozen = NULL;                   \
+  } while (0)
+
+// A shared map keeps everything, the buckets, the nodes, the keys and the
+// values, inside a memory region provided by the caller, so that processes
+// which map the same region (e.g. through shm_open or memfd_create and
+// MAP_SHARED) work on a single copy. The region only holds offsets, so it
+// can be mapped at a different address in each process. The accesses are
+// serialized through a process-shared rwlock that lives in the region. The
+// lock is not robust: a process that dies while holding it (in the middle of
+// a call) leaves the map locked for all the others, and the region has to be
+// set up again with 'chmap_shm_create'.
+
+// The function 'chmap_shm_create' sets up an empty map in the region, which
+// SHOULD BE 8 byte aligned, and returns a handle for the calling process,
+// NULL on failure. The previous contents of the region are discarded.
+chmap_shm* chmap_shm_create(void* region, size_t region_size,
+                            uint32_t initial_bucket_array_size, char** err);
+
+// The function 'chmap_shm_attach' returns a handle on a map that another
+// process has created in the region. A child forked after the creation can
+// keep using the handle of its parent instead.
+chmap_shm* chmap_shm_attach(void* region, size_t region_size, char** err);
+
+// The function 'chmap_shm_insert_elem' works the same way
+// 'chmap_insert_elem' does. It returns chm_not_enough_memory once the region
+// is full.
+chashmap_retval_t chmap_shm_insert_elem(chmap_shm* shm,
+                                        const chmap_pair* key_pair,
+                                        const chmap_pair* val_pair);
+
+// The function 'chmap_shm_get_elem_copy' works the same way
+// 'chmap_get_elem_copy' does. There is no reference variant, as the value
+// could change as soon as the lock gets released.
+chashmap_retval_t chmap_shm_get_elem_copy(chmap_shm* shm,
+                                          const chmap_pair* key_pair,
+                                          void* target_buf,
+                                          uint32_t target_buf_size);
+
+// The function 'chmap_shm_delete_elem' works the same way
+// 'chmap_delete_elem' does, the memory goes back to the region.
+chashmap_retval_t chmap_shm_delete_elem(chmap_shm* shm,
+                                        const chmap_pair* key_pair);
+
+// The function 'chmap_shm_elem_count' returns the number of elements in the
+// shared map.
+uint32_t chmap_shm_elem_count(chmap_shm* shm);
+
+// The function '__chmap_shm_detach' is not meant to be used directly, please
+// use the macro 'chmap_shm_detach' instead.
+void __chmap_shm_detach(chmap_shm* shm);
+
+// The macro 'chmap_shm_detach' releases the handle of the calling process.
+// The region and the map in it are left alone, unmapping the region is up to
+// the caller. The pointer then gets set to NULL.
+#define chmap_shm_detach(shm) \
+  do {                        \
+    __chmap_shm_detach(shm);  \
+    shm = NULL;               \
+  } while (0)
+
+// The function 'chmap_snapshot_async' writes the map to path, in the format
+// of 'chmap_save', from a background thread. The file holds the contents the
+// map had when the function got called, while the map stays usable in the
+// meantime: a writer that modifies a bucket the background thread didn't
+// reach yet copies that bucket first, which only costs a memcpy of the
+// bucket. The map doesn't scale until the snapshot is done. The values
+// modified in place through 'chmap_get_elem_ref' are not covered.
+// The file gets written under a temporary name and renamed once it is
+// complete, then done_cb (if not NULL) gets called from the background
+// thread with the result, it should not touch the map. Only one such
+// snapshot can run at a time. Destroying the map waits for it to finish.
+chashmap_retval_t chmap_snapshot_async(
+    chashmap* chmap, const char* path,
+    void (*done_cb)(chashmap_retval_t result, void* args), void* args);
+
+// The write-ahead log makes a map durable. Every successful insert, delete
+// and reset appends a record to an in-memory buffer, and a background thread
+// writes the buffer to the log file and fdatasyncs it once per commit
+// interval, or earlier if enough bytes pile up. A crash loses at most the
+// last commit interval worth of mutations. The values modified in place
+// through 'chmap_get_elem_ref' do not get logged.
+typedef struct chmap_wal_options {
+  // How long a mutation may stay in memory before it gets synced, 0 means
+  // as soon as possible
+  uint32_t commit_interval_us;
+  // How many bytes may pile up before they get synced regardless of the
+  // interval, 0 means the default (1 MiB)
+  uint32_t commit_bytes;
+} chmap_wal_options;
+
+// The function 'chmap_wal_open' starts logging the mutations of chmap to
+// the log at log_path, appending to it if it already exists. The options
+// can be NULL for a 1 ms interval. It returns NULL on failure. Destroying
+// the map closes its log too.
+chmap_wal* chmap_wal_open(chashmap* chmap, const char* log_path,
+                          const chmap_wal_options* options, char** err);
+
+// The function 'chmap_wal_sync' returns once every mutation logged before
+// the call is on disk. It returns chm_io_error if the log could not be
+// written, the log then stops growing.
+chashmap_retval_t chmap_wal_sync(chmap_wal* wal);
+
+// The function 'chmap_wal_checkpoint' saves the map to snapshot_path
+// atomically, and then empties the log. The writers are blocked in the
+// meantime.
+chashmap_retval_t chmap_wal_checkpoint(chmap_wal* wal,
+                                       const char* snapshot_path);
+
+// The function 'chmap_wal_recover' loads the snapshot at snapshot_path (if
+// there is one), and replays the log at log_path on top of it. A torn
+// record at the end of the log gets dropped along with anything after it.
+// The log is not attached to the returned map, 'chmap_wal_open' does that.
+chashmap* chmap_wal_recover(const char* snapshot_path, const char* log_path,
+                            chashmap_memmgmt_procs_t* mmgmt_procs,
+                            char** err);
+
+// The function '__chmap_wal_close' is not meant to be used directly, please
+// use the macro 'chmap_wal_close' instead.
+void __chmap_wal_close(chmap_wal* wal);
+
+// The macro 'chmap_wal_close' syncs the log, stops logging and frees the
+// log. It SHOULD NOT be used after the map got destroyed, as that closes
+// the log already. The pointer then gets set to NULL.
+#define chmap_wal_close(wal) \
+  do {                       \
+    __chmap_wal_close(wal);  \
+    wal = NULL;              \
+  } while (0)
+
+// The value log keeps the large values out of memory. The values that are at
+// least spill_threshold bytes long get appended to a segment file, and the
+// map only keeps a small handle for them, 'chmap_get_elem_copy' reads them
+// back with pread. A background thread collects the segments that are mostly
+// garbage (deleted or replaced values), by moving their live values to the
+// current segment and deleting them. The segment files get unlinked as soon
+// as they're created, so the log does not outlive the map.
+typedef struct chmap_vlog_options {
+  // The size a value needs to have to get spilled, 0 means the default
+  // (1 KiB)
+  uint32_t spill_threshold;
+  // The size a segment may grow to before a new one gets started, 0 means
+  // the default (64 MiB)
+  uint64_t segment_size;
+  // How much of a segment (in percent) should be garbage before it gets
+  // collected, 0 means the default (50)
+  uint32_t gc_garbage_percent;
+} chmap_vlog_options;
+
+typedef struct chmap_vlog_stats {
+  // The values in the log, and their bytes
+  uint64_t live_values;
+  uint64_t live_bytes;
+  // The bytes the segments take up, garbage included
+  uint64_t disk_bytes;
+  uint32_t segment_count;
+  // The segments the collector deleted, and the bytes it moved to do that
+  uint64_t collected_segments;
+  uint64_t relocated_bytes;
+} chmap_vlog_stats;
+
+// The function 'chmap_enable_value_log' makes the map spill its large values
+// to segment files in dir, from the next insert on. The options can be NULL
+// for the defaults. The spilled values have no references, so
+// 'chmap_get_elem_ref' returns chm_value_spilled for them, and the
+// 'chmap_for_each_elem' callbacks get a copy of them. It can't be combined
+// with the optimistic read mode. It returns chm_io_error if no file can be
+// created in dir. Destroying the map removes the log too.
+chashmap_retval_t chmap_enable_value_log(chashmap* chmap, const char* dir,
+                                         const chmap_vlog_options* options);
+
+// The function 'chmap_get_value_log_stats' fills stats in with the state of
+// the value log of the map.
+chashmap_retval_t chmap_get_value_log_stats(chashmap* chmap,
+                                            chmap_vlog_stats* stats);
+
+// The function 'chmap_set_memory_limit' caps the bytes the map allocates for
+// its buckets and entries, node overheads included, at limit_bytes (0 lifts
+// the limit). An insert that would go over it first offers the entries to
+// evict_cb, bucket by bucket from where the previous round stopped, and
+// removes the ones it returns non-zero for, until there is room or every
+// bucket has been visited. Without evict_cb, or if nothing more can be
+// evicted, the insert fails with chm_not_enough_memory. The evictions reach
+// the mutation hooks as deletes. The entries a snapshot can still see are
+// not offered to evict_cb, as evicting them would free no memory. Growing the bucket array is not checked against the
+// limit, so the map can go over it by the size of one array. In the
+// optimistic read mode, the evicted and replaced entries stay allocated until
+// 'chmap_reclaim_retired', and they are left out of the limit meanwhile, so
+// the map only stays under it if the retired memory gets reclaimed.
+chashmap_retval_t chmap_set_memory_limit(
+    chashmap* chmap, uint64_t limit_bytes,
+    int (*evict_cb)(const chmap_pair* key_pair, const chmap_pair* val_pair,
+                    void* args),
+    void* args);
+
+typedef struct chmap_mem_stats {
+  // The bytes of the bucket array
+  uint64_t bucket_bytes;
+  // The bytes of the nodes and their key and value pairs
+  uint64_t node_bytes;
+  uint64_t key_bytes;
+  // A value that lives in the value log only takes up the size of its handle
+  uint64_t val_bytes;
+  // The sum of all the above
+  uint64_t total_bytes;
+  // The allocator calls made for the bucket arrays and the entries since the
+  // map got created, every entry takes five allocations
+  uint64_t alloc_calls;
+  uint64_t realloc_calls;
+  uint64_t free_calls;
+} chmap_mem_stats;
+
+// The function 'chmap_memory_usage' fills stats in with the memory the map
+// holds for its buckets and entries. The entries kept for the snapshots and
+// the ones waiting for 'chmap_reclaim_retired' are included, since they are
+// still allocated. The numbers are kept up to date as the map changes, so
+// this function doesn't walk the map.
+chashmap_retval_t chmap_memory_usage(chashmap* chmap, chmap_mem_stats* stats);
+
+// The chains of CHMAP_CHAIN_HISTOGRAM_LEN - 1 elements or more share the last
+// slot of the histogram.
+#define CHMAP_CHAIN_HISTOGRAM_LEN 16
+
+typedef struct chmap_stats {
+  uint32_t elem_count;
+  uint32_t bucket_count;
+  // chain_histogram[i] is the number of buckets with i elements
+  uint64_t chain_histogram[CHMAP_CHAIN_HISTOGRAM_LEN];
+  uint32_t max_chain_len;
+  // The mean length of the chains that are not empty, which is how many
+  // elements a successful lookup walks past, give or take a half
+  double mean_chain_len;
+  double empty_bucket_ratio;
+  // How many times the bucket array got resized, and how long it took in
+  // total
+  uint64_t scale_up_count;
+  uint64_t scale_down_count;
+  uint64_t scale_nsec;
+  // Only counted when the library gets built with CHMAP_PROBE_STATS defined:
+  // the lookups that found their key and the ones that did not, and the key
+  // comparisons each of them made on average.
+  uint64_t hit_lookups;
+  uint64_t miss_lookups;
+  double compares_per_hit;
+  double compares_per_miss;
+} chmap_stats;
+
+// The function 'chmap_get_stats' fills stats in with the shape of the chains
+// of the map and the work it did to keep them short. It walks the whole
+// bucket array, so it's meant for diagnostics rather than the hot path.
+chashmap_retval_t chmap_get_stats(chashmap* chmap, chmap_stats* stats);
+
+typedef enum chmap_latency_op {
+  chmap_latency_insert,
+  chmap_latency_get,
+  chmap_latency_delete,
+  // The bucket array getting scaled up or down
+  chmap_latency_resize,
+  chmap_latency_op_count
+} chmap_latency_op;
+
+typedef struct chmap_latency_stats {
+  uint64_t count;
+  uint64_t mean_nsec;
+  uint64_t max_nsec;
+  // The upper bounds of the histogram buckets the percentiles fall into,
+  // which are at most 12.5% off
+  uint64_t p50_nsec;
+  uint64_t p99_nsec;
+  uint64_t p999_nsec;
+} chmap_latency_stats;
+
+// When the library gets built with CHMAP_INSTRUMENT defined
+// ('make CHMAP_INSTRUMENT=1'), every map keeps a latency histogram per
+// operation, with 8 buckets per power of two nanoseconds. 'chmap_get_elem_copy'
+// and 'chmap_get_elem_ref' both count as gets. In the other builds nothing
+// gets measured, and the histograms stay empty.
+
+// The function 'chmap_get_latency_stats' fills stats in with the summary of
+// the histogram of op.
+chashmap_retval_t chmap_get_latency_stats(chashmap* chmap, chmap_latency_op op,
+                                          chmap_latency_stats* stats);
+
+// The function 'chmap_dump_latency' writes all the histograms to fd as text,
+// the summary of every operation followed by its non-empty buckets, one per
+// line. It returns chm_io_error if the write fails.
+chashmap_retval_t chmap_dump_latency(chashmap* chmap, int fd);
+
+// A trace is a chmap_trace_header followed by one chmap_trace_record per
+// call, in the byte order of the machine that recorded it. The keys are only
+// kept as a hash, so a trace tells what the workload looked like without
+// holding its data; 'bench/replay' runs one against any map configuration.
+#define CHMAP_TRACE_MAGIC "CHMTRACE"
+#define CHMAP_TRACE_VERSION 1
+
+typedef enum chmap_trace_op {
+  chmap_trace_insert,
+  chmap_trace_get_copy,
+  chmap_trace_get_ref,
+  chmap_trace_delete,
+  chmap_trace_reset,
+  chmap_trace_op_count
+} chmap_trace_op;
+
+typedef struct chmap_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} chmap_trace_header;
+
+typedef struct chmap_trace_record {
+  // The 64 bit FNV-1a hash of the key, 0 for the resets
+  uint64_t key_hash;
+  // The nanoseconds since the trace got started
+  uint64_t nsec;
+  uint32_t key_size;
+  // The value size of the inserts, the buffer size of 'chmap_get_elem_copy'
+  // and the new bucket array size of the resets
+  uint32_t val_size;
+  // A chmap_trace_op
+  uint8_t op;
+  // The chashmap_retval_t the call returned
+  int8_t result;
+  uint8_t reserved[6];
+} chmap_trace_record;
+
+// The function 'chmap_start_trace' starts recording every insert, get,
+// delete and reset call made on chmap to a new file at path, failed ones
+// included. The records get buffered, and written out whenever the buffer
+// fills up. It SHOULD NOT be called while other threads are using the map.
+// It returns chm_io_error if the file can't be created.
+chashmap_retval_t chmap_start_trace(chashmap* chmap, const char* path);
+
+// The function 'chmap_stop_trace' writes out the buffered records, and
+// closes the trace. It SHOULD NOT be called while other threads are using the
+// map. It returns chm_io_error if any of the records could not be written.
+// Destroying the map stops its trace too.
+chashmap_retval_t chmap_stop_trace(chashmap* chmap);
+
 // The function '_chmap_destroy' is not meant to be used directly, please use
 // the macro 'chmap_destroy' instead.
 void __chmap_destroy(chashmap* chmap);
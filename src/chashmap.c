@@ -22,63 +22,39 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#include <chashmap.h>
-#include <stdbool.h>
-#include <stdlib.h>
-#include <string.h>
-
-#define mem_alloc(size) malloc(size)
-#define mem_calloc(elem_count, elem_size) calloc(elem_count, elem_size)
-#define mem_realloc(ptr, new_size) realloc(ptr, new_size)
-#define mem_free(ptr) free(ptr)
-
-#define _mem_alloc(m_procs, size) \
-  (m_procs) ? m_procs->malloc(size) : mem_alloc(size)
-#define _mem_calloc(m_procs, e_count, e_size) \
-  (m_procs) ? m_procs->calloc(e_count, e_size) : mem_calloc(e_count, e_size)
-#define _mem_realloc(m_procs, ptr, new_size) \
-  (m_procs) ? m_procs->realloc(ptr, new_size) : mem_realloc(ptr, new_size)
-#define _mem_free(m_procs, ptr) (m_procs) ? m_procs->free(ptr) : mem_free(ptr)
-
-#define stringify(s) #s
-#define x_stringify(s) stringify(s)
-#define CERR_STR(x) (__FILE__ ":" x_stringify(__LINE__) " - " x)
+#include "chashmap_internal.h"
+
+#include <sched.h>
+#include <time.h>
 
 const uint32_t minimum_allowed_bucket_array_size = 64;
 const uint32_t scale_factor = 4;
 const uint32_t minimum_scale_down_threshold =
     scale_factor * minimum_allowed_bucket_array_size;
 
-static inline void mem_assign(void* dest, void* src, uint32_t size) {
-  if (size == sizeof(unsigned int)) {
-    *(unsigned int*)dest = *(unsigned int*)src;
-  } else if (size == sizeof(unsigned long)) {
-    *(unsigned long*)dest = *(unsigned long*)src;
-  } else if (size == sizeof(unsigned char)) {
-    *(unsigned char*)dest = *(unsigned char*)src;
-  } else if (size == sizeof(unsigned short)) {
-    *(unsigned short*)dest = *(unsigned short*)src;
-  } else {
-    memcpy(dest, src, size);
-  }
+static inline void seqlock_write_begin(uint32_t* seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-typedef struct chmap_entry {
-  unsigned long hash_val;
-  chmap_pair* key_pair;
-  chmap_pair* val_pair;
-  chashmap_memmgmt_procs_t* m_procs;
-} chmap_entry;
+static inline void seqlock_write_end(uint32_t* seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
 
-typedef struct llist_node llist_node;
+static inline uint32_t seqlock_read_begin(const uint32_t* seq) {
+  uint32_t start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+  while (start & 1) {
+    // A writer is in the middle of an update, wait for it.
+    sched_yield();
+    start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+  }
+  return start;
+}
 
-typedef struct dllist_ref_node {
-  // All these pointers are mere references,
-  // and they are not 'owned' by this struct
-  struct dllist_ref_node* prev;
-  struct dllist_ref_node* next;
-  llist_node* host;
-} dllist_ref_node;
+static inline bool seqlock_read_retry(const uint32_t* seq, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
 
 void attach_node_to_dllist(dllist_ref_node** head, dllist_ref_node* node,
                            llist_node* host) {
@@ -108,21 +84,30 @@ void detach_node_from_dllist(dllist_ref_node** head, dllist_ref_node* node) {
   }
 }
 
-struct llist_node {
-  struct llist_node* next;
-  dllist_ref_node dllist_refs;
-  chmap_entry data;
-  chashmap_memmgmt_procs_t* m_procs;
-};
-
-void destroy_llist_node(dllist_ref_node** head_of_all_elems, llist_node* elem) {
+void destroy_llist_node(chmap_mem_usage* usage,
+                        dllist_ref_node** head_of_all_elems, llist_node* elem) {
   if (elem) {
-    if (elem->m_procs) {
-      void (*free_func)(void*) = elem->m_procs->free;
+    chmap_versions* versions = entry_versions(&elem->data);
+    if (usage) {
+      usage->node_bytes -= NODE_OVERHEAD_BYTES;
+      usage->key_bytes -= elem->data.key_pair->size;
+      usage->val_bytes -= elem->data.val_pair->size;
+      usage->free_calls += NODE_ALLOC_COUNT;
+      if (versions) {
+        usage->node_bytes -= sizeof(chmap_versions);
+        ++usage->free_calls;
+      }
+    }
+    if (entry_spilled(&elem->data)) {
+      vlog_release((chmap_vlog_ref*)elem->data.val_pair->ptr);
+    }
+    if (elem->data.m_procs) {
+      void (*free_func)(void*) = elem->data.m_procs->free;
       if (elem->data.key_pair->ptr) free_func(elem->data.key_pair->ptr);
       if (elem->data.key_pair) free_func(elem->data.key_pair);
       if (elem->data.val_pair->ptr) free_func(elem->data.val_pair->ptr);
       if (elem->data.val_pair) free_func(elem->data.val_pair);
+      if (versions) free_func(versions);
       if (head_of_all_elems) {
         detach_node_from_dllist(head_of_all_elems, &elem->dllist_refs);
       }
@@ -132,6 +117,7 @@ void destroy_llist_node(dllist_ref_node** head_of_all_elems, llist_node* elem) {
       if (elem->data.key_pair) mem_free(elem->data.key_pair);
       if (elem->data.val_pair->ptr) mem_free(elem->data.val_pair->ptr);
       if (elem->data.val_pair) mem_free(elem->data.val_pair);
+      if (versions) mem_free(versions);
       if (head_of_all_elems) {
         detach_node_from_dllist(head_of_all_elems, &elem->dllist_refs);
       }
@@ -140,46 +126,49 @@ void destroy_llist_node(dllist_ref_node** head_of_all_elems, llist_node* elem) {
   }
 }
 
-llist_node* create_llist_node(dllist_ref_node** head_of_all_elems,
+llist_node* create_llist_node(chmap_mem_usage* usage,
+                              dllist_ref_node** head_of_all_elems,
                               chmap_entry* data) {
   llist_node* new_elem =
       (llist_node*)_mem_calloc(data->m_procs, 1, sizeof(llist_node));
   if (!new_elem) {
     return NULL;
   }
-  new_elem->m_procs = data->m_procs;
+  new_elem->data.m_procs = data->m_procs;
 
   new_elem->data.key_pair =
       (chmap_pair*)_mem_alloc(data->m_procs, sizeof(chmap_pair));
   if (!new_elem->data.key_pair) {
-    destroy_llist_node(head_of_all_elems, new_elem);
+    destroy_llist_node(NULL, head_of_all_elems, new_elem);
     return NULL;
   }
 
   new_elem->data.val_pair =
       (chmap_pair*)_mem_alloc(data->m_procs, sizeof(chmap_pair));
   if (!new_elem->data.val_pair) {
-    destroy_llist_node(head_of_all_elems, new_elem);
+    destroy_llist_node(NULL, head_of_all_elems, new_elem);
     return NULL;
   }
 
   new_elem->data.key_pair->ptr =
       _mem_alloc(data->m_procs, data->key_pair->size);
   if (!new_elem->data.key_pair->ptr) {
-    destroy_llist_node(head_of_all_elems, new_elem);
+    destroy_llist_node(NULL, head_of_all_elems, new_elem);
     return NULL;
   }
 
   new_elem->data.val_pair->ptr =
       _mem_alloc(data->m_procs, data->val_pair->size);
   if (!new_elem->data.val_pair->ptr) {
-    destroy_llist_node(head_of_all_elems, new_elem);
+    destroy_llist_node(NULL, head_of_all_elems, new_elem);
     return NULL;
   }
 
   attach_node_to_dllist(head_of_all_elems, &new_elem->dllist_refs, new_elem);
   new_elem->next = NULL;
   new_elem->data.hash_val = data->hash_val;
+  // The versions are owned by the node from here on
+  new_elem->data.versions_and_flags = data->versions_and_flags;
   new_elem->data.key_pair->size = data->key_pair->size;
   new_elem->data.val_pair->size = data->val_pair->size;
   mem_assign(new_elem->data.key_pair->ptr, data->key_pair->ptr,
@@ -187,6 +176,17 @@ llist_node* create_llist_node(dllist_ref_node** head_of_all_elems,
   mem_assign(new_elem->data.val_pair->ptr, data->val_pair->ptr,
              data->val_pair->size);
 
+  if (usage) {
+    usage->node_bytes += NODE_OVERHEAD_BYTES;
+    usage->key_bytes += data->key_pair->size;
+    usage->val_bytes += data->val_pair->size;
+    usage->alloc_calls += NODE_ALLOC_COUNT;
+    if (entry_versions(data)) {
+      usage->node_bytes += sizeof(chmap_versions);
+      ++usage->alloc_calls;
+    }
+  }
+
   return new_elem;
 }
 
@@ -202,7 +202,8 @@ bool reset_val_of_llist_node(llist_node* elem, const chmap_pair* val_pair) {
     void* orig_buf = elem->data.val_pair->ptr;
 
     elem->data.val_pair->ptr =
-        _mem_realloc(elem->m_procs, elem->data.val_pair->ptr, val_pair->size);
+        _mem_realloc(elem->data.m_procs, elem->data.val_pair->ptr,
+                     val_pair->size);
     if (!elem->data.val_pair->ptr) {
       // Failed to reallocate.
       elem->data.val_pair->ptr = orig_buf;
@@ -217,10 +218,10 @@ bool reset_val_of_llist_node(llist_node* elem, const chmap_pair* val_pair) {
   return success;
 }
 
-llist_node* insert_into_llist(llist_node* head,
+llist_node* insert_into_llist(llist_node* head, chmap_mem_usage* usage,
                               dllist_ref_node** head_of_all_elems,
                               chmap_entry* data, bool* success) {
-  llist_node* new_elem = create_llist_node(head_of_all_elems, data);
+  llist_node* new_elem = create_llist_node(usage, head_of_all_elems, data);
   if (!new_elem) {
     *success = false;
     return head;
@@ -284,37 +285,35 @@ llist_node* find_in_llist(llist_node* head, const chmap_pair* key_pair) {
   return tracker;
 }
 
-llist_node* destroy_the_whole_llist(llist_node* head,
+llist_node* destroy_the_whole_llist(llist_node* head, chmap_mem_usage* usage,
                                     dllist_ref_node** head_of_all_elems) {
   llist_node* tracker = head;
 
   while (tracker) {
     llist_node* node_to_be_deleted = tracker;
     tracker = tracker->next;
-    destroy_llist_node(head_of_all_elems, node_to_be_deleted);
+    destroy_llist_node(usage, head_of_all_elems, node_to_be_deleted);
   }
 
   return tracker;
 }
 
-llist_node* delete_from_llist(llist_node* head,
-                              dllist_ref_node** head_of_all_elems,
-                              const chmap_pair* key_pair, bool* found) {
-  *found = false;
+llist_node* unlink_from_llist(llist_node* head, const chmap_pair* key_pair,
+                              llist_node** unlinked) {
+  *unlinked = NULL;
   llist_node* tracker = head;
   llist_node* previous = NULL;
 
   while (tracker) {
     if (tracker->data.key_pair->size == key_pair->size) {
       if (compare_key_pairs(tracker->data.key_pair, key_pair)) {
-        // This is the node to be deleted
-        *found = true;
+        // This is the node to be unlinked
+        *unlinked = tracker;
         if (!previous) {
           head = tracker->next;
         } else {
           previous->next = tracker->next;
         }
-        destroy_llist_node(head_of_all_elems, tracker);
 
         return head;
       }
@@ -327,15 +326,440 @@ llist_node* delete_from_llist(llist_node* head,
   return head;
 }
 
-struct chashmap {
-  uint32_t elem_count;
-  uint32_t bucket_arr_size;
-  uint32_t elem_count_to_scale_up;
-  uint32_t elem_count_to_scale_down;
-  llist_node** bucket_arr;
-  dllist_ref_node* head_of_all_elems;
-  chashmap_memmgmt_procs_t* m_procs;
-};
+llist_node* replace_in_llist(llist_node* head, llist_node* old_node,
+                             llist_node* new_node) {
+  new_node->next = old_node->next;
+
+  if (head == old_node) {
+    return new_node;
+  }
+
+  llist_node* tracker = head;
+  while (tracker->next != old_node) {
+    tracker = tracker->next;
+  }
+  __atomic_store_n(&tracker->next, new_node, __ATOMIC_RELEASE);
+
+  return head;
+}
+
+llist_node* find_in_llist_optimistic(llist_node* head,
+                                     const chmap_pair* key_pair) {
+  llist_node* tracker = head;
+  while (tracker) {
+    if (compare_key_pairs(tracker->data.key_pair, key_pair)) {
+      return tracker;
+    }
+    tracker = __atomic_load_n(&tracker->next, __ATOMIC_ACQUIRE);
+  }
+
+  return tracker;
+}
+
+#if defined(CHMAP_PROBE_STATS) || defined(CHMAP_USDT)
+// The lookups walk the chains here, so that the comparisons they make get
+// counted, and the long walks get traced.
+llist_node* find_in_llist_probed(chashmap* chmap, llist_node* head,
+                                 const chmap_pair* key_pair) {
+  uint64_t compares = 0;
+  llist_node* tracker = head;
+  while (tracker) {
+    ++compares;
+    if (compare_key_pairs(tracker->data.key_pair, key_pair)) {
+      break;
+    }
+    tracker = __atomic_load_n(&tracker->next, __ATOMIC_ACQUIRE);
+  }
+
+#ifdef CHMAP_PROBE_STATS
+  chmap_op_counters* counters = &chmap->counters;
+  __atomic_fetch_add(tracker ? &counters->hit_lookups : &counters->miss_lookups,
+                     1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(
+      tracker ? &counters->hit_compares : &counters->miss_compares, compares,
+      __ATOMIC_RELAXED);
+#endif
+
+#ifdef CHMAP_USDT
+  if (compares > CHMAP_USDT_LONG_CHAIN) {
+    USDT_PROBE3(long_chain, chmap, compares, tracker != NULL);
+  }
+#endif
+
+  return tracker;
+}
+
+#ifdef CHMAP_USDT
+// Counts the nodes it walks past, so that an insert can trace the chain it
+// lengthens without walking it again.
+llist_node* find_in_llist_counted(llist_node* head, const chmap_pair* key_pair,
+                                  uint32_t* walked) {
+  llist_node* tracker = head;
+  while (tracker) {
+    ++*walked;
+    if (compare_key_pairs(tracker->data.key_pair, key_pair)) {
+      return tracker;
+    }
+    tracker = tracker->next;
+  }
+
+  return tracker;
+}
+#endif
+
+#define lookup_in_llist(chmap, head, key_pair) \
+  find_in_llist_probed(chmap, head, key_pair)
+#define lookup_in_llist_optimistic(chmap, head, key_pair) \
+  find_in_llist_probed(chmap, head, key_pair)
+#else
+#define lookup_in_llist(chmap, head, key_pair) find_in_llist(head, key_pair)
+#define lookup_in_llist_optimistic(chmap, head, key_pair) \
+  find_in_llist_optimistic(head, key_pair)
+#endif
+
+const uint32_t initial_history_arr_size = 64;
+
+// Should be called once the node is detached from the list it was on.
+static inline void push_retired_node(chashmap* chmap, llist_node* elem) {
+  elem->dllist_refs.prev = NULL;
+  elem->dllist_refs.next = chmap->seqlock->retired_nodes;
+  chmap->seqlock->retired_nodes = &elem->dllist_refs;
+  chmap->seqlock->retired_bytes +=
+      NODE_OVERHEAD_BYTES + elem->data.key_pair->size +
+      elem->data.val_pair->size +
+      (entry_versions(&elem->data) ? sizeof(chmap_versions) : 0);
+}
+
+void retire_llist_node(chashmap* chmap, llist_node* elem) {
+  detach_node_from_dllist(&chmap->head_of_all_elems, &elem->dllist_refs);
+  push_retired_node(chmap, elem);
+}
+
+bool retire_mem(chashmap* chmap, void* ptr, void* aux) {
+  retired_mem* r =
+      (retired_mem*)_mem_alloc(chmap->m_procs, sizeof(retired_mem));
+  if (!r) {
+    return false;
+  }
+
+  r->ptr = ptr;
+  r->aux = aux;
+  r->next = chmap->seqlock->retired_mem;
+  chmap->seqlock->retired_mem = r;
+  if (aux) {
+    chmap->seqlock->retired_bytes +=
+        sizeof(chmap_pair) + ((chmap_pair*)aux)->size;
+  }
+
+  return true;
+}
+
+void free_retired(chashmap* chmap) {
+  dllist_ref_node* node = chmap->seqlock->retired_nodes;
+  while (node) {
+    dllist_ref_node* next = node->next;
+    destroy_llist_node(&chmap->mem_usage, NULL, node->host);
+    node = next;
+  }
+  chmap->seqlock->retired_nodes = NULL;
+
+  retired_mem* r = chmap->seqlock->retired_mem;
+  while (r) {
+    retired_mem* next = r->next;
+    if (r->aux) {
+      // A value pair replaced by 'reset_val_of_llist_node_optimistic'
+      chmap->mem_usage.node_bytes -= sizeof(chmap_pair);
+      chmap->mem_usage.val_bytes -= ((chmap_pair*)r->aux)->size;
+      chmap->mem_usage.free_calls += 2;
+    } else {
+      // A bucket array
+      ++chmap->mem_usage.free_calls;
+    }
+    if (r->ptr) _mem_free(chmap->m_procs, r->ptr);
+    if (r->aux) _mem_free(chmap->m_procs, r->aux);
+    _mem_free(chmap->m_procs, r);
+    r = next;
+  }
+  chmap->seqlock->retired_mem = NULL;
+  chmap->seqlock->retired_bytes = 0;
+}
+
+// Replaces the value of a node without touching the buffer the optimistic
+// readers might be copying from. A new pair gets published, and the old one
+// gets retired.
+bool reset_val_of_llist_node_optimistic(chashmap* chmap, llist_node* elem,
+                                        const chmap_pair* val_pair) {
+  chmap_pair* new_pair =
+      (chmap_pair*)_mem_alloc(chmap->m_procs, sizeof(chmap_pair));
+  if (!new_pair) {
+    return false;
+  }
+
+  new_pair->ptr = _mem_alloc(chmap->m_procs, val_pair->size);
+  if (!new_pair->ptr) {
+    _mem_free(chmap->m_procs, new_pair);
+    return false;
+  }
+
+  chmap_pair* old_pair = elem->data.val_pair;
+  if (!retire_mem(chmap, old_pair->ptr, old_pair)) {
+    _mem_free(chmap->m_procs, new_pair->ptr);
+    _mem_free(chmap->m_procs, new_pair);
+    return false;
+  }
+
+  mem_assign(new_pair->ptr, val_pair->ptr, val_pair->size);
+  new_pair->size = val_pair->size;
+  __atomic_store_n(&elem->data.val_pair, new_pair, __ATOMIC_RELEASE);
+  // The old pair is accounted for until it gets freed
+  chmap->mem_usage.node_bytes += sizeof(chmap_pair);
+  chmap->mem_usage.val_bytes += val_pair->size;
+  chmap->mem_usage.alloc_calls += 2;
+
+  return true;
+}
+
+static inline uint32_t created_version(const llist_node* elem) {
+  const chmap_versions* versions = entry_versions(&elem->data);
+  return versions ? versions->created : 0;
+}
+
+static inline bool visible_to_snapshot(const llist_node* elem,
+                                       uint32_t version, bool in_history) {
+  // The entries in the history always have their versions
+  return created_version(elem) <= version &&
+         (!in_history || version < entry_versions(&elem->data)->deleted);
+}
+
+bool needed_by_a_snapshot(chashmap* chmap, const llist_node* elem,
+                          bool in_history) {
+  if (!chmap->snapshots) {
+    return false;
+  }
+
+  if (!in_history) {
+    // A live entry is visible to every snapshot not older than itself.
+    return chmap->snapshots->newest &&
+           created_version(elem) <= chmap->snapshots->newest->version;
+  }
+
+  for (chashmap_snapshot* snap = chmap->snapshots->oldest; snap;
+       snap = snap->next) {
+    if (visible_to_snapshot(elem, snap->version, true)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// The versions for an entry created now, NULL without an error if there are
+// no snapshots to tell it apart for.
+static inline bool new_versions(chashmap* chmap, chmap_versions** versions) {
+  *versions = NULL;
+  if (!chmap->snapshots || !chmap->snapshots->newest) {
+    return true;
+  }
+
+  *versions =
+      (chmap_versions*)_mem_alloc(chmap->m_procs, sizeof(chmap_versions));
+  if (!*versions) {
+    return false;
+  }
+  (*versions)->created = chmap->version;
+  (*versions)->deleted = 0;
+
+  return true;
+}
+
+void release_spare_versions(chashmap* chmap) {
+  chmap_snapshot_state* state = chmap->snapshots;
+  while (state->spare_versions) {
+    chmap_versions* next = state->spare_versions->next_spare;
+    _mem_free(chmap->m_procs, state->spare_versions);
+    ++chmap->mem_usage.free_calls;
+    state->spare_versions = next;
+  }
+  state->spare_count = 0;
+}
+
+// Makes sure that 'count' more entries can be moved into the history without
+// any allocation failures along the way.
+bool reserve_history(chashmap* chmap, uint32_t count) {
+  chmap_snapshot_state* state = chmap->snapshots;
+
+  // Nothing moves into the history without a snapshot to keep it for
+  while (state->newest && state->spare_count < count) {
+    chmap_versions* spare =
+        (chmap_versions*)_mem_alloc(chmap->m_procs, sizeof(chmap_versions));
+    if (!spare) {
+      return false;
+    }
+    ++chmap->mem_usage.alloc_calls;
+    spare->next_spare = state->spare_versions;
+    state->spare_versions = spare;
+    ++state->spare_count;
+  }
+  uint64_t needed = (uint64_t)state->history_count + count;
+  uint32_t new_size = state->history_arr_size;
+
+  if (new_size == 0) {
+    new_size = initial_history_arr_size;
+  }
+  while (needed > (uint64_t)new_size * 6 / 4 && new_size < (1U << 31)) {
+    new_size *= scale_factor;
+  }
+
+  if (new_size == state->history_arr_size) {
+    return true;
+  }
+
+  llist_node** new_arr =
+      (llist_node**)_mem_calloc(chmap->m_procs, new_size, sizeof(llist_node*));
+  if (!new_arr) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < state->history_arr_size; ++i) {
+    llist_node* tracker = state->history_arr[i];
+    while (tracker) {
+      llist_node* next = tracker->next;
+      uint32_t new_index = tracker->data.hash_val % new_size;
+      new_arr[new_index] =
+          migrate_llist_node_to_another_llist(new_arr[new_index], NULL, tracker);
+      tracker = next;
+    }
+  }
+
+  if (state->history_arr) {
+    _mem_free(chmap->m_procs, state->history_arr);
+  }
+  state->history_arr = new_arr;
+  state->history_arr_size = new_size;
+
+  return true;
+}
+
+// Expects the node to be unlinked from its chain already, and the history to
+// be reserved. An optimistic reader might be standing on this node, and its
+// 'next' is about to point into the history, so the callers should hold the
+// resize sequence counter in the optimistic read mode (see 'stripe_seq_for').
+void move_llist_node_to_history(chashmap* chmap, llist_node* elem) {
+  chmap_snapshot_state* state = chmap->snapshots;
+
+  detach_node_from_dllist(&chmap->head_of_all_elems, &elem->dllist_refs);
+  attach_node_to_dllist(&state->head_of_history, &elem->dllist_refs, elem);
+  chmap_versions* versions = entry_versions(&elem->data);
+  if (!versions) {
+    // Created before all the snapshots
+    versions = state->spare_versions;
+    state->spare_versions = versions->next_spare;
+    --state->spare_count;
+    versions->created = 0;
+    set_entry_versions(&elem->data, versions);
+    chmap->mem_usage.node_bytes += sizeof(chmap_versions);
+  }
+  versions->deleted = chmap->version;
+
+  uint32_t index = elem->data.hash_val % state->history_arr_size;
+  state->history_arr[index] = migrate_llist_node_to_another_llist(
+      state->history_arr[index], NULL, elem);
+  ++state->history_count;
+}
+
+// Returns the sequence counter a writer should bump around a mutation of the
+// entry with the given hash, NULL if the map is not in the optimistic read
+// mode. If there are snapshots, the mutation might move nodes into the
+// history, which can lead a reader of any stripe astray.
+uint32_t* stripe_seq_for(chashmap* chmap, unsigned long hash) {
+  if (!chmap->seqlock) {
+    return NULL;
+  }
+
+  if (chmap->snapshots && chmap->snapshots->newest) {
+    return &chmap->seqlock->resize_seq;
+  }
+
+  return &chmap->seqlock->stripe_seqs[hash % SEQLOCK_STRIPE_COUNT];
+}
+
+// Gets rid of a node that is no longer a part of the live map. It is kept
+// for the snapshots if any of them can see it, otherwise it gets retired for
+// the optimistic readers, or simply destroyed.
+void discard_llist_node(chashmap* chmap, llist_node* elem) {
+  if (needed_by_a_snapshot(chmap, elem, false)) {
+    move_llist_node_to_history(chmap, elem);
+  } else if (chmap->seqlock) {
+    retire_llist_node(chmap, elem);
+  } else {
+    destroy_llist_node(&chmap->mem_usage, &chmap->head_of_all_elems, elem);
+  }
+}
+
+// Frees the history entries that none of the remaining snapshots can see.
+void prune_history(chashmap* chmap) {
+  chmap_snapshot_state* state = chmap->snapshots;
+
+  for (uint32_t i = 0; i < state->history_arr_size; ++i) {
+    llist_node* tracker = state->history_arr[i];
+    llist_node* previous = NULL;
+    while (tracker) {
+      llist_node* next = tracker->next;
+      if (needed_by_a_snapshot(chmap, tracker, true)) {
+        previous = tracker;
+      } else {
+        if (previous) {
+          previous->next = next;
+        } else {
+          state->history_arr[i] = next;
+        }
+        detach_node_from_dllist(&state->head_of_history,
+                                &tracker->dllist_refs);
+        if (chmap->seqlock) {
+          push_retired_node(chmap, tracker);
+        } else {
+          destroy_llist_node(&chmap->mem_usage, NULL, tracker);
+        }
+        --state->history_count;
+      }
+      tracker = next;
+    }
+  }
+}
+
+// Replaces a node that some snapshot can see with a copy holding the new
+// value, and moves the original one into the history.
+bool copy_llist_node_on_write(chashmap* chmap, uint32_t index,
+                              llist_node* elem, const chmap_pair* val_pair,
+                              bool spilled, uint32_t* stripe_seq) {
+  chmap_entry data = {.hash_val = elem->data.hash_val,
+                      .key_pair = elem->data.key_pair,
+                      .val_pair = (chmap_pair*)val_pair,
+                      .m_procs = chmap->m_procs};
+  chmap_versions* versions = NULL;
+  if (!reserve_history(chmap, 1) || !new_versions(chmap, &versions)) {
+    return false;
+  }
+  set_entry_versions(&data, versions);
+  set_entry_spilled(&data, spilled);
+
+  llist_node* new_elem =
+      create_llist_node(&chmap->mem_usage, &chmap->head_of_all_elems, &data);
+  if (!new_elem) {
+    if (versions) _mem_free(chmap->m_procs, versions);
+    return false;
+  }
+
+  if (stripe_seq) seqlock_write_begin(stripe_seq);
+  __atomic_store_n(
+      &chmap->bucket_arr[index],
+      replace_in_llist(chmap->bucket_arr[index], elem, new_elem),
+      __ATOMIC_RELEASE);
+  move_llist_node_to_history(chmap, elem);
+  if (stripe_seq) seqlock_write_end(stripe_seq);
+
+  return true;
+}
 
 void set_chmap_scaling_limits(chashmap* chmap) {
   chmap->elem_count_to_scale_up = chmap->bucket_arr_size * 6 / 4;
@@ -463,6 +887,24 @@ chashmap* chmap_create_mp(uint32_t initial_bucket_array_size,
   chmap->bucket_arr_size = initial_bucket_array_size;
   chmap->elem_count = 0;
   chmap->head_of_all_elems = NULL;
+  chmap->seqlock = NULL;
+  chmap->resize_thread_count = 1;
+  chmap->version = 0;
+  chmap->snapshots = NULL;
+  chmap->hooks = NULL;
+  chmap->async_snapshot = NULL;
+  chmap->vlog = NULL;
+  chmap->trace = NULL;
+  memset(&chmap->mem_usage, 0, sizeof(chmap->mem_usage));
+  chmap->mem_usage.alloc_calls = 1;
+  chmap->mem_limit = 0;
+  chmap->evict_cb = NULL;
+  chmap->evict_args = NULL;
+  chmap->evict_cursor = 0;
+  memset(&chmap->counters, 0, sizeof(chmap->counters));
+#ifdef CHMAP_INSTRUMENT
+  memset(chmap->latency, 0, sizeof(chmap->latency));
+#endif
   set_chmap_scaling_limits(chmap);
 
   chmap->bucket_arr = (llist_node**)_mem_calloc(
@@ -484,49 +926,10 @@ chashmap* chmap_create_mp(uint32_t initial_bucket_array_size,
   return chmap;
 }
 
-static inline void assign_key_to_hash_id(unsigned long* id_ptr, uint32_t size,
-                                         const unsigned char* c_key_ptr) {
-  if (size == sizeof(unsigned int)) {
-    *id_ptr = *(unsigned int*)c_key_ptr;
-  } else if (size == sizeof(unsigned long)) {
-    *id_ptr = *(unsigned long*)c_key_ptr;
-  } else if (size == sizeof(unsigned char)) {
-    *id_ptr = *c_key_ptr;
-  } else if (size == sizeof(unsigned short)) {
-    *id_ptr = *(unsigned short*)c_key_ptr;
-  } else {
-    unsigned char* c_id_ptr = (unsigned char*)id_ptr;
-#if BYTE_ORDER == LITTLE_ENDIAN
-    for (uint32_t i = 0; i < size; ++i) {
-      c_id_ptr[i] = c_key_ptr[i];
-    }
-#else
-    uint32_t offset = sizeof(id) - size;
-    for (uint32_t i = 0; i < size; ++i) {
-      c_id_ptr[offset + i] = c_key_ptr[i];
-    }
-#endif
-  }
-}
-
 static inline uint32_t calculate_bucket_index(uint32_t bucket_arr_size,
                                               const chmap_pair* key_pair,
                                               unsigned long* hash_ptr) {
-  unsigned long id = 0x0;
-
-  unsigned char* c_key_ptr = (unsigned char*)key_pair->ptr;
-  uint32_t size = key_pair->size;
-
-  if (size <= sizeof(id)) {
-    // Kind of a number assignment.
-    assign_key_to_hash_id(&id, size, c_key_ptr);
-  } else {
-    // DJB2
-    id = 5381;
-    for (uint32_t i = 0; i < size; ++i) {
-      id = ((id << 5) + id) + c_key_ptr[i];
-    }
-  }
+  unsigned long id = calculate_hash(key_pair);
 
   if (hash_ptr) {
     *hash_ptr = id;
@@ -537,15 +940,15 @@ static inline uint32_t calculate_bucket_index(uint32_t bucket_arr_size,
   return index;
 }
 
-#ifdef RUNNING_UNIT_TESTS
 uint32_t chmap_get_bucket_arr_size(chashmap* chmap) {
   if (!chmap) {
     return 0;
   }
 
-  return chmap->bucket_arr_size;
+  return __atomic_load_n(&chmap->bucket_arr_size, __ATOMIC_RELAXED);
 }
 
+#ifdef RUNNING_UNIT_TESTS
 uint32_t chmap_get_elem_count_to_scale_up(chashmap* chmap) {
   if (!chmap) {
     return 0;
@@ -563,7 +966,95 @@ uint32_t chmap_get_elem_count_to_scale_down(chashmap* chmap) {
 }
 #endif
 
+// Scaling never needs two old buckets to feed the same new bucket unless
+// they are congruent modulo the smaller array size, as all the sizes are
+// powers of two. When scaling up, the nodes of the old bucket 'i' can only
+// land in the new buckets 'i + k * old_size'. When scaling down, the new
+// bucket 'j' can only be fed by the old buckets 'j + k * new_size'. So, a
+// task that owns a range of the smaller array (along with its 'rounds'
+// strided copies in the larger one) can relink its nodes without any
+// synchronization with the other tasks.
+const uint32_t parallel_rehash_min_bucket_count = 65536;
+
+typedef struct rehash_task {
+  llist_node** old_arr;
+  llist_node** new_arr;
+  uint32_t new_size;
+  uint32_t begin;
+  uint32_t end;
+  uint32_t rounds;
+  uint32_t stride;
+  pthread_t thread;
+  bool started;
+} rehash_task;
+
+void* run_rehash_task(void* arg) {
+  rehash_task* task = (rehash_task*)arg;
+
+  for (uint32_t round = 0; round < task->rounds; ++round) {
+    uint32_t offset = round * task->stride;
+    for (uint32_t i = task->begin + offset; i < task->end + offset; ++i) {
+      llist_node* tracker = task->old_arr[i];
+      while (tracker) {
+        llist_node* next = tracker->next;
+        uint32_t new_index = tracker->data.hash_val % task->new_size;
+        task->new_arr[new_index] = migrate_llist_node_to_another_llist(
+            task->new_arr[new_index], NULL, tracker);
+        tracker = next;
+      }
+      __atomic_store_n(&task->old_arr[i], NULL, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+void rehash_in_parallel(chashmap* chmap, rehash_task* whole) {
+  uint32_t thread_count = chmap->resize_thread_count;
+  rehash_task* tasks = (rehash_task*)_mem_calloc(chmap->m_procs, thread_count,
+                                                 sizeof(rehash_task));
+  if (!tasks) {
+    // Not the end of the world, do it the old way.
+    run_rehash_task(whole);
+    return;
+  }
+
+  uint32_t range_len = (whole->end - whole->begin) / thread_count;
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    tasks[i] = *whole;
+    tasks[i].begin = whole->begin + i * range_len;
+    tasks[i].end =
+        (i == thread_count - 1) ? whole->end : tasks[i].begin + range_len;
+  }
+
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    tasks[i].started = pthread_create(&tasks[i].thread, NULL, run_rehash_task,
+                                      &tasks[i]) == 0;
+  }
+
+  run_rehash_task(&tasks[0]);
+
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    if (tasks[i].started) {
+      pthread_join(tasks[i].thread, NULL);
+    } else {
+      run_rehash_task(&tasks[i]);
+    }
+  }
+
+  _mem_free(chmap->m_procs, tasks);
+}
+
 void scale_chmap(chashmap* chmap, bool up) {
+  if (chmap->async_snapshot) {
+    // The background snapshot walks the buckets by index, the map gets
+    // scaled once it's done.
+    return;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   uint32_t new_bucket_array_size = 0;
   if (up) {
     new_bucket_array_size = chmap->bucket_arr_size * scale_factor;
@@ -571,58 +1062,460 @@ void scale_chmap(chashmap* chmap, bool up) {
     new_bucket_array_size = chmap->bucket_arr_size / scale_factor;
   }
 
+  USDT_PROBE3(resize_start, chmap, chmap->bucket_arr_size,
+              new_bucket_array_size);
+
   llist_node** new_bucket_arr;
   new_bucket_arr = (llist_node**)_mem_calloc(
       chmap->m_procs, new_bucket_array_size, sizeof(llist_node*));
   if (!new_bucket_arr) {
     // We don't have enough memory to scale, return.
+    USDT_PROBE2(out_of_memory, chmap, "resize");
     return;
   }
 
-  // We have enough memory.
-  for (uint32_t i = 0; i < chmap->bucket_arr_size; ++i) {
-    llist_node* tracker = chmap->bucket_arr[i];
-    while (tracker) {
-      llist_node* next = tracker->next;
-      uint32_t new_index = tracker->data.hash_val % new_bucket_array_size;
-      new_bucket_arr[new_index] = migrate_llist_node_to_another_llist(
-          new_bucket_arr[new_index], NULL, tracker);
-      tracker = next;
+  if (chmap->seqlock) {
+    if (!retire_mem(chmap, chmap->bucket_arr, NULL)) {
+      _mem_free(chmap->m_procs, new_bucket_arr);
+      return;
     }
-    chmap->bucket_arr[i] = NULL;
+    seqlock_write_begin(&chmap->seqlock->resize_seq);
+  }
+
+  // We have enough memory.
+  rehash_task task = {.old_arr = chmap->bucket_arr,
+                      .new_arr = new_bucket_arr,
+                      .new_size = new_bucket_array_size,
+                      .begin = 0,
+                      .end = up ? chmap->bucket_arr_size : new_bucket_array_size,
+                      .rounds = up ? 1 : scale_factor,
+                      .stride = new_bucket_array_size};
+
+  if (chmap->resize_thread_count > 1 &&
+      chmap->bucket_arr_size >= parallel_rehash_min_bucket_count) {
+    rehash_in_parallel(chmap, &task);
+  } else {
+    run_rehash_task(&task);
   }
 
-  _mem_free(chmap->m_procs, chmap->bucket_arr);
+  if (!chmap->seqlock) {
+    _mem_free(chmap->m_procs, chmap->bucket_arr);
+    ++chmap->mem_usage.free_calls;
+  }
+  ++chmap->mem_usage.alloc_calls;
 
-  chmap->bucket_arr = new_bucket_arr;
-  chmap->bucket_arr_size = new_bucket_array_size;
+  __atomic_store_n(&chmap->bucket_arr, new_bucket_arr, __ATOMIC_RELAXED);
+  __atomic_store_n(&chmap->bucket_arr_size, new_bucket_array_size,
+                   __ATOMIC_RELAXED);
   set_chmap_scaling_limits(chmap);
+
+  if (chmap->seqlock) {
+    seqlock_write_end(&chmap->seqlock->resize_seq);
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t nsec = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                  end.tv_nsec - start.tv_nsec;
+  chmap->counters.scale_nsec += nsec;
+  USDT_PROBE3(resize_done, chmap, new_bucket_array_size, nsec);
+#ifdef CHMAP_INSTRUMENT
+  record_latency(chmap, chmap_latency_resize, nsec);
+#endif
+  if (up) {
+    ++chmap->counters.scale_up_count;
+  } else {
+    ++chmap->counters.scale_down_count;
+  }
 }
 
-chashmap_retval_t chmap_insert_elem(chashmap* chmap, const chmap_pair* key_pair,
-                                    const chmap_pair* val_pair) {
-  if (!chmap || !key_pair || !val_pair || !key_pair->ptr || !val_pair->ptr ||
-      key_pair->size == 0 || val_pair->size == 0) {
-    return chm_invalid_arguments;
+void chmap_add_mutation_hook(chashmap* chmap, chmap_mutation_hook* hook) {
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
   }
 
-  chmap_entry data = {.hash_val = 0,
-                      .key_pair = (chmap_pair*)key_pair,
+  hook->next = chmap->hooks;
+  chmap->hooks = hook;
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+}
+
+// Unlinks the hook without releasing it, returns false if it wasn't there.
+bool chmap_remove_mutation_hook(chashmap* chmap, chmap_mutation_hook* hook) {
+  bool found = false;
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  for (chmap_mutation_hook** link = &chmap->hooks; *link;
+       link = &(*link)->next) {
+    if (*link == hook) {
+      *link = hook->next;
+      found = true;
+      break;
+    }
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return found;
+}
+
+static inline void notify_insert(chashmap* chmap, const chmap_pair* key_pair,
+                                 const chmap_pair* val_pair) {
+  for (chmap_mutation_hook* hook = chmap->hooks; hook; hook = hook->next) {
+    if (hook->on_insert) hook->on_insert(hook->ctx, key_pair, val_pair);
+  }
+}
+
+static inline void notify_delete(chashmap* chmap, const chmap_pair* key_pair) {
+  for (chmap_mutation_hook* hook = chmap->hooks; hook; hook = hook->next) {
+    if (hook->on_delete) hook->on_delete(hook->ctx, key_pair);
+  }
+}
+
+static inline void notify_reset(chashmap* chmap) {
+  for (chmap_mutation_hook* hook = chmap->hooks; hook; hook = hook->next) {
+    if (hook->on_reset) hook->on_reset(hook->ctx);
+  }
+}
+
+void release_mutation_hooks(chashmap* chmap) {
+  while (chmap->hooks) {
+    chmap_mutation_hook* hook = chmap->hooks;
+    chmap->hooks = hook->next;
+    if (hook->release) hook->release(hook->ctx);
+  }
+}
+
+static inline uint64_t total_mem_usage(const chashmap* chmap) {
+  return (uint64_t)chmap->bucket_arr_size * sizeof(llist_node*) +
+         chmap->mem_usage.node_bytes + chmap->mem_usage.key_bytes +
+         chmap->mem_usage.val_bytes;
+}
+
+// What the memory limit gets checked against, the retired memory only goes
+// away with 'chmap_reclaim_retired'.
+static inline uint64_t limited_mem_usage(const chashmap* chmap) {
+  uint64_t usage = total_mem_usage(chmap);
+  return chmap->seqlock ? usage - chmap->seqlock->retired_bytes : usage;
+}
+
+// The bytes the map would allocate to store the key with a value taking up
+// val_size bytes in the node.
+uint64_t insert_cost(chashmap* chmap, uint32_t index,
+                     const chmap_pair* key_pair, uint32_t val_size) {
+  llist_node* r = find_in_llist(chmap->bucket_arr[index], key_pair);
+  if (!r || needed_by_a_snapshot(chmap, r, false)) {
+    return NODE_OVERHEAD_BYTES + key_pair->size + val_size;
+  }
+
+  uint32_t old_size = r->data.val_pair->size;
+  if (chmap->seqlock && old_size != val_size) {
+    // The old value stays around for the optimistic readers
+    return sizeof(chmap_pair) + val_size;
+  }
+
+  return val_size > old_size ? val_size - old_size : 0;
+}
+
+// Removes an entry picked by the eviction callback, the way
+// 'chmap_delete_elem' would, except that the map never scales down here. No
+// snapshot can see the entry, so it never moves into the history, and the
+// async snapshot should have copied the bucket already.
+void evict_llist_node(chashmap* chmap, uint32_t index, llist_node* elem) {
+  if (chmap->hooks) {
+    notify_delete(chmap, elem->data.key_pair);
+  }
+
+  uint32_t* stripe_seq = stripe_seq_for(chmap, elem->data.hash_val);
+
+  llist_node* unlinked = NULL;
+  if (stripe_seq) seqlock_write_begin(stripe_seq);
+  chmap->bucket_arr[index] =
+      unlink_from_llist(chmap->bucket_arr[index], elem->data.key_pair,
+                        &unlinked);
+  if (unlinked) {
+    discard_llist_node(chmap, unlinked);
+  }
+  if (stripe_seq) seqlock_write_end(stripe_seq);
+
+  --chmap->elem_count;
+}
+
+// Makes sure cost more bytes fit under the memory limit, by evicting the
+// entries the callback agrees to. Every round picks up from the bucket the
+// previous one stopped at, and gives up after visiting all of them. The
+// entries a snapshot can see are skipped, evicting them would free nothing.
+bool make_room(chashmap* chmap, uint64_t cost) {
+  if (limited_mem_usage(chmap) + cost <= chmap->mem_limit) {
+    return true;
+  }
+
+  if (!chmap->evict_cb) {
+    return false;
+  }
+
+  void* val_buf = NULL;
+  uint32_t val_capacity = 0;
+  bool fits = false;
+
+  for (uint32_t visited = 0; visited < chmap->bucket_arr_size && !fits;
+       ++visited) {
+    uint32_t index = chmap->evict_cursor++ % chmap->bucket_arr_size;
+    if (chmap->async_snapshot && !async_snapshot_before_write(chmap, index)) {
+      // Nothing gets offered to the callback that can't be evicted
+      break;
+    }
+    llist_node* tracker = chmap->bucket_arr[index];
+    while (tracker && !fits) {
+      llist_node* next = tracker->next;
+      chmap_pair val;
+      if (!needed_by_a_snapshot(chmap, tracker, false) &&
+          load_entry_val(&tracker->data, &val, &val_buf, &val_capacity) &&
+          chmap->evict_cb(tracker->data.key_pair, &val, chmap->evict_args)) {
+        evict_llist_node(chmap, index, tracker);
+        fits = limited_mem_usage(chmap) + cost <= chmap->mem_limit;
+      }
+      tracker = next;
+    }
+  }
+
+  if (val_buf) _mem_free(chmap->m_procs, val_buf);
+
+  return fits;
+}
+
+chashmap_retval_t chmap_set_memory_limit(
+    chashmap* chmap, uint64_t limit_bytes,
+    int (*evict_cb)(const chmap_pair* key_pair, const chmap_pair* val_pair,
+                    void* args),
+    void* args) {
+  if (!chmap) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  chmap->mem_limit = limit_bytes;
+  chmap->evict_cb = evict_cb;
+  chmap->evict_args = args;
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_memory_usage(chashmap* chmap, chmap_mem_stats* stats) {
+  if (!chmap || !stats) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  stats->bucket_bytes = (uint64_t)chmap->bucket_arr_size * sizeof(llist_node*);
+  stats->node_bytes = chmap->mem_usage.node_bytes;
+  stats->key_bytes = chmap->mem_usage.key_bytes;
+  stats->val_bytes = chmap->mem_usage.val_bytes;
+  stats->total_bytes = total_mem_usage(chmap);
+  stats->alloc_calls = chmap->mem_usage.alloc_calls;
+  stats->realloc_calls = chmap->mem_usage.realloc_calls;
+  stats->free_calls = chmap->mem_usage.free_calls;
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_get_stats(chashmap* chmap, chmap_stats* stats) {
+  if (!chmap || !stats) {
+    return chm_invalid_arguments;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  uint32_t non_empty = 0;
+  for (uint32_t i = 0; i < chmap->bucket_arr_size; ++i) {
+    uint32_t len = 0;
+    for (llist_node* tracker = chmap->bucket_arr[i]; tracker;
+         tracker = tracker->next) {
+      ++len;
+    }
+    if (len > stats->max_chain_len) {
+      stats->max_chain_len = len;
+    }
+    if (len > 0) {
+      ++non_empty;
+    }
+    ++stats->chain_histogram[len < CHMAP_CHAIN_HISTOGRAM_LEN
+                                 ? len
+                                 : CHMAP_CHAIN_HISTOGRAM_LEN - 1];
+  }
+
+  stats->elem_count = chmap->elem_count;
+  stats->bucket_count = chmap->bucket_arr_size;
+  stats->mean_chain_len =
+      non_empty ? (double)chmap->elem_count / non_empty : 0.0;
+  stats->empty_bucket_ratio =
+      (double)(chmap->bucket_arr_size - non_empty) / chmap->bucket_arr_size;
+  stats->scale_up_count = chmap->counters.scale_up_count;
+  stats->scale_down_count = chmap->counters.scale_down_count;
+  stats->scale_nsec = chmap->counters.scale_nsec;
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  chmap_op_counters* counters = &chmap->counters;
+  stats->hit_lookups = __atomic_load_n(&counters->hit_lookups, __ATOMIC_RELAXED);
+  stats->miss_lookups =
+      __atomic_load_n(&counters->miss_lookups, __ATOMIC_RELAXED);
+  if (stats->hit_lookups) {
+    stats->compares_per_hit =
+        (double)__atomic_load_n(&counters->hit_compares, __ATOMIC_RELAXED) /
+        stats->hit_lookups;
+  }
+  if (stats->miss_lookups) {
+    stats->compares_per_miss =
+        (double)__atomic_load_n(&counters->miss_compares, __ATOMIC_RELAXED) /
+        stats->miss_lookups;
+  }
+
+  return chm_success;
+}
+
+static inline chashmap_retval_t insert_elem(chashmap* chmap,
+                                            const chmap_pair* key_pair,
+                                            const chmap_pair* val_pair) {
+  if (!chmap || !key_pair || !val_pair || !key_pair->ptr || !val_pair->ptr ||
+      key_pair->size == 0 || val_pair->size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_entry data = {.hash_val = 0,
+                      .key_pair = (chmap_pair*)key_pair,
                       .val_pair = (chmap_pair*)val_pair,
                       .m_procs = chmap->m_procs};
 
   bool result = false;
+  uint32_t* stripe_seq = NULL;
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
 
   uint32_t index =
       calculate_bucket_index(chmap->bucket_arr_size, key_pair, &data.hash_val);
 
+  if (chmap->async_snapshot && !async_snapshot_before_write(chmap, index)) {
+    if (chmap->seqlock) {
+      pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    }
+    return chm_not_enough_memory;
+  }
+
+  bool spill = chmap->vlog && vlog_should_spill(chmap->vlog, val_pair->size);
+
+  if (chmap->mem_limit &&
+      !make_room(chmap, insert_cost(chmap, index, key_pair,
+                                    spill ? sizeof(chmap_vlog_ref)
+                                          : val_pair->size))) {
+    if (chmap->seqlock) {
+      pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    }
+    return chm_not_enough_memory;
+  }
+
+  chmap_vlog_ref ref;
+  chmap_pair spilled_pair = {.ptr = &ref, .size = sizeof(ref)};
+  if (spill) {
+    // The node only keeps the handle of the value
+    if (!vlog_append(chmap->vlog, val_pair, &ref)) {
+      if (chmap->seqlock) {
+        pthread_mutex_unlock(&chmap->seqlock->write_lock);
+      }
+      return chm_io_error;
+    }
+    data.val_pair = &spilled_pair;
+    set_entry_spilled(&data, true);
+  }
+
+  stripe_seq = stripe_seq_for(chmap, data.hash_val);
+
+#ifdef CHMAP_USDT
+  // A miss walks the whole chain the new node goes into
+  uint32_t chain_len = 0;
+  llist_node* r =
+      find_in_llist_counted(chmap->bucket_arr[index], key_pair, &chain_len);
+#else
   llist_node* r = find_in_llist(chmap->bucket_arr[index], key_pair);
+#endif
   if (r) {
     // The entry already exists
-    result = reset_val_of_llist_node(r, val_pair);
+    if (needed_by_a_snapshot(chmap, r, false)) {
+      result = copy_llist_node_on_write(chmap, index, r, data.val_pair,
+                                        spill, stripe_seq);
+    } else if (stripe_seq && r->data.val_pair->size != data.val_pair->size) {
+      result = reset_val_of_llist_node_optimistic(chmap, r, data.val_pair);
+    } else {
+      bool was_spilled = entry_spilled(&r->data);
+      uint32_t old_size = r->data.val_pair->size;
+      chmap_vlog_ref old_ref;
+      if (was_spilled) {
+        old_ref = *(chmap_vlog_ref*)r->data.val_pair->ptr;
+      }
+      if (stripe_seq) seqlock_write_begin(stripe_seq);
+      result = reset_val_of_llist_node(r, data.val_pair);
+      if (result) {
+        set_entry_spilled(&r->data, spill);
+        chmap->mem_usage.val_bytes += data.val_pair->size;
+        chmap->mem_usage.val_bytes -= old_size;
+        if (old_size != data.val_pair->size) {
+          ++chmap->mem_usage.realloc_calls;
+        }
+      }
+      if (stripe_seq) seqlock_write_end(stripe_seq);
+      if (result && was_spilled) {
+        vlog_release(&old_ref);
+      }
+    }
   } else {
-    chmap->bucket_arr[index] = insert_into_llist(
-        chmap->bucket_arr[index], &chmap->head_of_all_elems, &data, &result);
+#ifdef CHMAP_USDT
+    if (chain_len > CHMAP_USDT_LONG_CHAIN) {
+      USDT_PROBE3(long_chain, chmap, chain_len, 0);
+    }
+#endif
+    chmap_versions* versions = NULL;
+    if (new_versions(chmap, &versions)) {
+      set_entry_versions(&data, versions);
+      // The release store publishes a fully initialized node to the
+      // optimistic readers, it is a plain store on the common platforms.
+      __atomic_store_n(
+          &chmap->bucket_arr[index],
+          insert_into_llist(chmap->bucket_arr[index], &chmap->mem_usage,
+                            &chmap->head_of_all_elems, &data, &result),
+          __ATOMIC_RELEASE);
+    }
+    if (!result && versions) {
+      _mem_free(chmap->m_procs, versions);
+    }
     if (result) {
       if (++chmap->elem_count >= chmap->elem_count_to_scale_up) {
         // Time to scale up!
@@ -631,39 +1524,133 @@ chashmap_retval_t chmap_insert_elem(chashmap* chmap, const chmap_pair* key_pair,
     }
   }
 
+  if (!result && spill) {
+    vlog_release(&ref);
+  }
+
+  if (result && chmap->hooks) {
+    notify_insert(chmap, key_pair, val_pair);
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
   return result ? chm_success : chm_not_enough_memory;
 }
 
-chashmap_retval_t chmap_get_elem_copy(chashmap* chmap,
-                                      const chmap_pair* key_pair,
-                                      void* target_buf,
-                                      uint32_t target_buf_size) {
+chashmap_retval_t get_elem_copy_optimistic(chashmap* chmap,
+                                           const chmap_pair* key_pair,
+                                           void* target_buf,
+                                           uint32_t target_buf_size) {
+  chmap_seqlock_state* seqlock = chmap->seqlock;
+  unsigned long hash = calculate_hash(key_pair);
+  uint32_t* stripe_seq = &seqlock->stripe_seqs[hash % SEQLOCK_STRIPE_COUNT];
+
+  while (true) {
+    uint32_t resize_start = seqlock_read_begin(&seqlock->resize_seq);
+    llist_node** bucket_arr =
+        __atomic_load_n(&chmap->bucket_arr, __ATOMIC_RELAXED);
+    uint32_t bucket_arr_size =
+        __atomic_load_n(&chmap->bucket_arr_size, __ATOMIC_RELAXED);
+    if (seqlock_read_retry(&seqlock->resize_seq, resize_start)) {
+      // The array and its size might not belong together.
+      continue;
+    }
+
+    uint32_t stripe_start = seqlock_read_begin(stripe_seq);
+
+    llist_node* r = lookup_in_llist_optimistic(
+        chmap,
+        __atomic_load_n(&bucket_arr[hash % bucket_arr_size], __ATOMIC_ACQUIRE),
+        key_pair);
+    if (r) {
+      chmap_pair* val_pair =
+          __atomic_load_n(&r->data.val_pair, __ATOMIC_ACQUIRE);
+      uint32_t min_size = target_buf_size;
+      if (val_pair->size < min_size) {
+        min_size = val_pair->size;
+      }
+      mem_assign(target_buf, val_pair->ptr, min_size);
+    }
+
+    if (seqlock_read_retry(stripe_seq, stripe_start) ||
+        seqlock_read_retry(&seqlock->resize_seq, resize_start)) {
+      // A writer got in our way, what we have might be torn.
+      continue;
+    }
+
+    return r ? chm_success : chm_key_not_found;
+  }
+}
+
+chashmap_retval_t chmap_insert_elem(chashmap* chmap, const chmap_pair* key_pair,
+                                    const chmap_pair* val_pair) {
+  LATENCY_START(start);
+  chashmap_retval_t result = insert_elem(chmap, key_pair, val_pair);
+  LATENCY_RECORD(chmap, chmap_latency_insert, start);
+  if (result == chm_not_enough_memory) {
+    USDT_PROBE2(out_of_memory, chmap, "insert");
+  }
+  if (chmap && chmap->trace) {
+    trace_record(chmap->trace, chmap_trace_insert, key_pair,
+                 val_pair ? val_pair->size : 0, result);
+  }
+
+  return result;
+}
+
+static inline chashmap_retval_t get_elem_copy(chashmap* chmap,
+                                              const chmap_pair* key_pair,
+                                              void* target_buf,
+                                              uint32_t target_buf_size) {
   if (!chmap || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
       !target_buf || target_buf_size == 0) {
     return chm_invalid_arguments;
   }
 
+  if (chmap->seqlock) {
+    return get_elem_copy_optimistic(chmap, key_pair, target_buf,
+                                    target_buf_size);
+  }
+
   chashmap_retval_t result = chm_key_not_found;
 
   uint32_t index =
       calculate_bucket_index(chmap->bucket_arr_size, key_pair, NULL);
 
-  llist_node* r = find_in_llist(chmap->bucket_arr[index], key_pair);
+  llist_node* r = lookup_in_llist(chmap, chmap->bucket_arr[index], key_pair);
   if (r) {
     uint32_t min_size = target_buf_size;
-    if (r->data.val_pair->size < min_size) {
-      min_size = r->data.val_pair->size;
+    if (entry_val_size(&r->data) < min_size) {
+      min_size = entry_val_size(&r->data);
     }
-    mem_assign(target_buf, r->data.val_pair->ptr, min_size);
-    result = chm_success;
+    result = read_entry_val(&r->data, target_buf, min_size) ? chm_success
+                                                            : chm_io_error;
   }
 
   return result;
 }
 
-chashmap_retval_t chmap_get_elem_ref(chashmap* chmap,
-                                     const chmap_pair* key_pair,
-                                     chmap_pair** val_pair) {
+chashmap_retval_t chmap_get_elem_copy(chashmap* chmap,
+                                      const chmap_pair* key_pair,
+                                      void* target_buf,
+                                      uint32_t target_buf_size) {
+  LATENCY_START(start);
+  chashmap_retval_t result =
+      get_elem_copy(chmap, key_pair, target_buf, target_buf_size);
+  LATENCY_RECORD(chmap, chmap_latency_get, start);
+  if (chmap && chmap->trace) {
+    trace_record(chmap->trace, chmap_trace_get_copy, key_pair,
+                 target_buf_size, result);
+  }
+
+  return result;
+}
+
+static inline chashmap_retval_t get_elem_ref(chashmap* chmap,
+                                             const chmap_pair* key_pair,
+                                             chmap_pair** val_pair) {
   if (!chmap || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
       !val_pair) {
     return chm_invalid_arguments;
@@ -674,8 +1661,10 @@ chashmap_retval_t chmap_get_elem_ref(chashmap* chmap,
   uint32_t index =
       calculate_bucket_index(chmap->bucket_arr_size, key_pair, NULL);
 
-  llist_node* r = find_in_llist(chmap->bucket_arr[index], key_pair);
-  if (r) {
+  llist_node* r = lookup_in_llist(chmap, chmap->bucket_arr[index], key_pair);
+  if (r && entry_spilled(&r->data)) {
+    result = chm_value_spilled;
+  } else if (r) {
     *val_pair = r->data.val_pair;
     result = chm_success;
   }
@@ -683,19 +1672,55 @@ chashmap_retval_t chmap_get_elem_ref(chashmap* chmap,
   return result;
 }
 
-chashmap_retval_t chmap_delete_elem(chashmap* chmap,
-                                    const chmap_pair* key_pair) {
+chashmap_retval_t chmap_get_elem_ref(chashmap* chmap,
+                                     const chmap_pair* key_pair,
+                                     chmap_pair** val_pair) {
+  LATENCY_START(start);
+  chashmap_retval_t result = get_elem_ref(chmap, key_pair, val_pair);
+  LATENCY_RECORD(chmap, chmap_latency_get, start);
+  if (chmap && chmap->trace) {
+    trace_record(chmap->trace, chmap_trace_get_ref, key_pair, 0, result);
+  }
+
+  return result;
+}
+
+static inline chashmap_retval_t delete_elem(chashmap* chmap,
+                                            const chmap_pair* key_pair) {
   if (!chmap || !key_pair || !key_pair->ptr || key_pair->size == 0) {
     return chm_invalid_arguments;
   }
 
   bool found = false;
+  unsigned long hash = 0;
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
 
   uint32_t index =
-      calculate_bucket_index(chmap->bucket_arr_size, key_pair, NULL);
+      calculate_bucket_index(chmap->bucket_arr_size, key_pair, &hash);
+
+  if ((chmap->async_snapshot &&
+       !async_snapshot_before_write(chmap, index)) ||
+      (chmap->snapshots && !reserve_history(chmap, 1))) {
+    if (chmap->seqlock) {
+      pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    }
+    return chm_not_enough_memory;
+  }
 
-  chmap->bucket_arr[index] = delete_from_llist(
-      chmap->bucket_arr[index], &chmap->head_of_all_elems, key_pair, &found);
+  uint32_t* stripe_seq = stripe_seq_for(chmap, hash);
+
+  llist_node* unlinked = NULL;
+  if (stripe_seq) seqlock_write_begin(stripe_seq);
+  chmap->bucket_arr[index] =
+      unlink_from_llist(chmap->bucket_arr[index], key_pair, &unlinked);
+  if (unlinked) {
+    discard_llist_node(chmap, unlinked);
+    found = true;
+  }
+  if (stripe_seq) seqlock_write_end(stripe_seq);
 
   if (found) {
     if (--chmap->elem_count < chmap->elem_count_to_scale_down &&
@@ -703,10 +1728,31 @@ chashmap_retval_t chmap_delete_elem(chashmap* chmap,
       // Time to scale down!
       scale_chmap(chmap, false);
     }
-    return chm_success;
+    if (chmap->hooks) {
+      notify_delete(chmap, key_pair);
+    }
   }
 
-  return chm_key_not_found;
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return found ? chm_success : chm_key_not_found;
+}
+
+chashmap_retval_t chmap_delete_elem(chashmap* chmap,
+                                    const chmap_pair* key_pair) {
+  LATENCY_START(start);
+  chashmap_retval_t result = delete_elem(chmap, key_pair);
+  LATENCY_RECORD(chmap, chmap_latency_delete, start);
+  if (result == chm_not_enough_memory) {
+    USDT_PROBE2(out_of_memory, chmap, "delete");
+  }
+  if (chmap && chmap->trace) {
+    trace_record(chmap->trace, chmap_trace_delete, key_pair, 0, result);
+  }
+
+  return result;
 }
 
 uint32_t chmap_elem_count(chashmap* chmap) {
@@ -717,6 +1763,17 @@ uint32_t chmap_elem_count(chashmap* chmap) {
   return 0;
 }
 
+// The value pair to hand to a callback, a copy of the value if it got
+// spilled. NULL if a spilled value can't be read back.
+static inline chmap_pair* callback_val(const chmap_entry* data,
+                                       chmap_pair* copy, void** buf,
+                                       uint32_t* capacity) {
+  if (!entry_spilled(data)) {
+    return data->val_pair;
+  }
+  return load_entry_val(data, copy, buf, capacity) ? copy : NULL;
+}
+
 void chmap_for_each_elem(chashmap* chmap,
                          void (*callback)(const chmap_pair* key_pair,
                                           chmap_pair* val_pair, void* args),
@@ -725,15 +1782,259 @@ void chmap_for_each_elem(chashmap* chmap,
     return;
   }
 
+  void* buf = NULL;
+  uint32_t capacity = 0;
+  chmap_pair copy;
+
   dllist_ref_node* tracker = chmap->head_of_all_elems;
   while (tracker) {
-    (*callback)(tracker->host->data.key_pair, tracker->host->data.val_pair,
-                args);
+    chmap_entry* data = &tracker->host->data;
+    chmap_pair* val_pair = callback_val(data, &copy, &buf, &capacity);
+    if (val_pair) {
+      (*callback)(data->key_pair, val_pair, args);
+    }
     tracker = tracker->next;
   }
+
+  if (buf) {
+    _mem_free(chmap->m_procs, buf);
+  }
 }
 
-chashmap_retval_t chmap_reset(chashmap* chmap, uint32_t new_bucket_array_size) {
+// The parallel walkers grab this many buckets at a time from a shared
+// cursor. The chunks are small enough to even out the uneven chain lengths,
+// and large enough to keep the cursor from becoming a hot spot.
+const uint32_t parallel_walk_chunk_size = 256;
+
+typedef struct parallel_walk {
+  chashmap* chmap;
+  uint32_t next_chunk;
+  uint32_t chunk_count;
+  void (*callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                   void* args);
+  void (*reduce_callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                          void* local, void* args);
+  void* args;
+} parallel_walk;
+
+typedef struct parallel_walker {
+  parallel_walk* walk;
+  void* local;
+  pthread_t thread;
+  bool started;
+} parallel_walker;
+
+void* run_parallel_walker(void* arg) {
+  parallel_walker* walker = (parallel_walker*)arg;
+  parallel_walk* walk = walker->walk;
+  llist_node** bucket_arr = walk->chmap->bucket_arr;
+  uint32_t bucket_arr_size = walk->chmap->bucket_arr_size;
+  void* buf = NULL;
+  uint32_t capacity = 0;
+  chmap_pair copy;
+
+  uint32_t chunk;
+  while ((chunk = __atomic_fetch_add(&walk->next_chunk, 1,
+                                     __ATOMIC_RELAXED)) < walk->chunk_count) {
+    uint32_t begin = chunk * parallel_walk_chunk_size;
+    uint32_t end = begin + parallel_walk_chunk_size;
+    if (end > bucket_arr_size) {
+      end = bucket_arr_size;
+    }
+
+    for (uint32_t i = begin; i < end; ++i) {
+      llist_node* tracker = bucket_arr[i];
+      while (tracker) {
+        chmap_pair* val_pair =
+            callback_val(&tracker->data, &copy, &buf, &capacity);
+        if (!val_pair) {
+          // The spilled value could not be read back
+        } else if (walk->reduce_callback) {
+          (*walk->reduce_callback)(tracker->data.key_pair, val_pair,
+                                   walker->local, walk->args);
+        } else {
+          (*walk->callback)(tracker->data.key_pair, val_pair, walk->args);
+        }
+        tracker = tracker->next;
+      }
+    }
+  }
+
+  if (buf) {
+    _mem_free(walk->chmap->m_procs, buf);
+  }
+
+  return NULL;
+}
+
+chashmap_retval_t walk_in_parallel(parallel_walk* walk, uint32_t thread_count,
+                                   const chmap_reducer* reducer) {
+  chashmap* chmap = walk->chmap;
+  walk->next_chunk = 0;
+  walk->chunk_count =
+      (chmap->bucket_arr_size + parallel_walk_chunk_size - 1) /
+      parallel_walk_chunk_size;
+
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  if (thread_count > walk->chunk_count) {
+    thread_count = walk->chunk_count;
+  }
+
+  parallel_walker* walkers = (parallel_walker*)_mem_calloc(
+      chmap->m_procs, thread_count, sizeof(parallel_walker));
+  if (!walkers) {
+    return chm_not_enough_memory;
+  }
+
+  // Every walker gets its own cache line aligned accumulator, so that they
+  // don't need to share anything while walking.
+  void* locals = NULL;
+  size_t local_stride = 0;
+  if (reducer && reducer->local_size > 0) {
+    local_stride = (reducer->local_size + CACHE_LINE_SIZE - 1) /
+                   CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    locals = _mem_calloc(chmap->m_procs, thread_count,
+                         local_stride + CACHE_LINE_SIZE);
+    if (!locals) {
+      _mem_free(chmap->m_procs, walkers);
+      return chm_not_enough_memory;
+    }
+  }
+
+  unsigned char* first_local =
+      (unsigned char*)(((uintptr_t)locals + CACHE_LINE_SIZE - 1) &
+                       ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    walkers[i].walk = walk;
+    walkers[i].local = locals ? first_local + i * local_stride : NULL;
+    if (reducer && reducer->init) {
+      (*reducer->init)(walkers[i].local, walk->args);
+    }
+  }
+
+  // The calling thread is a walker too. If some of the threads can't be
+  // created, the ones that are running simply take over their chunks.
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    walkers[i].started = pthread_create(&walkers[i].thread, NULL,
+                                        run_parallel_walker, &walkers[i]) == 0;
+  }
+
+  run_parallel_walker(&walkers[0]);
+
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    if (walkers[i].started) {
+      pthread_join(walkers[i].thread, NULL);
+    }
+  }
+
+  if (reducer && reducer->combine) {
+    for (uint32_t i = 0; i < thread_count; ++i) {
+      (*reducer->combine)(walkers[i].local, walk->args);
+    }
+  }
+
+  if (locals) {
+    _mem_free(chmap->m_procs, locals);
+  }
+  _mem_free(chmap->m_procs, walkers);
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_for_each_elem_parallel(
+    chashmap* chmap, uint32_t thread_count,
+    void (*callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                    void* args),
+    void* args) {
+  if (!chmap || !callback) {
+    return chm_invalid_arguments;
+  }
+
+  parallel_walk walk = {.chmap = chmap,
+                        .callback = callback,
+                        .reduce_callback = NULL,
+                        .args = args};
+
+  return walk_in_parallel(&walk, thread_count, NULL);
+}
+
+chashmap_retval_t chmap_for_each_elem_parallel_reduce(
+    chashmap* chmap, uint32_t thread_count,
+    void (*callback)(const chmap_pair* key_pair, chmap_pair* val_pair,
+                     void* local, void* args),
+    const chmap_reducer* reducer, void* args) {
+  if (!chmap || !callback || !reducer) {
+    return chm_invalid_arguments;
+  }
+
+  parallel_walk walk = {.chmap = chmap,
+                        .callback = NULL,
+                        .reduce_callback = callback,
+                        .args = args};
+
+  return walk_in_parallel(&walk, thread_count, reducer);
+}
+
+// Empties the buckets, the nodes are discarded one by one. The bucket
+// pointers are cleared one at a time, so that an optimistic reader never sees
+// a torn pointer.
+void discard_all_llist_nodes(chashmap* chmap) {
+  for (uint32_t i = 0; i < chmap->bucket_arr_size; ++i) {
+    llist_node* tracker = chmap->bucket_arr[i];
+    __atomic_store_n(&chmap->bucket_arr[i], NULL, __ATOMIC_RELAXED);
+    while (tracker) {
+      llist_node* next = tracker->next;
+      discard_llist_node(chmap, tracker);
+      tracker = next;
+    }
+  }
+}
+
+// The optimistic flavour of 'chmap_reset', it expects the write lock to be
+// held. No buffer that a reader might be looking at gets freed or reallocated
+// in place, and the buckets get cleared one pointer at a time, so that a
+// reader never sees a torn pointer.
+chashmap_retval_t reset_optimistic(chashmap* chmap,
+                                   uint32_t new_bucket_array_size) {
+  chashmap_retval_t result = chm_success;
+  llist_node** new_bucket_arr = NULL;
+
+  if (new_bucket_array_size > 0 &&
+      new_bucket_array_size != chmap->bucket_arr_size) {
+    new_bucket_arr = (llist_node**)_mem_calloc(
+        chmap->m_procs, new_bucket_array_size, sizeof(llist_node*));
+    if (new_bucket_arr && !retire_mem(chmap, chmap->bucket_arr, NULL)) {
+      _mem_free(chmap->m_procs, new_bucket_arr);
+      new_bucket_arr = NULL;
+    }
+    if (!new_bucket_arr) {
+      result = chm_not_enough_memory;
+    }
+  }
+
+  seqlock_write_begin(&chmap->seqlock->resize_seq);
+
+  discard_all_llist_nodes(chmap);
+
+  if (new_bucket_arr) {
+    __atomic_store_n(&chmap->bucket_arr, new_bucket_arr, __ATOMIC_RELAXED);
+    __atomic_store_n(&chmap->bucket_arr_size, new_bucket_array_size,
+                     __ATOMIC_RELAXED);
+    set_chmap_scaling_limits(chmap);
+    ++chmap->mem_usage.alloc_calls;
+  }
+
+  chmap->elem_count = 0;
+
+  seqlock_write_end(&chmap->seqlock->resize_seq);
+
+  return result;
+}
+
+static inline chashmap_retval_t reset_chmap(chashmap* chmap,
+                                            uint32_t new_bucket_array_size) {
   if (!chmap) {
     return chm_invalid_arguments;
   }
@@ -743,15 +2044,38 @@ chashmap_retval_t chmap_reset(chashmap* chmap, uint32_t new_bucket_array_size) {
   if (new_bucket_array_size > 0 &&
       new_bucket_array_size < minimum_allowed_bucket_array_size) {
     new_bucket_array_size = minimum_allowed_bucket_array_size;
-  } else {
+  } else if (new_bucket_array_size > 0) {
     new_bucket_array_size =
         find_nearest_gte_power_of_two(new_bucket_array_size);
   }
 
-  for (uint32_t i = 0; i < chmap->bucket_arr_size; ++i) {
-    destroy_the_whole_llist(chmap->bucket_arr[i], &chmap->head_of_all_elems);
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  if ((chmap->async_snapshot &&
+       !async_snapshot_before_write(chmap, ASYNC_SNAPSHOT_ALL_BUCKETS)) ||
+      (chmap->snapshots && !reserve_history(chmap, chmap->elem_count))) {
+    // The snapshots can't keep the elements, so leave them alone.
+    if (chmap->seqlock) {
+      pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    }
+    return chm_not_enough_memory;
+  }
+
+  // The elements are gone even if the bucket array can't be resized
+  if (chmap->hooks) {
+    notify_reset(chmap);
   }
 
+  if (chmap->seqlock) {
+    result = reset_optimistic(chmap, new_bucket_array_size);
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    return result;
+  }
+
+  discard_all_llist_nodes(chmap);
+
   if (new_bucket_array_size > 0 &&
       new_bucket_array_size != chmap->bucket_arr_size) {
     llist_node** orig = chmap->bucket_arr;
@@ -759,11 +2083,13 @@ chashmap_retval_t chmap_reset(chashmap* chmap, uint32_t new_bucket_array_size) {
     chmap->bucket_arr =
         _mem_realloc(chmap->m_procs, chmap->bucket_arr,
                      new_bucket_array_size * sizeof(llist_node*));
+    ++chmap->mem_usage.realloc_calls;
     if (!chmap->bucket_arr) {
       chmap->bucket_arr = orig;
       result = chm_not_enough_memory;
     } else {
       chmap->bucket_arr_size = new_bucket_array_size;
+      set_chmap_scaling_limits(chmap);
     }
   }
 
@@ -773,10 +2099,295 @@ chashmap_retval_t chmap_reset(chashmap* chmap, uint32_t new_bucket_array_size) {
   return result;
 }
 
+chashmap_retval_t chmap_reset(chashmap* chmap, uint32_t new_bucket_array_size) {
+  chashmap_retval_t result = reset_chmap(chmap, new_bucket_array_size);
+  if (result == chm_not_enough_memory) {
+    USDT_PROBE2(out_of_memory, chmap, "reset");
+  }
+  if (chmap && chmap->trace) {
+    trace_record(chmap->trace, chmap_trace_reset, NULL, new_bucket_array_size,
+                 result);
+  }
+
+  return result;
+}
+
+chashmap_retval_t chmap_set_resize_threads(chashmap* chmap,
+                                           uint32_t thread_count) {
+  if (!chmap || thread_count == 0) {
+    return chm_invalid_arguments;
+  }
+
+  chmap->resize_thread_count = thread_count;
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_enable_optimistic_reads(chashmap* chmap) {
+  if (!chmap) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    // Already enabled
+    return chm_success;
+  }
+
+  if (chmap->vlog) {
+    // The readers would race the value log for the spilled values
+    return chm_invalid_arguments;
+  }
+
+  chmap_seqlock_state* seqlock = (chmap_seqlock_state*)_mem_calloc(
+      chmap->m_procs, 1, sizeof(chmap_seqlock_state));
+  if (!seqlock) {
+    return chm_not_enough_memory;
+  }
+
+  if (pthread_mutex_init(&seqlock->write_lock, NULL) != 0) {
+    _mem_free(chmap->m_procs, seqlock);
+    return chm_not_enough_memory;
+  }
+
+  chmap->seqlock = seqlock;
+
+  return chm_success;
+}
+
+void chmap_reclaim_retired(chashmap* chmap) {
+  if (!chmap || !chmap->seqlock) {
+    return;
+  }
+
+  pthread_mutex_lock(&chmap->seqlock->write_lock);
+  free_retired(chmap);
+  pthread_mutex_unlock(&chmap->seqlock->write_lock);
+}
+
+chashmap_snapshot* chmap_snapshot(chashmap* chmap) {
+  if (!chmap || chmap->version == UINT32_MAX) {
+    return NULL;
+  }
+
+  chashmap_snapshot* snap = (chashmap_snapshot*)_mem_calloc(
+      chmap->m_procs, 1, sizeof(chashmap_snapshot));
+  if (!snap) {
+    return NULL;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  if (!chmap->snapshots) {
+    chmap->snapshots = (chmap_snapshot_state*)_mem_calloc(
+        chmap->m_procs, 1, sizeof(chmap_snapshot_state));
+    if (!chmap->snapshots) {
+      if (chmap->seqlock) {
+        pthread_mutex_unlock(&chmap->seqlock->write_lock);
+      }
+      _mem_free(chmap->m_procs, snap);
+      return NULL;
+    }
+  }
+
+  chmap_snapshot_state* state = chmap->snapshots;
+  snap->chmap = chmap;
+  snap->version = chmap->version++;
+  snap->elem_count = chmap->elem_count;
+  snap->prev = state->newest;
+  snap->next = NULL;
+  if (state->newest) {
+    state->newest->next = snap;
+  } else {
+    state->oldest = snap;
+  }
+  state->newest = snap;
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return snap;
+}
+
+uint32_t chmap_snapshot_elem_count(chashmap_snapshot* snap) {
+  if (snap) {
+    return snap->elem_count;
+  }
+
+  return 0;
+}
+
+llist_node* find_in_snapshot(chashmap_snapshot* snap,
+                             const chmap_pair* key_pair) {
+  chashmap* chmap = snap->chmap;
+  unsigned long hash = calculate_hash(key_pair);
+
+  llist_node* tracker = chmap->bucket_arr[hash % chmap->bucket_arr_size];
+  for (; tracker; tracker = tracker->next) {
+    if (visible_to_snapshot(tracker, snap->version, false) &&
+        compare_key_pairs(tracker->data.key_pair, key_pair)) {
+      return tracker;
+    }
+  }
+
+  chmap_snapshot_state* state = chmap->snapshots;
+  if (state->history_arr_size == 0) {
+    return NULL;
+  }
+
+  tracker = state->history_arr[hash % state->history_arr_size];
+  for (; tracker; tracker = tracker->next) {
+    if (visible_to_snapshot(tracker, snap->version, true) &&
+        compare_key_pairs(tracker->data.key_pair, key_pair)) {
+      return tracker;
+    }
+  }
+
+  return NULL;
+}
+
+chashmap_retval_t chmap_snapshot_get_elem_copy(chashmap_snapshot* snap,
+                                               const chmap_pair* key_pair,
+                                               void* target_buf,
+                                               uint32_t target_buf_size) {
+  if (!snap || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
+      !target_buf || target_buf_size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  llist_node* r = find_in_snapshot(snap, key_pair);
+  if (!r) {
+    return chm_key_not_found;
+  }
+
+  uint32_t min_size = target_buf_size;
+  if (entry_val_size(&r->data) < min_size) {
+    min_size = entry_val_size(&r->data);
+  }
+
+  return read_entry_val(&r->data, target_buf, min_size) ? chm_success
+                                                        : chm_io_error;
+}
+
+void chmap_snapshot_for_each_elem(chashmap_snapshot* snap,
+                                  void (*callback)(const chmap_pair* key_pair,
+                                                   const chmap_pair* val_pair,
+                                                  void* args),
+                                  void* args) {
+  if (!snap || !callback) {
+    return;
+  }
+
+  void* buf = NULL;
+  uint32_t capacity = 0;
+  chmap_pair copy;
+
+  dllist_ref_node* tracker = snap->chmap->head_of_all_elems;
+  for (; tracker; tracker = tracker->next) {
+    chmap_entry* data = &tracker->host->data;
+    if (visible_to_snapshot(tracker->host, snap->version, false)) {
+      chmap_pair* val_pair = callback_val(data, &copy, &buf, &capacity);
+      if (val_pair) {
+        (*callback)(data->key_pair, val_pair, args);
+      }
+    }
+  }
+
+  tracker = snap->chmap->snapshots->head_of_history;
+  for (; tracker; tracker = tracker->next) {
+    chmap_entry* data = &tracker->host->data;
+    if (visible_to_snapshot(tracker->host, snap->version, true)) {
+      chmap_pair* val_pair = callback_val(data, &copy, &buf, &capacity);
+      if (val_pair) {
+        (*callback)(data->key_pair, val_pair, args);
+      }
+    }
+  }
+
+  if (buf) {
+    _mem_free(snap->chmap->m_procs, buf);
+  }
+}
+
+void __chmap_snapshot_release(chashmap_snapshot* snap) {
+  if (!snap) {
+    return;
+  }
+
+  chashmap* chmap = snap->chmap;
+  chmap_snapshot_state* state = chmap->snapshots;
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  if (snap->prev) {
+    snap->prev->next = snap->next;
+  } else {
+    state->oldest = snap->next;
+  }
+  if (snap->next) {
+    snap->next->prev = snap->prev;
+  } else {
+    state->newest = snap->prev;
+  }
+  _mem_free(chmap->m_procs, snap);
+
+  prune_history(chmap);
+  if (!state->newest) {
+    release_spare_versions(chmap);
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+}
+
+void destroy_snapshot_state(chashmap* chmap) {
+  chmap_snapshot_state* state = chmap->snapshots;
+
+  while (state->oldest) {
+    chashmap_snapshot* next = state->oldest->next;
+    _mem_free(chmap->m_procs, state->oldest);
+    state->oldest = next;
+  }
+  state->newest = NULL;
+
+  prune_history(chmap);
+  release_spare_versions(chmap);
+
+  if (state->history_arr) {
+    _mem_free(chmap->m_procs, state->history_arr);
+  }
+  _mem_free(chmap->m_procs, state);
+  chmap->snapshots = NULL;
+}
+
 void __chmap_destroy(chashmap* chmap) {
   if (chmap) {
+    if (chmap->async_snapshot) {
+      async_snapshot_finish(chmap);
+    }
+    release_mutation_hooks(chmap);
     for (uint32_t i = 0; i < chmap->bucket_arr_size; ++i) {
-      destroy_the_whole_llist(chmap->bucket_arr[i], &chmap->head_of_all_elems);
+      destroy_the_whole_llist(chmap->bucket_arr[i], &chmap->mem_usage,
+                              &chmap->head_of_all_elems);
+    }
+    if (chmap->snapshots) {
+      destroy_snapshot_state(chmap);
+    }
+    if (chmap->seqlock) {
+      free_retired(chmap);
+      pthread_mutex_destroy(&chmap->seqlock->write_lock);
+      _mem_free(chmap->m_procs, chmap->seqlock);
+    }
+    if (chmap->vlog) {
+      vlog_close(chmap->vlog);
+    }
+    if (chmap->trace) {
+      trace_close(chmap->trace);
     }
     if (chmap->m_procs) {
       void (*free_func)(void*) = chmap->m_procs->free;
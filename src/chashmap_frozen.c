@@ -0,0 +1,538 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_internal.h"
+
+// An immutable map built on a minimal perfect hash, in the spirit of PTHash:
+// the keys get split into buckets with a skewed distribution, and every
+// bucket gets a pilot value which places all of its keys into free slots.
+// The buckets get processed from the largest to the smallest, so the hard
+// ones get placed while the table is still empty. The table has a little
+// slack (alpha < 1) to keep the pilot search short, and the slots that fall
+// beyond the element count get remapped into the holes below it, so the
+// slot array ends up exactly elem_count long.
+//
+// A lookup hashes the key once, reads a pilot, computes the slot and
+// compares a single key.
+
+#define FROZEN_MAX_SEEDS 16
+#define FROZEN_MAX_PILOT (1U << 24)
+
+struct chmap_frozen {
+  uint64_t seed;
+  uint32_t elem_count;
+  uint32_t slot_count;  // elem_count plus the slack
+  uint32_t bucket_count;
+  uint32_t dense_bucket_count;  // The buckets that get the dense 60% of keys
+  uint32_t* pilots;
+  uint32_t* remap;  // slot_count - elem_count entries
+  uint64_t* offsets;  // elem_count entries, into data
+  unsigned char* data;  // u32 key size, u32 value size, key, value
+  uint64_t data_size;
+  uint64_t source_bytes;
+  chashmap_memmgmt_procs_t procs;
+  chashmap_memmgmt_procs_t* m_procs;
+};
+
+typedef struct frozen_key {
+  uint64_t hash;
+  uint32_t bucket;
+  uint32_t slot;
+  chmap_entry* entry;
+} frozen_key;
+
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdUL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53UL;
+  x ^= x >> 33;
+  return x;
+}
+
+// The map's own hash is the identity for the short keys, and DJB2 collides
+// too easily for the longer ones, so the keys get hashed again here.
+static inline uint64_t frozen_hash(const chmap_pair* key_pair, uint64_t seed) {
+  const unsigned char* bytes = (const unsigned char*)key_pair->ptr;
+  uint32_t len = key_pair->size;
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15UL);
+
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    h = (h ^ mix64(word)) * 0x87c37b91114253d5UL;
+    h = (h << 27) | (h >> 37);
+    bytes += sizeof(word);
+    len -= sizeof(word);
+  }
+
+  if (len > 0) {
+    uint64_t word = 0;
+    memcpy(&word, bytes, len);
+    h = (h ^ mix64(word)) * 0x87c37b91114253d5UL;
+  }
+
+  return mix64(h);
+}
+
+static inline uint32_t frozen_bucket(const chmap_frozen* frozen,
+                                     uint64_t hash) {
+  // 60% of the keys go to 30% of the buckets
+  uint64_t high = hash >> 32;
+  if ((hash & 0xff) < 154) {
+    return high % frozen->dense_bucket_count;
+  }
+  return frozen->dense_bucket_count +
+         high % (frozen->bucket_count - frozen->dense_bucket_count);
+}
+
+static inline uint32_t frozen_slot(const chmap_frozen* frozen, uint64_t hash,
+                                   uint32_t pilot) {
+  uint64_t h2 = mix64(hash ^ 0x2545f4914f6cdd1dUL);
+  return (h2 ^ mix64(pilot + 0x9e3779b97f4a7c15UL)) % frozen->slot_count;
+}
+
+uint32_t floor_log2(uint32_t n) {
+  uint32_t result = 0;
+  while (n >>= 1) {
+    ++result;
+  }
+  return result;
+}
+
+void set_frozen_geometry(chmap_frozen* frozen, uint32_t elem_count) {
+  frozen->elem_count = elem_count;
+  // alpha = 0.99
+  frozen->slot_count = elem_count + elem_count / 99 + 1;
+  // c = 5, as in n * c / log2(n)
+  uint32_t log2 = floor_log2(elem_count) + 1;
+  uint64_t bucket_count = (uint64_t)elem_count * 5 / log2 + 2;
+  frozen->bucket_count = bucket_count > UINT32_MAX ? UINT32_MAX : bucket_count;
+  frozen->dense_bucket_count = frozen->bucket_count * 3 / 10;
+  if (frozen->dense_bucket_count == 0) {
+    frozen->dense_bucket_count = 1;
+  }
+}
+
+// Tries to find a pilot for every bucket with the current seed. The keys
+// must be sorted by bucket, and order lists the buckets from the largest.
+bool search_pilots(chmap_frozen* frozen, frozen_key* keys,
+                   const uint32_t* bucket_starts, const uint32_t* order,
+                   unsigned char* taken) {
+  for (uint32_t i = 0; i < frozen->bucket_count; ++i) {
+    uint32_t bucket = order[i];
+    uint32_t begin = bucket_starts[bucket];
+    uint32_t end = bucket_starts[bucket + 1];
+    if (begin == end) {
+      break;  // The rest are empty too
+    }
+
+    // Two keys with the same hash can never be separated
+    for (uint32_t j = begin; j < end; ++j) {
+      for (uint32_t k = j + 1; k < end; ++k) {
+        if (keys[j].hash == keys[k].hash) {
+          return false;
+        }
+      }
+    }
+
+    bool placed = false;
+    for (uint32_t pilot = 0; pilot < FROZEN_MAX_PILOT && !placed; ++pilot) {
+      uint32_t j = begin;
+      for (; j < end; ++j) {
+        uint32_t slot = frozen_slot(frozen, keys[j].hash, pilot);
+        if (taken[slot]) {
+          break;
+        }
+        // Mark as we go, so the keys of the bucket can't collide either
+        taken[slot] = 1;
+        keys[j].slot = slot;
+      }
+
+      if (j == end) {
+        frozen->pilots[bucket] = pilot;
+        placed = true;
+      } else {
+        for (uint32_t k = begin; k < j; ++k) {
+          taken[keys[k].slot] = 0;
+        }
+      }
+    }
+
+    if (!placed) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int compare_frozen_keys_by_bucket(const void* lhs, const void* rhs) {
+  const frozen_key* l = (const frozen_key*)lhs;
+  const frozen_key* r = (const frozen_key*)rhs;
+  return (l->bucket > r->bucket) - (l->bucket < r->bucket);
+}
+
+// Assigns every key a slot, returns false if no seed works out.
+bool build_mph(chmap_frozen* frozen, frozen_key* keys, uint32_t* bucket_starts,
+               uint32_t* order, unsigned char* taken) {
+  uint32_t n = frozen->elem_count;
+
+  for (uint32_t attempt = 0; attempt < FROZEN_MAX_SEEDS; ++attempt) {
+    frozen->seed = mix64(0x51ed270b27a0ef1dUL + attempt);
+
+    for (uint32_t i = 0; i < n; ++i) {
+      keys[i].hash = frozen_hash(keys[i].entry->key_pair, frozen->seed);
+      keys[i].bucket = frozen_bucket(frozen, keys[i].hash);
+    }
+    qsort(keys, n, sizeof(frozen_key), compare_frozen_keys_by_bucket);
+
+    memset(bucket_starts, 0, (frozen->bucket_count + 1) * sizeof(uint32_t));
+    uint32_t max_bucket_size = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      ++bucket_starts[keys[i].bucket + 1];
+    }
+    for (uint32_t b = 0; b < frozen->bucket_count; ++b) {
+      if (bucket_starts[b + 1] > max_bucket_size) {
+        max_bucket_size = bucket_starts[b + 1];
+      }
+      bucket_starts[b + 1] += bucket_starts[b];
+    }
+
+    // Counting sort of the buckets by size, largest first
+    uint32_t* size_starts = (uint32_t*)_mem_calloc(
+        frozen->m_procs, max_bucket_size + 2, sizeof(uint32_t));
+    if (!size_starts) {
+      return false;
+    }
+    for (uint32_t b = 0; b < frozen->bucket_count; ++b) {
+      uint32_t size = bucket_starts[b + 1] - bucket_starts[b];
+      ++size_starts[max_bucket_size - size + 1];
+    }
+    for (uint32_t s = 0; s <= max_bucket_size; ++s) {
+      size_starts[s + 1] += size_starts[s];
+    }
+    for (uint32_t b = 0; b < frozen->bucket_count; ++b) {
+      uint32_t size = bucket_starts[b + 1] - bucket_starts[b];
+      order[size_starts[max_bucket_size - size]++] = b;
+    }
+    _mem_free(frozen->m_procs, size_starts);
+
+    memset(taken, 0, frozen->slot_count);
+    memset(frozen->pilots, 0, frozen->bucket_count * sizeof(uint32_t));
+    if (search_pilots(frozen, keys, bucket_starts, order, taken)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Moves the slots beyond elem_count into the holes below it.
+void fill_remap(chmap_frozen* frozen, frozen_key* keys,
+                const unsigned char* taken) {
+  uint32_t n = frozen->elem_count;
+  uint32_t hole = 0;
+
+  for (uint32_t slot = n; slot < frozen->slot_count; ++slot) {
+    if (!taken[slot]) {
+      continue;
+    }
+    while (taken[hole]) {
+      ++hole;
+    }
+    frozen->remap[slot - n] = hole++;
+  }
+
+  for (uint32_t i = 0; i < n; ++i) {
+    if (keys[i].slot >= n) {
+      keys[i].slot = frozen->remap[keys[i].slot - n];
+    }
+  }
+}
+
+int compare_frozen_keys_by_slot(const void* lhs, const void* rhs) {
+  const frozen_key* l = (const frozen_key*)lhs;
+  const frozen_key* r = (const frozen_key*)rhs;
+  return (l->slot > r->slot) - (l->slot < r->slot);
+}
+
+// Packs the entries in slot order.
+bool pack_entries(chmap_frozen* frozen, frozen_key* keys) {
+  uint32_t n = frozen->elem_count;
+  qsort(keys, n, sizeof(frozen_key), compare_frozen_keys_by_slot);
+
+  uint64_t data_size = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    data_size += 2 * sizeof(uint32_t) + keys[i].entry->key_pair->size +
+                 entry_val_size(keys[i].entry);
+  }
+
+  frozen->data =
+      (unsigned char*)_mem_alloc(frozen->m_procs, data_size ? data_size : 1);
+  if (!frozen->data) {
+    return false;
+  }
+  frozen->data_size = data_size;
+
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    const chmap_pair* key_pair = keys[i].entry->key_pair;
+    uint32_t val_size = entry_val_size(keys[i].entry);
+    frozen->offsets[i] = offset;
+    memcpy(frozen->data + offset, &key_pair->size, sizeof(uint32_t));
+    memcpy(frozen->data + offset + sizeof(uint32_t), &val_size,
+           sizeof(uint32_t));
+    offset += 2 * sizeof(uint32_t);
+    memcpy(frozen->data + offset, key_pair->ptr, key_pair->size);
+    offset += key_pair->size;
+    if (!read_entry_val(keys[i].entry, frozen->data + offset, val_size)) {
+      return false;
+    }
+    offset += val_size;
+  }
+
+  return true;
+}
+
+// What the live map spends on its structure and its data, not counting the
+// allocator's own overhead.
+uint64_t live_map_bytes(const chashmap* chmap) {
+  uint64_t bytes =
+      sizeof(chashmap) + (uint64_t)chmap->bucket_arr_size * sizeof(llist_node*);
+
+  const dllist_ref_node* tracker = chmap->head_of_all_elems;
+  while (tracker) {
+    const chmap_entry* data = &tracker->host->data;
+    bytes += sizeof(llist_node) + 2 * sizeof(chmap_pair) +
+             data->key_pair->size + data->val_pair->size;
+    tracker = tracker->next;
+  }
+
+  return bytes;
+}
+
+chmap_frozen* chmap_freeze(chashmap* chmap, char** err) {
+  if (!chmap) {
+    if (err) {
+      *err = CERR_STR("Invalid map");
+    }
+    return NULL;
+  }
+
+  chmap_frozen* frozen =
+      (chmap_frozen*)_mem_calloc(chmap->m_procs, 1, sizeof(chmap_frozen));
+  if (!frozen) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    return NULL;
+  }
+  if (chmap->m_procs) {
+    frozen->procs = *chmap->m_procs;
+    frozen->m_procs = &frozen->procs;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  uint32_t n = chmap->elem_count;
+  set_frozen_geometry(frozen, n);
+  frozen->source_bytes = live_map_bytes(chmap);
+
+  const char* build_err = NULL;
+  chashmap_memmgmt_procs_t* m_procs = frozen->m_procs;
+  frozen_key* keys = (frozen_key*)_mem_alloc(
+      m_procs, (n ? n : 1) * sizeof(frozen_key));
+  uint32_t* bucket_starts = (uint32_t*)_mem_alloc(
+      m_procs, (frozen->bucket_count + 1) * sizeof(uint32_t));
+  uint32_t* order = (uint32_t*)_mem_alloc(
+      m_procs, frozen->bucket_count * sizeof(uint32_t));
+  unsigned char* taken =
+      (unsigned char*)_mem_alloc(m_procs, frozen->slot_count);
+  frozen->pilots = (uint32_t*)_mem_calloc(m_procs, frozen->bucket_count,
+                                          sizeof(uint32_t));
+  frozen->remap = (uint32_t*)_mem_calloc(
+      m_procs, frozen->slot_count - n, sizeof(uint32_t));
+  frozen->offsets =
+      (uint64_t*)_mem_alloc(m_procs, (n ? n : 1) * sizeof(uint64_t));
+
+  if (!keys || !bucket_starts || !order || !taken || !frozen->pilots ||
+      !frozen->remap || !frozen->offsets) {
+    build_err = CERR_STR("Failed to allocate buffer");
+  }
+
+  if (!build_err) {
+    uint32_t i = 0;
+    const dllist_ref_node* tracker = chmap->head_of_all_elems;
+    while (tracker) {
+      keys[i++].entry = &tracker->host->data;
+      tracker = tracker->next;
+    }
+
+    if (!build_mph(frozen, keys, bucket_starts, order, taken)) {
+      build_err = CERR_STR("Failed to build the perfect hash");
+    } else {
+      fill_remap(frozen, keys, taken);
+      if (!pack_entries(frozen, keys)) {
+        build_err = CERR_STR("Failed to pack the entries");
+      }
+    }
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  if (keys) _mem_free(m_procs, keys);
+  if (bucket_starts) _mem_free(m_procs, bucket_starts);
+  if (order) _mem_free(m_procs, order);
+  if (taken) _mem_free(m_procs, taken);
+
+  if (build_err) {
+    if (err) {
+      *err = (char*)build_err;
+    }
+    chmap_frozen_destroy(frozen);
+    return NULL;
+  }
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return frozen;
+}
+
+uint32_t chmap_frozen_elem_count(chmap_frozen* frozen) {
+  if (!frozen) {
+    return 0;
+  }
+
+  return frozen->elem_count;
+}
+
+chashmap_retval_t chmap_frozen_get_elem_ref(chmap_frozen* frozen,
+                                            const chmap_pair* key_pair,
+                                            chmap_pair* val_pair) {
+  if (!frozen || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
+      !val_pair) {
+    return chm_invalid_arguments;
+  }
+
+  if (frozen->elem_count == 0) {
+    return chm_key_not_found;
+  }
+
+  uint64_t hash = frozen_hash(key_pair, frozen->seed);
+  uint32_t pilot = frozen->pilots[frozen_bucket(frozen, hash)];
+  uint32_t slot = frozen_slot(frozen, hash, pilot);
+  if (slot >= frozen->elem_count) {
+    slot = frozen->remap[slot - frozen->elem_count];
+  }
+
+  const unsigned char* entry = frozen->data + frozen->offsets[slot];
+  uint32_t key_size, val_size;
+  memcpy(&key_size, entry, sizeof(uint32_t));
+  memcpy(&val_size, entry + sizeof(uint32_t), sizeof(uint32_t));
+  entry += 2 * sizeof(uint32_t);
+
+  if (key_size != key_pair->size ||
+      memcmp(entry, key_pair->ptr, key_size) != 0) {
+    return chm_key_not_found;
+  }
+
+  val_pair->ptr = (void*)(entry + key_size);
+  val_pair->size = val_size;
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_frozen_get_elem_copy(chmap_frozen* frozen,
+                                             const chmap_pair* key_pair,
+                                             void* target_buf,
+                                             uint32_t target_buf_size) {
+  if (!target_buf || target_buf_size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_pair val_pair;
+  chashmap_retval_t result =
+      chmap_frozen_get_elem_ref(frozen, key_pair, &val_pair);
+  if (result != chm_success) {
+    return result;
+  }
+
+  uint32_t min_size = target_buf_size;
+  if (val_pair.size < min_size) {
+    min_size = val_pair.size;
+  }
+  memcpy(target_buf, val_pair.ptr, min_size);
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_frozen_get_stats(chmap_frozen* frozen,
+                                         chmap_frozen_stats* stats) {
+  if (!frozen || !stats) {
+    return chm_invalid_arguments;
+  }
+
+  stats->elem_count = frozen->elem_count;
+  stats->frozen_bytes =
+      sizeof(chmap_frozen) +
+      (uint64_t)frozen->bucket_count * sizeof(uint32_t) +
+      (uint64_t)(frozen->slot_count - frozen->elem_count) * sizeof(uint32_t) +
+      (uint64_t)frozen->elem_count * sizeof(uint64_t) + frozen->data_size;
+  stats->source_bytes = frozen->source_bytes;
+
+  if (frozen->elem_count > 0) {
+    stats->frozen_bytes_per_entry =
+        (double)stats->frozen_bytes / frozen->elem_count;
+    stats->source_bytes_per_entry =
+        (double)stats->source_bytes / frozen->elem_count;
+  } else {
+    stats->frozen_bytes_per_entry = 0;
+    stats->source_bytes_per_entry = 0;
+  }
+
+  return chm_success;
+}
+
+void __chmap_frozen_destroy(chmap_frozen* frozen) {
+  if (!frozen) {
+    return;
+  }
+
+  // The procs live inside the struct, keep a copy around for the last free
+  chashmap_memmgmt_procs_t procs = frozen->procs;
+  chashmap_memmgmt_procs_t* m_procs = frozen->m_procs ? &procs : NULL;
+
+  if (frozen->pilots) _mem_free(m_procs, frozen->pilots);
+  if (frozen->remap) _mem_free(m_procs, frozen->remap);
+  if (frozen->offsets) _mem_free(m_procs, frozen->offsets);
+  if (frozen->data) _mem_free(m_procs, frozen->data);
+  _mem_free(m_procs, frozen);
+}
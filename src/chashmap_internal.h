@@ -0,0 +1,453 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// The definitions shared by the translation units of the library. This
+// header is not installed, and it's not meant to be used by the clients.
+
+#pragma once
+
+#include <chashmap.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define mem_alloc(size) malloc(size)
+#define mem_calloc(elem_count, elem_size) calloc(elem_count, elem_size)
+#define mem_realloc(ptr, new_size) realloc(ptr, new_size)
+#define mem_free(ptr) free(ptr)
+
+#define _mem_alloc(m_procs, size) \
+  (m_procs) ? m_procs->malloc(size) : mem_alloc(size)
+#define _mem_calloc(m_procs, e_count, e_size) \
+  (m_procs) ? m_procs->calloc(e_count, e_size) : mem_calloc(e_count, e_size)
+#define _mem_realloc(m_procs, ptr, new_size) \
+  (m_procs) ? m_procs->realloc(ptr, new_size) : mem_realloc(ptr, new_size)
+#define _mem_free(m_procs, ptr) (m_procs) ? m_procs->free(ptr) : mem_free(ptr)
+
+#ifdef CHMAP_INSTRUMENT
+#include <time.h>
+
+// The histogram buckets are exact below 8ns, and split every power of two
+// into 8 above that.
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_BUCKET_COUNT \
+  ((64 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS)
+
+typedef struct chmap_latency_hist {
+  uint64_t buckets[LATENCY_BUCKET_COUNT];
+  uint64_t count;
+  uint64_t total_nsec;
+  uint64_t max_nsec;
+} chmap_latency_hist;
+
+static inline uint64_t latency_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void record_latency(chashmap* chmap, chmap_latency_op op, uint64_t nsec);
+
+#define LATENCY_START(start) uint64_t start = latency_now()
+#define LATENCY_RECORD(chmap, op, start) \
+  if (chmap) record_latency(chmap, op, latency_now() - start)
+#else
+#define LATENCY_START(start)
+#define LATENCY_RECORD(chmap, op, start)
+#endif
+
+#ifdef CHMAP_USDT
+#include <sys/sdt.h>
+
+// The chain walks longer than this fire the 'long_chain' probe.
+#ifndef CHMAP_USDT_LONG_CHAIN
+#define CHMAP_USDT_LONG_CHAIN 8
+#endif
+
+// The probes of the 'chashmap' provider. With no tracer attached, each of
+// them is a single nop.
+#define USDT_PROBE2(name, a1, a2) DTRACE_PROBE2(chashmap, name, a1, a2)
+#define USDT_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(chashmap, name, a1, a2, a3)
+#else
+#define USDT_PROBE2(name, a1, a2)
+#define USDT_PROBE3(name, a1, a2, a3)
+#endif
+
+#define stringify(s) #s
+#define x_stringify(s) stringify(s)
+#define CERR_STR(x) (__FILE__ ":" x_stringify(__LINE__) " - " x)
+
+extern const uint32_t minimum_allowed_bucket_array_size;
+extern const uint32_t scale_factor;
+
+// The number of sequence counters used in the optimistic read mode. Every
+// bucket array size is a power of two and never smaller than this value, so
+// the stripe of a bucket (index % count) is also (hash % count), and it does
+// not change when the map gets scaled.
+#define SEQLOCK_STRIPE_COUNT 64
+
+#define CACHE_LINE_SIZE 64
+
+static inline void mem_assign(void* dest, void* src, uint32_t size) {
+  if (size == sizeof(unsigned int)) {
+    *(unsigned int*)dest = *(unsigned int*)src;
+  } else if (size == sizeof(unsigned long)) {
+    *(unsigned long*)dest = *(unsigned long*)src;
+  } else if (size == sizeof(unsigned char)) {
+    *(unsigned char*)dest = *(unsigned char*)src;
+  } else if (size == sizeof(unsigned short)) {
+    *(unsigned short*)dest = *(unsigned short*)src;
+  } else {
+    memcpy(dest, src, size);
+  }
+}
+
+static inline void assign_key_to_hash_id(unsigned long* id_ptr, uint32_t size,
+                                         const unsigned char* c_key_ptr) {
+  if (size == sizeof(unsigned int)) {
+    *id_ptr = *(unsigned int*)c_key_ptr;
+  } else if (size == sizeof(unsigned long)) {
+    *id_ptr = *(unsigned long*)c_key_ptr;
+  } else if (size == sizeof(unsigned char)) {
+    *id_ptr = *c_key_ptr;
+  } else if (size == sizeof(unsigned short)) {
+    *id_ptr = *(unsigned short*)c_key_ptr;
+  } else {
+    unsigned char* c_id_ptr = (unsigned char*)id_ptr;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    for (uint32_t i = 0; i < size; ++i) {
+      c_id_ptr[i] = c_key_ptr[i];
+    }
+#else
+    uint32_t offset = sizeof(id) - size;
+    for (uint32_t i = 0; i < size; ++i) {
+      c_id_ptr[offset + i] = c_key_ptr[i];
+    }
+#endif
+  }
+}
+
+static inline unsigned long calculate_hash(const chmap_pair* key_pair) {
+  unsigned long id = 0x0;
+
+  unsigned char* c_key_ptr = (unsigned char*)key_pair->ptr;
+  uint32_t size = key_pair->size;
+
+  if (size <= sizeof(id)) {
+    // Kind of a number assignment.
+    assign_key_to_hash_id(&id, size, c_key_ptr);
+  } else {
+    // DJB2
+    id = 5381;
+    for (uint32_t i = 0; i < size; ++i) {
+      id = ((id << 5) + id) + c_key_ptr[i];
+    }
+  }
+
+  return id;
+}
+
+// The map version an entry got created in, and the one it got deleted (or
+// replaced) in, which is only meaningful once the entry is kept around for a
+// snapshot. Only the entries created while there are snapshots, and the ones
+// moved into the history, have these. An entry without them predates all the
+// snapshots that are around. The spare ones are chained through next_spare.
+typedef union chmap_versions {
+  struct {
+    uint32_t created;
+    uint32_t deleted;
+  };
+  union chmap_versions* next_spare;
+} chmap_versions;
+
+typedef struct chmap_entry {
+  unsigned long hash_val;
+  chmap_pair* key_pair;
+  chmap_pair* val_pair;
+  chashmap_memmgmt_procs_t* m_procs;
+  // The chmap_versions of the entry, if it has them, with the flags below in
+  // the low bits the alignment of the record leaves free. Goes through the
+  // accessors below.
+  uintptr_t versions_and_flags;
+} chmap_entry;
+
+// The value lives in the value log, and val_pair holds a chmap_vlog_ref.
+#define ENTRY_SPILLED ((uintptr_t)1)
+#define ENTRY_FLAGS ENTRY_SPILLED
+
+static inline chmap_versions* entry_versions(const chmap_entry* entry) {
+  return (chmap_versions*)(entry->versions_and_flags & ~ENTRY_FLAGS);
+}
+
+static inline void set_entry_versions(chmap_entry* entry,
+                                      chmap_versions* versions) {
+  entry->versions_and_flags =
+      (uintptr_t)versions | (entry->versions_and_flags & ENTRY_FLAGS);
+}
+
+static inline bool entry_spilled(const chmap_entry* entry) {
+  return entry->versions_and_flags & ENTRY_SPILLED;
+}
+
+static inline void set_entry_spilled(chmap_entry* entry, bool spilled) {
+  entry->versions_and_flags = spilled
+                                  ? entry->versions_and_flags | ENTRY_SPILLED
+                                  : entry->versions_and_flags & ~ENTRY_SPILLED;
+}
+
+typedef struct llist_node llist_node;
+
+typedef struct dllist_ref_node {
+  // All these pointers are mere references,
+  // and they are not 'owned' by this struct
+  struct dllist_ref_node* prev;
+  struct dllist_ref_node* next;
+  llist_node* host;
+} dllist_ref_node;
+
+struct llist_node {
+  struct llist_node* next;
+  dllist_ref_node dllist_refs;
+  chmap_entry data;
+};
+
+// What every node costs on top of its key and value buffers
+#define NODE_OVERHEAD_BYTES (sizeof(llist_node) + 2 * sizeof(chmap_pair))
+
+// The bytes held by the nodes of a map, kept up to date as the nodes come and
+// go. The bucket array is left out, its size is known at any time. The calls
+// count the allocations of both.
+typedef struct chmap_mem_usage {
+  uint64_t node_bytes;
+  uint64_t key_bytes;
+  uint64_t val_bytes;
+  uint64_t alloc_calls;
+  uint64_t realloc_calls;
+  uint64_t free_calls;
+} chmap_mem_usage;
+
+// A node is made of this many allocations
+#define NODE_ALLOC_COUNT 5
+
+// What 'chmap_get_stats' reports besides the shape of the chains. The lookup
+// counters only move in the CHMAP_PROBE_STATS builds, and they get updated
+// atomically since the optimistic readers run concurrently.
+typedef struct chmap_op_counters {
+  uint64_t scale_up_count;
+  uint64_t scale_down_count;
+  uint64_t scale_nsec;
+  uint64_t hit_lookups;
+  uint64_t hit_compares;
+  uint64_t miss_lookups;
+  uint64_t miss_compares;
+} chmap_op_counters;
+
+// The optimistic readers walk the chains without any locks, and they might
+// still be looking at a node or a buffer while a writer replaces it. That's
+// why, in the optimistic read mode, such memory areas are 'retired' instead
+// of being freed, and they stay around until 'chmap_reclaim_retired' gets
+// called, or the map gets destroyed.
+typedef struct retired_mem {
+  struct retired_mem* next;
+  void* ptr;
+  void* aux;
+} retired_mem;
+
+typedef struct chmap_seqlock_state {
+  // Serializes the writers, the readers never touch it.
+  pthread_mutex_t write_lock;
+  // Bumped around the operations that replace the whole bucket array, or
+  // touch all the buckets at once (scaling and resetting).
+  uint32_t resize_seq;
+  // Bumped around the mutations of the chains that belong to a stripe.
+  uint32_t stripe_seqs[SEQLOCK_STRIPE_COUNT];
+  // The retired nodes are chained through their dllist_refs, as they are
+  // already detached from the list of all elements.
+  dllist_ref_node* retired_nodes;
+  retired_mem* retired_mem;
+  // The bytes of the retired nodes and value pairs, which the memory usage
+  // still counts, but the memory limit leaves out, as evicting more entries
+  // would not free any of them.
+  uint64_t retired_bytes;
+} chmap_seqlock_state;
+
+// The snapshots share the nodes with the live map. As long as there is a
+// snapshot, an entry that is visible to one is never modified in place or
+// freed. Instead, it gets moved into the 'history', a separate chained hash
+// table, and the live map continues with a copy (or without it, if it got
+// deleted). A snapshot of version 'v' sees the live entries created at or
+// before 'v', and the history entries that were alive at 'v'.
+struct chashmap_snapshot {
+  chashmap* chmap;
+  uint32_t version;
+  uint32_t elem_count;
+  struct chashmap_snapshot* prev;
+  struct chashmap_snapshot* next;
+};
+
+typedef struct chmap_snapshot_state {
+  // Ordered by version, oldest first.
+  chashmap_snapshot* oldest;
+  chashmap_snapshot* newest;
+  llist_node** history_arr;
+  uint32_t history_arr_size;
+  uint32_t history_count;
+  dllist_ref_node* head_of_history;
+  // Reserved along with the history, for the entries that move into it
+  // without their versions.
+  chmap_versions* spare_versions;
+  uint32_t spare_count;
+} chmap_snapshot_state;
+
+// Gets told about every successful mutation, while the map is still locked
+// in the optimistic read mode, so the calls come in the order the mutations
+// got applied. Used by the layers that need to follow the map's contents,
+// like the write-ahead log.
+typedef struct chmap_mutation_hook {
+  void (*on_insert)(void* ctx, const chmap_pair* key_pair,
+                    const chmap_pair* val_pair);
+  void (*on_delete)(void* ctx, const chmap_pair* key_pair);
+  void (*on_reset)(void* ctx);
+  // Called when the hook gets removed, or the map gets destroyed
+  void (*release)(void* ctx);
+  void* ctx;
+  struct chmap_mutation_hook* next;
+} chmap_mutation_hook;
+
+// The state of a snapshot being streamed to a file in the background, see
+// chashmap_snapshot_async.c.
+typedef struct chmap_async_snapshot chmap_async_snapshot;
+
+// The value log the large values get spilled to, see chashmap_vlog.c.
+typedef struct chmap_vlog chmap_vlog;
+
+// The trace of the API calls being recorded, see chashmap_trace.c.
+typedef struct chmap_trace chmap_trace;
+
+// What a node holds in place of a value that got spilled to the value log.
+typedef struct chmap_vlog_ref {
+  chmap_vlog* vlog;
+  uint32_t handle;
+  uint32_t size;
+} chmap_vlog_ref;
+
+struct chashmap {
+  uint32_t elem_count;
+  uint32_t bucket_arr_size;
+  uint32_t elem_count_to_scale_up;
+  uint32_t elem_count_to_scale_down;
+  llist_node** bucket_arr;
+  dllist_ref_node* head_of_all_elems;
+  chashmap_memmgmt_procs_t* m_procs;
+  chmap_seqlock_state* seqlock;
+  uint32_t resize_thread_count;
+  // Gets bumped every time a snapshot is taken.
+  uint32_t version;
+  chmap_snapshot_state* snapshots;
+  chmap_mutation_hook* hooks;
+  chmap_async_snapshot* async_snapshot;
+  chmap_vlog* vlog;
+  chmap_trace* trace;
+  chmap_mem_usage mem_usage;
+  // 0 when the map is not limited
+  uint64_t mem_limit;
+  int (*evict_cb)(const chmap_pair* key_pair, const chmap_pair* val_pair,
+                  void* args);
+  void* evict_args;
+  // The bucket the next eviction round starts from
+  uint32_t evict_cursor;
+  chmap_op_counters counters;
+#ifdef CHMAP_INSTRUMENT
+  chmap_latency_hist latency[chmap_latency_op_count];
+#endif
+};
+
+void attach_node_to_dllist(dllist_ref_node** head, dllist_ref_node* node,
+                           llist_node* host);
+void detach_node_from_dllist(dllist_ref_node** head, dllist_ref_node* node);
+// Both keep 'usage' up to date unless it is NULL.
+llist_node* create_llist_node(chmap_mem_usage* usage,
+                              dllist_ref_node** head_of_all_elems,
+                              chmap_entry* data);
+void destroy_llist_node(chmap_mem_usage* usage,
+                        dllist_ref_node** head_of_all_elems, llist_node* elem);
+void set_chmap_scaling_limits(chashmap* chmap);
+void scale_chmap(chashmap* chmap, bool up);
+uint32_t find_nearest_gte_power_of_two(uint32_t input);
+void chmap_add_mutation_hook(chashmap* chmap, chmap_mutation_hook* hook);
+bool chmap_remove_mutation_hook(chashmap* chmap, chmap_mutation_hook* hook);
+
+// Passed to 'async_snapshot_before_write' when every bucket is about to change
+#define ASYNC_SNAPSHOT_ALL_BUCKETS UINT32_MAX
+
+// Should be called by the writers before they modify a bucket while an async
+// snapshot exists. Makes sure the bucket made it into the snapshot, and
+// cleans up a finished snapshot. Returns false if the bucket could not be
+// copied for lack of memory.
+bool async_snapshot_before_write(chashmap* chmap, uint32_t index);
+// Waits for a running async snapshot to finish, and cleans it up.
+void async_snapshot_finish(chashmap* chmap);
+
+// Whether a value of the given size should go to the value log.
+bool vlog_should_spill(chmap_vlog* vlog, uint32_t size);
+// Appends a value to the log, and fills ref in with where it went.
+bool vlog_append(chmap_vlog* vlog, const chmap_pair* val_pair,
+                 chmap_vlog_ref* ref);
+// Reads the first len bytes of a spilled value into buf.
+bool vlog_read(const chmap_vlog_ref* ref, void* buf, uint32_t len);
+// Turns a spilled value into garbage, to be collected in the background.
+void vlog_release(const chmap_vlog_ref* ref);
+void vlog_close(chmap_vlog* vlog);
+
+// Appends a record of a call to the trace, key_pair is NULL for the resets.
+void trace_record(chmap_trace* trace, chmap_trace_op op,
+                  const chmap_pair* key_pair, uint32_t val_size,
+                  chashmap_retval_t result);
+// Writes out the buffered records and frees the trace, returns false if any
+// of the records could not be written.
+bool trace_close(chmap_trace* trace);
+
+static inline uint32_t entry_val_size(const chmap_entry* entry) {
+  if (entry_spilled(entry)) {
+    return ((const chmap_vlog_ref*)entry->val_pair->ptr)->size;
+  }
+  return entry->val_pair->size;
+}
+
+// Copies the first len bytes of the value of the entry into dest, wherever
+// the value lives.
+static inline bool read_entry_val(const chmap_entry* entry, void* dest,
+                                  uint32_t len) {
+  if (entry_spilled(entry)) {
+    return vlog_read((const chmap_vlog_ref*)entry->val_pair->ptr, dest, len);
+  }
+  memcpy(dest, entry->val_pair->ptr, len);
+  return true;
+}
+
+// Points val_pair at the value of the entry. A spilled value gets read into
+// *buf first, which grows as needed and is up to the caller to free.
+bool load_entry_val(const chmap_entry* entry, chmap_pair* val_pair,
+                    void** buf, uint32_t* capacity);
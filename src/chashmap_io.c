@@ -0,0 +1,807 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The snapshot format, all the integers are in the native byte order, which
+// is recorded in the header:
+//
+//   header:   magic "CHMP", u16 format version, u16 hash function id,
+//             u32 byte order mark, u64 element count
+//   chunks:   magic "CHNK", u32 record count, u64 payload size,
+//             u64 checksum of the payload, followed by the payload
+//   records:  u64 hash, u32 key size, u32 value size, key bytes, value bytes
+//   trailer:  magic "CHME", u32 reserved, u64 chunk count,
+//             u64 checksum of the chunk headers
+//
+// The stored hashes let the loader place the entries without hashing the
+// keys again, as long as the hash function id matches. A chunk only holds
+// whole records and carries its own checksum, so the chunks of a file can be
+// found by hopping over the payloads and parsed independently of each other.
+//
+// The first version of the format had the records right after the header,
+// followed by a u64 checksum of the records and magic "CHME". It is still
+// read by 'chmap_load'.
+const char snapshot_magic[4] = {'C', 'H', 'M', 'P'};
+const char snapshot_end_magic[4] = {'C', 'H', 'M', 'E'};
+const char snapshot_chunk_magic[4] = {'C', 'H', 'N', 'K'};
+const uint16_t snapshot_format_version = 2;
+const uint16_t snapshot_unchunked_format_version = 1;
+// The identity of the short keys, and DJB2 for the rest.
+const uint16_t snapshot_hash_function_id = 1;
+const uint32_t snapshot_byte_order_mark = 0x01020304;
+
+void checksum_init(chmap_checksum* checksum) {
+  memset(checksum, 0, sizeof(chmap_checksum));
+  checksum->state = 0x9e3779b97f4a7c15UL;
+}
+
+static inline uint64_t checksum_mix(uint64_t state, uint64_t word) {
+  state ^= word * 0x87c37b91114253d5UL;
+  state = (state << 31) | (state >> 33);
+  return state * 0x4cf5ad432745937fUL;
+}
+
+// Works on 8 byte words, and carries the leftovers to the next call, so that
+// the result does not depend on how the stream gets split up.
+void checksum_update(chmap_checksum* checksum, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  checksum->total_len += len;
+
+  if (checksum->pending_len > 0) {
+    size_t room = sizeof(uint64_t) - checksum->pending_len;
+    size_t chunk = len < room ? len : room;
+    memcpy(checksum->pending + checksum->pending_len, bytes, chunk);
+    checksum->pending_len += chunk;
+    bytes += chunk;
+    len -= chunk;
+    if (checksum->pending_len < sizeof(uint64_t)) {
+      return;
+    }
+    uint64_t word;
+    memcpy(&word, checksum->pending, sizeof(word));
+    checksum->state = checksum_mix(checksum->state, word);
+    checksum->pending_len = 0;
+  }
+
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    checksum->state = checksum_mix(checksum->state, word);
+    bytes += sizeof(word);
+    len -= sizeof(word);
+  }
+
+  memcpy(checksum->pending, bytes, len);
+  checksum->pending_len = len;
+}
+
+uint64_t checksum_final(const chmap_checksum* checksum) {
+  uint64_t word = 0;
+  memcpy(&word, checksum->pending, checksum->pending_len);
+  uint64_t state = checksum_mix(checksum->state, word);
+  state ^= checksum->total_len;
+  state ^= state >> 33;
+  state *= 0xff51afd7ed558ccdUL;
+  state ^= state >> 33;
+  return state;
+}
+
+bool write_fully(int fd, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  while (len > 0) {
+    ssize_t written = write(fd, bytes, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    len -= written;
+  }
+  return true;
+}
+
+bool writer_flush(chmap_writer* writer) {
+  if (writer->len > 0) {
+    if (!write_fully(writer->fd, writer->buf, writer->len)) {
+      return false;
+    }
+    writer->len = 0;
+  }
+  return true;
+}
+
+bool writer_append(chmap_writer* writer, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+
+  if (writer->checksummed) {
+    checksum_update(&writer->checksum, data, len);
+  }
+
+  while (len > 0) {
+    if (writer->len == CHMAP_IO_BUF_SIZE && !writer_flush(writer)) {
+      return false;
+    }
+    size_t room = CHMAP_IO_BUF_SIZE - writer->len;
+    size_t chunk = len < room ? len : room;
+    memcpy(writer->buf + writer->len, bytes, chunk);
+    writer->len += chunk;
+    bytes += chunk;
+    len -= chunk;
+  }
+
+  return true;
+}
+
+void writer_init(chmap_writer* writer, int fd) {
+  writer->fd = fd;
+  writer->len = 0;
+  writer->checksummed = true;
+  checksum_init(&writer->checksum);
+}
+
+bool snapshot_writer_init(chmap_snapshot_writer* writer, int fd,
+                          chashmap_memmgmt_procs_t* m_procs,
+                          uint64_t elem_count) {
+  memset(writer, 0, sizeof(chmap_snapshot_writer));
+  writer->fd = fd;
+  writer->m_procs = m_procs;
+  writer->chunk_capacity =
+      sizeof(chmap_chunk_header) + CHMAP_SNAPSHOT_CHUNK_SIZE;
+  writer->chunk = (unsigned char*)_mem_alloc(m_procs, writer->chunk_capacity);
+  if (!writer->chunk) {
+    return false;
+  }
+  writer->chunk_len = sizeof(chmap_chunk_header);
+  checksum_init(&writer->index_checksum);
+
+  chmap_snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.format_version = snapshot_format_version;
+  header.hash_function_id = snapshot_hash_function_id;
+  header.byte_order_mark = snapshot_byte_order_mark;
+  header.elem_count = elem_count;
+
+  return write_fully(fd, &header, sizeof(header));
+}
+
+bool snapshot_writer_flush_chunk(chmap_snapshot_writer* writer) {
+  if (writer->record_count == 0) {
+    return true;
+  }
+
+  chmap_chunk_header header;
+  memcpy(header.magic, snapshot_chunk_magic, sizeof(header.magic));
+  header.record_count = writer->record_count;
+  header.payload_size = writer->chunk_len - sizeof(header);
+
+  chmap_checksum checksum;
+  checksum_init(&checksum);
+  checksum_update(&checksum, writer->chunk + sizeof(header),
+                  header.payload_size);
+  header.payload_checksum = checksum_final(&checksum);
+
+  memcpy(writer->chunk, &header, sizeof(header));
+  checksum_update(&writer->index_checksum, &header, sizeof(header));
+  if (!write_fully(writer->fd, writer->chunk, writer->chunk_len)) {
+    return false;
+  }
+
+  writer->chunk_len = sizeof(header);
+  writer->record_count = 0;
+  ++writer->chunk_count;
+
+  return true;
+}
+
+// Makes room for a record of len bytes, closing the current chunk if the
+// record does not fit in it.
+bool snapshot_writer_reserve(chmap_snapshot_writer* writer, size_t len) {
+  if (writer->chunk_len + len <= writer->chunk_capacity) {
+    return true;
+  }
+
+  if (!snapshot_writer_flush_chunk(writer)) {
+    return false;
+  }
+
+  size_t needed = sizeof(chmap_chunk_header) + len;
+  if (needed <= writer->chunk_capacity) {
+    return true;
+  }
+
+  unsigned char* chunk =
+      (unsigned char*)_mem_realloc(writer->m_procs, writer->chunk, needed);
+  if (!chunk) {
+    return false;
+  }
+  writer->chunk = chunk;
+  writer->chunk_capacity = needed;
+
+  return true;
+}
+
+bool snapshot_writer_append_record(chmap_snapshot_writer* writer,
+                                   unsigned long hash,
+                                   const chmap_pair* key_pair,
+                                   const chmap_pair* val_pair) {
+  chmap_record_header header = {.hash = hash,
+                                .key_size = key_pair->size,
+                                .val_size = val_pair->size};
+  if (!snapshot_writer_reserve(
+          writer, sizeof(header) + header.key_size + header.val_size)) {
+    return false;
+  }
+
+  unsigned char* dest = writer->chunk + writer->chunk_len;
+  memcpy(dest, &header, sizeof(header));
+  dest += sizeof(header);
+  memcpy(dest, key_pair->ptr, header.key_size);
+  dest += header.key_size;
+  memcpy(dest, val_pair->ptr, header.val_size);
+  writer->chunk_len += sizeof(header) + header.key_size + header.val_size;
+  ++writer->record_count;
+
+  return true;
+}
+
+// Appends records that are already in the on-disk layout, splitting them up
+// at the record boundaries if they don't fit in the current chunk.
+bool snapshot_writer_append_encoded(chmap_snapshot_writer* writer,
+                                    const unsigned char* data, size_t len) {
+  const unsigned char* end = data + len;
+  while (data < end) {
+    chmap_record_header header;
+    if (!decode_record(data, end, &header)) {
+      return false;
+    }
+
+    size_t record_len = sizeof(header) + header.key_size + header.val_size;
+    if (!snapshot_writer_reserve(writer, record_len)) {
+      return false;
+    }
+    memcpy(writer->chunk + writer->chunk_len, data, record_len);
+    writer->chunk_len += record_len;
+    ++writer->record_count;
+    data += record_len;
+  }
+
+  return true;
+}
+
+bool snapshot_writer_finish(chmap_snapshot_writer* writer) {
+  if (!snapshot_writer_flush_chunk(writer)) {
+    return false;
+  }
+
+  chmap_chunked_trailer trailer;
+  memcpy(trailer.magic, snapshot_end_magic, sizeof(trailer.magic));
+  trailer.reserved = 0;
+  trailer.chunk_count = writer->chunk_count;
+  trailer.index_checksum = checksum_final(&writer->index_checksum);
+
+  return write_fully(writer->fd, &trailer, sizeof(trailer));
+}
+
+void snapshot_writer_release(chmap_snapshot_writer* writer) {
+  if (writer->chunk) {
+    _mem_free(writer->m_procs, writer->chunk);
+    writer->chunk = NULL;
+  }
+}
+
+// The caller is expected to hold the write lock in the optimistic mode.
+chashmap_retval_t save_chmap(chashmap* chmap, int fd) {
+  chmap_snapshot_writer writer;
+  bool result =
+      snapshot_writer_init(&writer, fd, chmap->m_procs, chmap->elem_count);
+
+  void* val_buf = NULL;
+  uint32_t val_capacity = 0;
+
+  dllist_ref_node* tracker = chmap->head_of_all_elems;
+  while (result && tracker) {
+    chmap_entry* data = &tracker->host->data;
+    chmap_pair val_pair;
+    result = load_entry_val(data, &val_pair, &val_buf, &val_capacity) &&
+             snapshot_writer_append_record(&writer, data->hash_val,
+                                           data->key_pair, &val_pair);
+    tracker = tracker->next;
+  }
+
+  result = result && snapshot_writer_finish(&writer);
+
+  if (val_buf) _mem_free(chmap->m_procs, val_buf);
+  snapshot_writer_release(&writer);
+
+  return result ? chm_success : chm_io_error;
+}
+
+chashmap_retval_t chmap_save(chashmap* chmap, int fd) {
+  if (!chmap || fd < 0) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  chashmap_retval_t result = save_chmap(chmap, fd);
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return result;
+}
+
+bool read_fully(int fd, void* data, size_t len) {
+  unsigned char* bytes = (unsigned char*)data;
+  while (len > 0) {
+    ssize_t n = read(fd, bytes, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      // Premature end of file
+      return false;
+    }
+    bytes += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Returns a copy of path with suffix appended, e.g. the ".tmp" file a
+// snapshot is written to before it gets renamed over path.
+char* copy_path(chashmap_memmgmt_procs_t* m_procs, const char* path,
+                const char* suffix) {
+  size_t path_len = strlen(path);
+  size_t suffix_len = strlen(suffix);
+  char* copy = (char*)_mem_alloc(m_procs, path_len + suffix_len + 1);
+  if (copy) {
+    memcpy(copy, path, path_len);
+    memcpy(copy + path_len, suffix, suffix_len + 1);
+  }
+  return copy;
+}
+
+// Makes the rename of a file durable.
+bool sync_parent_dir(const char* path, chashmap_memmgmt_procs_t* m_procs) {
+  // dirname may modify its argument
+  char* copy = copy_path(m_procs, path, "");
+  if (!copy) {
+    return false;
+  }
+
+  int dir_fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  _mem_free(m_procs, copy);
+  if (dir_fd < 0) {
+    return false;
+  }
+
+  bool result = fsync(dir_fd) == 0;
+  close(dir_fd);
+
+  return result;
+}
+
+void reader_init(chmap_reader* reader, int fd) {
+  reader->fd = fd;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->checksummed = true;
+  checksum_init(&reader->checksum);
+}
+
+bool reader_read(chmap_reader* reader, void* data, size_t len) {
+  unsigned char* bytes = (unsigned char*)data;
+  size_t total = len;
+
+  while (len > 0) {
+    if (reader->pos == reader->len) {
+      ssize_t n = read(reader->fd, reader->buf, CHMAP_IO_BUF_SIZE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      reader->pos = 0;
+      reader->len = n;
+    }
+    size_t available = reader->len - reader->pos;
+    size_t chunk = len < available ? len : available;
+    memcpy(bytes, reader->buf + reader->pos, chunk);
+    reader->pos += chunk;
+    bytes += chunk;
+    len -= chunk;
+  }
+
+  if (reader->checksummed) {
+    checksum_update(&reader->checksum, data, total);
+  }
+
+  return true;
+}
+
+const char* check_snapshot_header(const chmap_snapshot_header* header) {
+  if (memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0) {
+    return CERR_STR("Not a chashmap snapshot");
+  }
+  if (header->byte_order_mark != snapshot_byte_order_mark) {
+    return CERR_STR("The snapshot was saved with a different byte order");
+  }
+  if (header->format_version != snapshot_format_version &&
+      header->format_version != snapshot_unchunked_format_version) {
+    return CERR_STR("Unsupported snapshot format version");
+  }
+  if (header->hash_function_id != snapshot_hash_function_id) {
+    return CERR_STR("The snapshot was saved with a different hash function");
+  }
+  if (header->elem_count > UINT32_MAX) {
+    return CERR_STR("The snapshot has too many elements");
+  }
+  return NULL;
+}
+
+// Parses the record header at pos, and returns where the key starts, or
+// NULL if the record is malformed or runs past end.
+const unsigned char* decode_record(const unsigned char* pos,
+                                   const unsigned char* end,
+                                   chmap_record_header* record) {
+  if ((size_t)(end - pos) < sizeof(chmap_record_header)) {
+    return NULL;
+  }
+  memcpy(record, pos, sizeof(chmap_record_header));
+  pos += sizeof(chmap_record_header);
+
+  if (record->key_size == 0 || record->val_size == 0 ||
+      (uint64_t)record->key_size + record->val_size > (uint64_t)(end - pos)) {
+    return NULL;
+  }
+
+  return pos;
+}
+
+// The smallest bucket array that holds elem_count elements without scaling.
+uint32_t bucket_arr_size_for(uint64_t elem_count) {
+  uint64_t size = elem_count * 4 / 6 + 1;
+  if (size > (1U << 31)) {
+    size = 1U << 31;
+  }
+  return find_nearest_gte_power_of_two((uint32_t)size);
+}
+
+// How many elements a load from a stream presizes the map for at most, the
+// map grows past that as the records come in.
+const uint32_t load_presize_cap = 1 << 16;
+
+// The function 'check_elem_count' makes sure that byte_count bytes of
+// records can hold elem_count of them, as nothing covers the element count
+// of the header, which sizes the bucket array, with a checksum.
+const char* check_elem_count(uint64_t elem_count, uint64_t byte_count) {
+  // Every record has a key and a value of at least one byte each
+  if (elem_count > byte_count / (sizeof(chmap_record_header) + 2)) {
+    return CERR_STR("The element count does not match the records");
+  }
+  return NULL;
+}
+
+// The element count to presize the map for before loading the records that
+// follow on fd, checked against the rest of the file if there is one.
+const char* presize_count_for(int fd, uint64_t elem_count,
+                              uint64_t* presize_count) {
+  struct stat st;
+  off_t offset;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && offset <= st.st_size) {
+    *presize_count = elem_count;
+    return check_elem_count(elem_count, (uint64_t)(st.st_size - offset));
+  }
+
+  *presize_count = elem_count < load_presize_cap ? elem_count
+                                                 : load_presize_cap;
+  return NULL;
+}
+
+// Links a node that is known not to be in the map yet, reusing its hash.
+bool bulk_insert(chashmap* chmap, chmap_entry* data) {
+  llist_node* node =
+      create_llist_node(&chmap->mem_usage, &chmap->head_of_all_elems, data);
+  if (!node) {
+    return false;
+  }
+
+  uint32_t index = data->hash_val % chmap->bucket_arr_size;
+  node->next = chmap->bucket_arr[index];
+  chmap->bucket_arr[index] = node;
+  if (++chmap->elem_count >= chmap->elem_count_to_scale_up) {
+    // Only when the map got presized for less than the header said
+    scale_chmap(chmap, true);
+  }
+
+  return true;
+}
+
+// A growable scratch buffer for the keys and the values being loaded.
+bool reserve_scratch(chashmap* chmap, void** buf, uint32_t* capacity,
+                     uint32_t size) {
+  if (size <= *capacity) {
+    return true;
+  }
+
+  void* new_buf = _mem_realloc(chmap->m_procs, *buf, size);
+  if (!new_buf) {
+    return false;
+  }
+
+  *buf = new_buf;
+  *capacity = size;
+
+  return true;
+}
+
+// The records of the first format version, followed by a single checksum.
+const char* load_unchunked_records(chashmap* chmap, chmap_reader* reader,
+                                   uint64_t elem_count) {
+  void* key_buf = NULL;
+  void* val_buf = NULL;
+  uint32_t key_capacity = 0;
+  uint32_t val_capacity = 0;
+  const char* load_err = NULL;
+
+  for (uint64_t i = 0; i < elem_count && !load_err; ++i) {
+    chmap_record_header record;
+    if (!reader_read(reader, &record, sizeof(record)) ||
+        record.key_size == 0 || record.val_size == 0) {
+      load_err = CERR_STR("Failed to read a record");
+      break;
+    }
+
+    if (!reserve_scratch(chmap, &key_buf, &key_capacity, record.key_size) ||
+        !reserve_scratch(chmap, &val_buf, &val_capacity, record.val_size)) {
+      load_err = CERR_STR("Failed to allocate a record buffer");
+      break;
+    }
+
+    if (!reader_read(reader, key_buf, record.key_size) ||
+        !reader_read(reader, val_buf, record.val_size)) {
+      load_err = CERR_STR("Failed to read a record");
+      break;
+    }
+
+    chmap_entry data = {
+        .hash_val = record.hash,
+        .key_pair = &(chmap_pair){.ptr = key_buf, .size = record.key_size},
+        .val_pair = &(chmap_pair){.ptr = val_buf, .size = record.val_size},
+        .m_procs = chmap->m_procs};
+    if (!bulk_insert(chmap, &data)) {
+      load_err = CERR_STR("Failed to allocate an element");
+    }
+  }
+
+  if (!load_err) {
+    chmap_snapshot_trailer trailer;
+    uint64_t expected = checksum_final(&reader->checksum);
+    reader->checksummed = false;
+    if (!reader_read(reader, &trailer, sizeof(trailer)) ||
+        memcmp(trailer.magic, snapshot_end_magic, sizeof(trailer.magic)) !=
+            0) {
+      load_err = CERR_STR("Failed to read the snapshot trailer");
+    } else if (trailer.checksum != expected) {
+      load_err = CERR_STR("Checksum mismatch");
+    }
+  }
+
+  if (key_buf) _mem_free(chmap->m_procs, key_buf);
+  if (val_buf) _mem_free(chmap->m_procs, val_buf);
+
+  return load_err;
+}
+
+const char* load_chunk_records(chashmap* chmap, const unsigned char* payload,
+                               const chmap_chunk_header* chunk) {
+  const unsigned char* pos = payload;
+  const unsigned char* end = payload + chunk->payload_size;
+
+  for (uint32_t i = 0; i < chunk->record_count; ++i) {
+    chmap_record_header record;
+    const unsigned char* key = decode_record(pos, end, &record);
+    if (!key) {
+      return CERR_STR("Failed to read a record");
+    }
+
+    chmap_entry data = {
+        .hash_val = record.hash,
+        .key_pair = &(chmap_pair){.ptr = (void*)key, .size = record.key_size},
+        .val_pair = &(chmap_pair){.ptr = (void*)(key + record.key_size),
+                                  .size = record.val_size},
+        .m_procs = chmap->m_procs};
+    if (!bulk_insert(chmap, &data)) {
+      return CERR_STR("Failed to allocate an element");
+    }
+    pos = key + record.key_size + record.val_size;
+  }
+
+  if (pos != end) {
+    return CERR_STR("The chunk has trailing bytes");
+  }
+
+  return NULL;
+}
+
+const char* load_chunks(chashmap* chmap, chmap_reader* reader,
+                        uint64_t elem_count) {
+  reader->checksummed = false;
+
+  chmap_checksum index_checksum;
+  checksum_init(&index_checksum);
+  uint64_t chunk_count = 0;
+  uint64_t record_count = 0;
+  void* payload = NULL;
+  uint32_t payload_capacity = 0;
+  const char* load_err = NULL;
+
+  for (;;) {
+    chmap_chunk_header chunk;
+    if (!reader_read(reader, &chunk, sizeof(chunk))) {
+      load_err = CERR_STR("Failed to read a chunk header");
+      break;
+    }
+
+    if (memcmp(chunk.magic, snapshot_end_magic, sizeof(chunk.magic)) == 0) {
+      chmap_chunked_trailer trailer;
+      memcpy(&trailer, &chunk, sizeof(trailer));
+      if (trailer.chunk_count != chunk_count ||
+          trailer.index_checksum != checksum_final(&index_checksum)) {
+        load_err = CERR_STR("Checksum mismatch");
+      } else if (record_count != elem_count) {
+        load_err = CERR_STR("The element count does not match the records");
+      }
+      break;
+    }
+
+    if (memcmp(chunk.magic, snapshot_chunk_magic, sizeof(chunk.magic)) != 0 ||
+        chunk.payload_size > UINT32_MAX) {
+      load_err = CERR_STR("Failed to read a chunk header");
+      break;
+    }
+    checksum_update(&index_checksum, &chunk, sizeof(chunk));
+
+    if (!reserve_scratch(chmap, &payload, &payload_capacity,
+                         (uint32_t)chunk.payload_size)) {
+      load_err = CERR_STR("Failed to allocate a chunk buffer");
+      break;
+    }
+    if (!reader_read(reader, payload, chunk.payload_size)) {
+      load_err = CERR_STR("Failed to read a chunk");
+      break;
+    }
+
+    chmap_checksum checksum;
+    checksum_init(&checksum);
+    checksum_update(&checksum, payload, chunk.payload_size);
+    if (checksum_final(&checksum) != chunk.payload_checksum) {
+      load_err = CERR_STR("Checksum mismatch");
+      break;
+    }
+
+    load_err = load_chunk_records(chmap, (const unsigned char*)payload, &chunk);
+    if (load_err) {
+      break;
+    }
+    record_count += chunk.record_count;
+    ++chunk_count;
+  }
+
+  if (payload) _mem_free(chmap->m_procs, payload);
+
+  return load_err;
+}
+
+chashmap* chmap_load(int fd, chashmap_memmgmt_procs_t* mmgmt_procs,
+                     char** err) {
+  if (fd < 0) {
+    if (err) {
+      *err = CERR_STR("Invalid file descriptor");
+    }
+    return NULL;
+  }
+
+  chmap_snapshot_header header;
+  if (!read_fully(fd, &header, sizeof(header))) {
+    if (err) {
+      *err = CERR_STR("Failed to read the snapshot header");
+    }
+    return NULL;
+  }
+
+  const char* header_err = check_snapshot_header(&header);
+  if (header_err) {
+    if (err) {
+      *err = (char*)header_err;
+    }
+    return NULL;
+  }
+
+  uint64_t presize_count = 0;
+  header_err = presize_count_for(fd, header.elem_count, &presize_count);
+  if (header_err) {
+    if (err) {
+      *err = (char*)header_err;
+    }
+    return NULL;
+  }
+
+  chashmap* chmap =
+      chmap_create_mp(bucket_arr_size_for(presize_count), mmgmt_procs, err);
+  if (!chmap) {
+    return NULL;
+  }
+
+  chmap_reader* reader =
+      (chmap_reader*)_mem_alloc(chmap->m_procs, sizeof(chmap_reader));
+  if (!reader) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate the read buffer");
+    }
+    chmap_destroy(chmap);
+    return NULL;
+  }
+  reader_init(reader, fd);
+
+  const char* load_err =
+      header.format_version == snapshot_unchunked_format_version
+          ? load_unchunked_records(chmap, reader, header.elem_count)
+          : load_chunks(chmap, reader, header.elem_count);
+
+  _mem_free(chmap->m_procs, reader);
+
+  if (load_err) {
+    if (err) {
+      *err = (char*)load_err;
+    }
+    chmap_destroy(chmap);
+    return NULL;
+  }
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return chmap;
+}
@@ -0,0 +1,158 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// The snapshot file format and the buffered I/O helpers shared by the
+// persistence code. Not meant to be used by the clients.
+
+#pragma once
+
+#include "chashmap_internal.h"
+
+#define CHMAP_IO_BUF_SIZE (64 * 1024)
+// The payload size the snapshot writer aims for, a chunk only gets bigger
+// when a single record does not fit in it.
+#define CHMAP_SNAPSHOT_CHUNK_SIZE (1024 * 1024)
+
+extern const char snapshot_magic[4];
+extern const char snapshot_end_magic[4];
+extern const char snapshot_chunk_magic[4];
+extern const uint16_t snapshot_format_version;
+extern const uint16_t snapshot_hash_function_id;
+extern const uint32_t snapshot_byte_order_mark;
+
+typedef struct chmap_snapshot_header {
+  char magic[4];
+  uint16_t format_version;
+  uint16_t hash_function_id;
+  uint32_t byte_order_mark;
+  uint32_t reserved;
+  uint64_t elem_count;
+} chmap_snapshot_header;
+
+typedef struct chmap_record_header {
+  uint64_t hash;
+  uint32_t key_size;
+  uint32_t val_size;
+} chmap_record_header;
+
+typedef struct chmap_snapshot_trailer {
+  uint64_t checksum;
+  char magic[4];
+  char padding[4];
+} chmap_snapshot_trailer;
+
+typedef struct chmap_chunk_header {
+  char magic[4];
+  uint32_t record_count;
+  uint64_t payload_size;
+  uint64_t payload_checksum;
+} chmap_chunk_header;
+
+// Ends a chunked snapshot, in place of the chunk header that would follow
+// the last chunk.
+typedef struct chmap_chunked_trailer {
+  char magic[4];
+  uint32_t reserved;
+  uint64_t chunk_count;
+  // Covers the chunk headers, in the order they appear in the file.
+  uint64_t index_checksum;
+} chmap_chunked_trailer;
+
+typedef struct chmap_checksum {
+  uint64_t state;
+  uint64_t total_len;
+  unsigned char pending[8];
+  uint32_t pending_len;
+} chmap_checksum;
+
+typedef struct chmap_writer {
+  int fd;
+  bool checksummed;
+  size_t len;
+  chmap_checksum checksum;
+  unsigned char buf[CHMAP_IO_BUF_SIZE];
+} chmap_writer;
+
+// Writes the chunked snapshot format, collecting the records of a chunk in
+// memory so that its header can go in front of them.
+typedef struct chmap_snapshot_writer {
+  int fd;
+  chashmap_memmgmt_procs_t* m_procs;
+  // The chunk being filled, with room for its header at the front.
+  unsigned char* chunk;
+  size_t chunk_len;
+  size_t chunk_capacity;
+  uint32_t record_count;
+  uint64_t chunk_count;
+  chmap_checksum index_checksum;
+} chmap_snapshot_writer;
+
+typedef struct chmap_reader {
+  int fd;
+  bool checksummed;
+  size_t pos;
+  size_t len;
+  chmap_checksum checksum;
+  unsigned char buf[CHMAP_IO_BUF_SIZE];
+} chmap_reader;
+
+void checksum_init(chmap_checksum* checksum);
+void checksum_update(chmap_checksum* checksum, const void* data, size_t len);
+uint64_t checksum_final(const chmap_checksum* checksum);
+
+bool write_fully(int fd, const void* data, size_t len);
+bool read_fully(int fd, void* data, size_t len);
+char* copy_path(chashmap_memmgmt_procs_t* m_procs, const char* path,
+                const char* suffix);
+bool sync_parent_dir(const char* path, chashmap_memmgmt_procs_t* m_procs);
+
+void writer_init(chmap_writer* writer, int fd);
+bool writer_append(chmap_writer* writer, const void* data, size_t len);
+bool writer_flush(chmap_writer* writer);
+
+bool snapshot_writer_init(chmap_snapshot_writer* writer, int fd,
+                          chashmap_memmgmt_procs_t* m_procs,
+                          uint64_t elem_count);
+bool snapshot_writer_append_record(chmap_snapshot_writer* writer,
+                                   unsigned long hash,
+                                   const chmap_pair* key_pair,
+                                   const chmap_pair* val_pair);
+bool snapshot_writer_append_encoded(chmap_snapshot_writer* writer,
+                                    const unsigned char* data, size_t len);
+bool snapshot_writer_finish(chmap_snapshot_writer* writer);
+void snapshot_writer_release(chmap_snapshot_writer* writer);
+chashmap_retval_t save_chmap(chashmap* chmap, int fd);
+
+void reader_init(chmap_reader* reader, int fd);
+bool reader_read(chmap_reader* reader, void* data, size_t len);
+
+const char* check_snapshot_header(const chmap_snapshot_header* header);
+const unsigned char* decode_record(const unsigned char* pos,
+                                   const unsigned char* end,
+                                   chmap_record_header* record);
+uint32_t bucket_arr_size_for(uint64_t elem_count);
+const char* check_elem_count(uint64_t elem_count, uint64_t byte_count);
+bool bulk_insert(chashmap* chmap, chmap_entry* data);
+bool reserve_scratch(chashmap* chmap, void** buf, uint32_t* capacity,
+                     uint32_t size);
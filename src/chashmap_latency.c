@@ -0,0 +1,152 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_internal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+const char* latency_op_names[chmap_latency_op_count] = {"insert", "get",
+                                                        "delete", "resize"};
+
+#ifdef CHMAP_INSTRUMENT
+
+static inline uint32_t latency_bucket_index(uint64_t nsec) {
+  if (nsec < (1 << LATENCY_SUB_BUCKET_BITS)) {
+    return (uint32_t)nsec;
+  }
+
+  uint32_t msb = 63 - __builtin_clzll(nsec);
+  uint32_t shift = msb - LATENCY_SUB_BUCKET_BITS;
+  uint32_t sub_bucket =
+      (nsec >> shift) & ((1 << LATENCY_SUB_BUCKET_BITS) - 1);
+
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+// The largest latency that falls into the bucket
+static inline uint64_t latency_bucket_upper_bound(uint32_t index) {
+  if (index < (1 << LATENCY_SUB_BUCKET_BITS)) {
+    return index;
+  }
+
+  uint32_t shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+  uint64_t sub_bucket = index & ((1 << LATENCY_SUB_BUCKET_BITS) - 1);
+  uint64_t lower = ((1ULL << LATENCY_SUB_BUCKET_BITS) + sub_bucket) << shift;
+
+  return lower + (1ULL << shift) - 1;
+}
+
+// The optimistic readers record their gets concurrently, hence the atomics.
+void record_latency(chashmap* chmap, chmap_latency_op op, uint64_t nsec) {
+  chmap_latency_hist* hist = &chmap->latency[op];
+
+  __atomic_fetch_add(&hist->buckets[latency_bucket_index(nsec)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total_nsec, nsec, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&hist->max_nsec, __ATOMIC_RELAXED);
+  while (nsec > max &&
+         !__atomic_compare_exchange_n(&hist->max_nsec, &max, nsec, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Finds the bucket holding the rank-th fastest operation.
+static uint64_t latency_percentile(const chmap_latency_hist* hist,
+                                   uint64_t count, double fraction) {
+  uint64_t rank = (uint64_t)(count * fraction);
+  if (rank >= count) {
+    rank = count - 1;
+  }
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+    seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    if (seen > rank) {
+      return latency_bucket_upper_bound(i);
+    }
+  }
+
+  return __atomic_load_n(&hist->max_nsec, __ATOMIC_RELAXED);
+}
+
+#endif
+
+chashmap_retval_t chmap_get_latency_stats(chashmap* chmap, chmap_latency_op op,
+                                          chmap_latency_stats* stats) {
+  if (!chmap || !stats || op >= chmap_latency_op_count) {
+    return chm_invalid_arguments;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+
+#ifdef CHMAP_INSTRUMENT
+  const chmap_latency_hist* hist = &chmap->latency[op];
+  stats->count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+  if (stats->count) {
+    stats->mean_nsec =
+        __atomic_load_n(&hist->total_nsec, __ATOMIC_RELAXED) / stats->count;
+    stats->max_nsec = __atomic_load_n(&hist->max_nsec, __ATOMIC_RELAXED);
+    stats->p50_nsec = latency_percentile(hist, stats->count, 0.5);
+    stats->p99_nsec = latency_percentile(hist, stats->count, 0.99);
+    stats->p999_nsec = latency_percentile(hist, stats->count, 0.999);
+  }
+#endif
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_dump_latency(chashmap* chmap, int fd) {
+  if (!chmap || fd < 0) {
+    return chm_invalid_arguments;
+  }
+
+  for (uint32_t op = 0; op < chmap_latency_op_count; ++op) {
+    chmap_latency_stats stats;
+    chmap_get_latency_stats(chmap, op, &stats);
+    if (dprintf(fd,
+                "%s count=%" PRIu64 " mean=%" PRIu64 "ns p50=%" PRIu64
+                "ns p99=%" PRIu64 "ns p999=%" PRIu64 "ns max=%" PRIu64 "ns\n",
+                latency_op_names[op], stats.count, stats.mean_nsec,
+                stats.p50_nsec, stats.p99_nsec, stats.p999_nsec,
+                stats.max_nsec) < 0) {
+      return chm_io_error;
+    }
+
+#ifdef CHMAP_INSTRUMENT
+    const chmap_latency_hist* hist = &chmap->latency[op];
+    for (uint32_t i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+      uint64_t count = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+      if (count && dprintf(fd, "  <=%" PRIu64 "ns %" PRIu64 "\n",
+                           latency_bucket_upper_bound(i), count) < 0) {
+        return chm_io_error;
+      }
+    }
+#endif
+  }
+
+  return chm_success;
+}
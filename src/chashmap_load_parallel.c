@@ -0,0 +1,408 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Loads a chunked snapshot with several threads. The file gets mapped, and
+// the chunk headers get collected by hopping over the payloads. Then, in the
+// first phase, every thread parses a contiguous run of chunks, creating the
+// nodes on a list of its own, and sorts them by the bucket range they fall
+// into. In the second phase, every thread owns one of the bucket ranges and
+// links the nodes all the threads sorted into it, so no two threads ever
+// touch the same bucket. Finally, the per-thread lists of all the elements
+// get spliced together.
+
+typedef struct load_chunk {
+  chmap_chunk_header header;
+  const unsigned char* payload;
+} load_chunk;
+
+typedef struct parse_task {
+  chashmap* chmap;
+  const load_chunk* chunks;
+  uint64_t begin;
+  uint64_t end;
+  uint32_t range_len;
+  // The nodes this task created, and the bucket range lists they are on.
+  dllist_ref_node* head;
+  dllist_ref_node* tail;
+  llist_node** ranges;
+  uint64_t elem_count;
+  chmap_mem_usage mem_usage;
+  const char* err;
+  pthread_t thread;
+  bool started;
+} parse_task;
+
+typedef struct link_task {
+  chashmap* chmap;
+  parse_task* parse_tasks;
+  uint32_t task_count;
+  uint32_t range;
+  pthread_t thread;
+  bool started;
+} link_task;
+
+const char* parse_chunk(parse_task* task, const load_chunk* chunk) {
+  chashmap* chmap = task->chmap;
+
+  chmap_checksum checksum;
+  checksum_init(&checksum);
+  checksum_update(&checksum, chunk->payload, chunk->header.payload_size);
+  if (checksum_final(&checksum) != chunk->header.payload_checksum) {
+    return CERR_STR("Checksum mismatch");
+  }
+
+  const unsigned char* pos = chunk->payload;
+  const unsigned char* end = pos + chunk->header.payload_size;
+  for (uint32_t i = 0; i < chunk->header.record_count; ++i) {
+    chmap_record_header record;
+    const unsigned char* key = decode_record(pos, end, &record);
+    if (!key) {
+      return CERR_STR("Failed to read a record");
+    }
+
+    chmap_entry data = {
+        .hash_val = record.hash,
+        .key_pair = &(chmap_pair){.ptr = (void*)key, .size = record.key_size},
+        .val_pair = &(chmap_pair){.ptr = (void*)(key + record.key_size),
+                                  .size = record.val_size},
+        .m_procs = chmap->m_procs};
+    bool first = task->head == NULL;
+    llist_node* node =
+        create_llist_node(&task->mem_usage, &task->head, &data);
+    if (!node) {
+      return CERR_STR("Failed to allocate an element");
+    }
+    if (first) {
+      // The nodes get attached at the head, the first one stays the tail.
+      task->tail = task->head;
+    }
+
+    uint32_t range = (record.hash % chmap->bucket_arr_size) / task->range_len;
+    node->next = task->ranges[range];
+    task->ranges[range] = node;
+    ++task->elem_count;
+
+    pos = key + record.key_size + record.val_size;
+  }
+
+  if (pos != end) {
+    return CERR_STR("The chunk has trailing bytes");
+  }
+
+  return NULL;
+}
+
+void* run_parse_task(void* arg) {
+  parse_task* task = (parse_task*)arg;
+
+  for (uint64_t i = task->begin; i < task->end && !task->err; ++i) {
+    task->err = parse_chunk(task, &task->chunks[i]);
+  }
+
+  return NULL;
+}
+
+void* run_link_task(void* arg) {
+  link_task* task = (link_task*)arg;
+  chashmap* chmap = task->chmap;
+
+  for (uint32_t i = 0; i < task->task_count; ++i) {
+    llist_node* tracker = task->parse_tasks[i].ranges[task->range];
+    while (tracker) {
+      llist_node* next = tracker->next;
+      uint32_t index = tracker->data.hash_val % chmap->bucket_arr_size;
+      tracker->next = chmap->bucket_arr[index];
+      chmap->bucket_arr[index] = tracker;
+      tracker = next;
+    }
+  }
+
+  return NULL;
+}
+
+// Runs the tasks on their own threads, the first one on the calling thread.
+// The tasks whose threads can't be started get run on the calling thread
+// too.
+#define run_load_tasks(tasks, count, run)                                \
+  do {                                                                   \
+    for (uint32_t i = 1; i < (count); ++i) {                             \
+      (tasks)[i].started =                                               \
+          pthread_create(&(tasks)[i].thread, NULL, run, &(tasks)[i]) == 0; \
+    }                                                                    \
+    run(&(tasks)[0]);                                                    \
+    for (uint32_t i = 1; i < (count); ++i) {                             \
+      if ((tasks)[i].started) {                                          \
+        pthread_join((tasks)[i].thread, NULL);                           \
+      } else {                                                           \
+        run(&(tasks)[i]);                                                \
+      }                                                                  \
+    }                                                                    \
+  } while (0)
+
+// Collects the chunks between the header and the trailer.
+const char* index_chunks(chashmap_memmgmt_procs_t* m_procs,
+                         const unsigned char* base, size_t size,
+                         uint64_t elem_count, load_chunk** chunks,
+                         uint64_t* chunk_count) {
+  chmap_checksum index_checksum;
+  checksum_init(&index_checksum);
+  uint64_t capacity = 0;
+  uint64_t record_count = 0;
+  size_t offset = sizeof(chmap_snapshot_header);
+
+  *chunks = NULL;
+  *chunk_count = 0;
+
+  for (;;) {
+    chmap_chunk_header header;
+    if (size - offset < sizeof(header)) {
+      return CERR_STR("Failed to read a chunk header");
+    }
+    memcpy(&header, base + offset, sizeof(header));
+    offset += sizeof(header);
+
+    if (memcmp(header.magic, snapshot_end_magic, sizeof(header.magic)) == 0) {
+      chmap_chunked_trailer trailer;
+      memcpy(&trailer, &header, sizeof(trailer));
+      if (trailer.chunk_count != *chunk_count ||
+          trailer.index_checksum != checksum_final(&index_checksum)) {
+        return CERR_STR("Checksum mismatch");
+      }
+      if (record_count != elem_count) {
+        return CERR_STR("The element count does not match the records");
+      }
+      return NULL;
+    }
+
+    if (memcmp(header.magic, snapshot_chunk_magic, sizeof(header.magic)) !=
+            0 ||
+        header.payload_size > size - offset) {
+      return CERR_STR("Failed to read a chunk header");
+    }
+    checksum_update(&index_checksum, &header, sizeof(header));
+
+    if (*chunk_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      load_chunk* new_chunks = (load_chunk*)_mem_realloc(
+          m_procs, *chunks, capacity * sizeof(load_chunk));
+      if (!new_chunks) {
+        return CERR_STR("Failed to allocate the chunk index");
+      }
+      *chunks = new_chunks;
+    }
+
+    (*chunks)[*chunk_count].header = header;
+    (*chunks)[*chunk_count].payload = base + offset;
+    ++*chunk_count;
+    record_count += header.record_count;
+    offset += header.payload_size;
+  }
+}
+
+const char* load_chunks_in_parallel(chashmap* chmap, const load_chunk* chunks,
+                                    uint64_t chunk_count,
+                                    uint32_t thread_count) {
+  parse_task* parse_tasks = (parse_task*)_mem_calloc(
+      chmap->m_procs, thread_count, sizeof(parse_task));
+  link_task* link_tasks = (link_task*)_mem_calloc(chmap->m_procs, thread_count,
+                                                  sizeof(link_task));
+  llist_node** ranges = (llist_node**)_mem_calloc(
+      chmap->m_procs, (size_t)thread_count * thread_count,
+      sizeof(llist_node*));
+  const char* load_err = NULL;
+
+  if (!parse_tasks || !link_tasks || !ranges) {
+    load_err = CERR_STR("Failed to allocate the loader threads");
+    goto cleanup;
+  }
+
+  uint32_t range_len =
+      (chmap->bucket_arr_size + thread_count - 1) / thread_count;
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    parse_tasks[i].chmap = chmap;
+    parse_tasks[i].chunks = chunks;
+    parse_tasks[i].begin = chunk_count * i / thread_count;
+    parse_tasks[i].end = chunk_count * (i + 1) / thread_count;
+    parse_tasks[i].range_len = range_len;
+    parse_tasks[i].ranges = &ranges[(size_t)i * thread_count];
+
+    link_tasks[i].chmap = chmap;
+    link_tasks[i].parse_tasks = parse_tasks;
+    link_tasks[i].task_count = thread_count;
+    link_tasks[i].range = i;
+  }
+
+  run_load_tasks(parse_tasks, thread_count, run_parse_task);
+
+  for (uint32_t i = 0; i < thread_count && !load_err; ++i) {
+    load_err = parse_tasks[i].err;
+  }
+
+  if (load_err) {
+    for (uint32_t i = 0; i < thread_count; ++i) {
+      dllist_ref_node* tracker = parse_tasks[i].head;
+      while (tracker) {
+        dllist_ref_node* next = tracker->next;
+        destroy_llist_node(NULL, NULL, tracker->host);
+        tracker = next;
+      }
+    }
+    goto cleanup;
+  }
+
+  run_load_tasks(link_tasks, thread_count, run_link_task);
+
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    parse_task* task = &parse_tasks[i];
+    if (!task->head) {
+      continue;
+    }
+    task->tail->next = chmap->head_of_all_elems;
+    if (chmap->head_of_all_elems) {
+      chmap->head_of_all_elems->prev = task->tail;
+    }
+    chmap->head_of_all_elems = task->head;
+    chmap->elem_count += task->elem_count;
+    chmap->mem_usage.node_bytes += task->mem_usage.node_bytes;
+    chmap->mem_usage.key_bytes += task->mem_usage.key_bytes;
+    chmap->mem_usage.val_bytes += task->mem_usage.val_bytes;
+    chmap->mem_usage.alloc_calls += task->mem_usage.alloc_calls;
+  }
+
+cleanup:
+  if (parse_tasks) _mem_free(chmap->m_procs, parse_tasks);
+  if (link_tasks) _mem_free(chmap->m_procs, link_tasks);
+  if (ranges) _mem_free(chmap->m_procs, ranges);
+
+  return load_err;
+}
+
+chashmap* chmap_load_parallel(const char* path, uint32_t thread_count,
+                              chashmap_memmgmt_procs_t* mmgmt_procs,
+                              char** err) {
+  if (!path || thread_count == 0) {
+    if (err) {
+      *err = CERR_STR("Invalid arguments");
+    }
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (err) {
+      *err = CERR_STR("Failed to open the file");
+    }
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(chmap_snapshot_header)) {
+    if (err) {
+      *err = CERR_STR("Failed to read the snapshot header");
+    }
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    if (err) {
+      *err = CERR_STR("Failed to map the file");
+    }
+    close(fd);
+    return NULL;
+  }
+
+  chmap_snapshot_header header;
+  memcpy(&header, base, sizeof(header));
+  const char* load_err = check_snapshot_header(&header);
+  if (!load_err) {
+    // The bucket array is sized by the count, before the chunks are read
+    load_err = check_elem_count(header.elem_count,
+                                size - sizeof(chmap_snapshot_header));
+  }
+  if (!load_err && header.format_version != snapshot_format_version) {
+    // The older snapshots have no chunks to split the work by.
+    munmap(base, size);
+    chashmap* chmap = chmap_load(fd, mmgmt_procs, err);
+    close(fd);
+    return chmap;
+  }
+  close(fd);
+
+  load_chunk* chunks = NULL;
+  uint64_t chunk_count = 0;
+  chashmap* chmap = NULL;
+
+  if (!load_err) {
+    load_err = index_chunks(mmgmt_procs, (const unsigned char*)base, size,
+                            header.elem_count, &chunks, &chunk_count);
+  }
+
+  if (!load_err) {
+    chmap = chmap_create_mp(bucket_arr_size_for(header.elem_count),
+                            mmgmt_procs, err);
+    if (!chmap) {
+      if (chunks) _mem_free(mmgmt_procs, chunks);
+      munmap(base, size);
+      return NULL;
+    }
+  }
+
+  if (!load_err && chunk_count > 0) {
+    if (thread_count > chunk_count) {
+      thread_count = (uint32_t)chunk_count;
+    }
+    load_err = load_chunks_in_parallel(chmap, chunks, chunk_count,
+                                       thread_count);
+  }
+
+  if (chunks) _mem_free(mmgmt_procs, chunks);
+  munmap(base, size);
+
+  if (load_err) {
+    if (err) {
+      *err = (char*)load_err;
+    }
+    if (chmap) {
+      chmap_destroy(chmap);
+    }
+    return NULL;
+  }
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return chmap;
+}
@@ -0,0 +1,194 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_internal.h"
+
+#include <sched.h>
+
+// A published map is an immutable chashmap behind an atomically swapped
+// pointer. The readers announce the epoch they started reading in, and the
+// writer waits for all the readers that might still be looking at the
+// previous map (the grace period) before destroying it.
+//
+// Every reader owns a cache line, so the readers never write to a shared
+// location. An epoch of 0 means the reader is not reading at the moment.
+struct chmap_pub_reader {
+  uint64_t epoch;
+  chmap_published* pub;
+  struct chmap_pub_reader* prev;
+  struct chmap_pub_reader* next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct chmap_published {
+  chashmap* current;
+  uint64_t epoch;
+  // Serializes the writers, and protects the list of readers.
+  pthread_mutex_t lock;
+  chmap_pub_reader* readers;
+};
+
+chmap_published* chmap_pub_create(chashmap* initial, char** err) {
+  if (!initial) {
+    if (err) {
+      *err = CERR_STR("The initial map is NULL");
+    }
+    return NULL;
+  }
+
+  chmap_published* pub = (chmap_published*)malloc(sizeof(chmap_published));
+  if (!pub) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&pub->lock, NULL) != 0) {
+    if (err) {
+      *err = CERR_STR("Failed to initialize the lock");
+    }
+    free(pub);
+    return NULL;
+  }
+
+  pub->current = initial;
+  pub->epoch = 1;
+  pub->readers = NULL;
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return pub;
+}
+
+chmap_pub_reader* chmap_pub_register_reader(chmap_published* pub) {
+  if (!pub) {
+    return NULL;
+  }
+
+  chmap_pub_reader* reader = NULL;
+  if (posix_memalign((void**)&reader, CACHE_LINE_SIZE,
+                     sizeof(chmap_pub_reader)) != 0) {
+    return NULL;
+  }
+
+  memset(reader, 0, sizeof(chmap_pub_reader));
+  reader->pub = pub;
+
+  pthread_mutex_lock(&pub->lock);
+  reader->next = pub->readers;
+  if (pub->readers) {
+    pub->readers->prev = reader;
+  }
+  pub->readers = reader;
+  pthread_mutex_unlock(&pub->lock);
+
+  return reader;
+}
+
+void chmap_pub_unregister_reader(chmap_pub_reader* reader) {
+  if (!reader) {
+    return;
+  }
+
+  chmap_published* pub = reader->pub;
+
+  pthread_mutex_lock(&pub->lock);
+  if (reader->prev) {
+    reader->prev->next = reader->next;
+  } else {
+    pub->readers = reader->next;
+  }
+  if (reader->next) {
+    reader->next->prev = reader->prev;
+  }
+  pthread_mutex_unlock(&pub->lock);
+
+  free(reader);
+}
+
+chashmap* chmap_pub_read_lock(chmap_pub_reader* reader) {
+  chmap_published* pub = reader->pub;
+
+  __atomic_store_n(&reader->epoch,
+                   __atomic_load_n(&pub->epoch, __ATOMIC_ACQUIRE),
+                   __ATOMIC_RELAXED);
+  // The announcement has to be visible before we pick the map up, otherwise
+  // the writer might miss us and free the map under our feet.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&pub->current, __ATOMIC_ACQUIRE);
+}
+
+void chmap_pub_read_unlock(chmap_pub_reader* reader) {
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+chashmap_retval_t chmap_pub_publish(chmap_published* pub, chashmap* next) {
+  if (!pub || !next) {
+    return chm_invalid_arguments;
+  }
+
+  pthread_mutex_lock(&pub->lock);
+
+  chashmap* previous = __atomic_exchange_n(&pub->current, next,
+                                           __ATOMIC_SEQ_CST);
+  uint64_t new_epoch = __atomic_add_fetch(&pub->epoch, 1, __ATOMIC_SEQ_CST);
+
+  // The grace period: any reader that announced an older epoch might still
+  // be holding the previous map.
+  for (chmap_pub_reader* reader = pub->readers; reader;
+       reader = reader->next) {
+    uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+    while (epoch != 0 && epoch < new_epoch) {
+      sched_yield();
+      epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  pthread_mutex_unlock(&pub->lock);
+
+  if (previous != next) {
+    chmap_destroy(previous);
+  }
+
+  return chm_success;
+}
+
+void __chmap_pub_destroy(chmap_published* pub) {
+  if (!pub) {
+    return;
+  }
+
+  while (pub->readers) {
+    chmap_pub_reader* next = pub->readers->next;
+    free(pub->readers);
+    pub->readers = next;
+  }
+
+  chmap_destroy(pub->current);
+  pthread_mutex_destroy(&pub->lock);
+  free(pub);
+}
@@ -0,0 +1,403 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The read-only file format. The file gets mapped as a whole, and the
+// lookups work on the mapping directly:
+//
+//   header:  chmap_ro_header
+//   slots:   slot_count chmap_ro_slot entries, open addressing with linear
+//            probing, an entry_offset of 0 marks an empty slot
+//   data:    the key bytes followed by the value bytes of every element,
+//            each entry starting at an 8 byte boundary
+//
+// All the offsets are relative to the start of the file.
+typedef struct chmap_ro_header {
+  char magic[4];
+  uint16_t format_version;
+  uint16_t hash_function_id;
+  uint32_t byte_order_mark;
+  uint32_t slot_count;
+  uint64_t elem_count;
+  uint64_t data_offset;
+  uint64_t file_size;
+} chmap_ro_header;
+
+typedef struct chmap_ro_slot {
+  uint64_t hash;
+  uint64_t entry_offset;
+  uint32_t key_size;
+  uint32_t val_size;
+} chmap_ro_slot;
+
+struct chmap_ro {
+  const unsigned char* base;
+  size_t size;
+  const chmap_ro_slot* slots;
+  uint32_t slot_mask;
+  uint64_t elem_count;
+};
+
+const char ro_magic[4] = {'C', 'H', 'R', 'O'};
+const uint16_t ro_format_version = 1;
+
+// The stored hashes of the short keys are the keys themselves, so they get
+// mixed before picking a slot, otherwise similar keys would form long runs.
+static inline uint32_t ro_slot_index(uint64_t hash, uint32_t slot_mask) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  return (uint32_t)hash & slot_mask;
+}
+
+static inline uint64_t align_to_8(uint64_t offset) {
+  return (offset + 7) & ~(uint64_t)7;
+}
+
+// Fills the slot array, and returns the size of the data region.
+uint64_t place_elements(chashmap* chmap, chmap_ro_slot* slots,
+                        uint32_t slot_count, uint64_t data_offset) {
+  uint32_t slot_mask = slot_count - 1;
+  uint64_t offset = data_offset;
+
+  dllist_ref_node* tracker = chmap->head_of_all_elems;
+  while (tracker) {
+    chmap_entry* data = &tracker->host->data;
+    uint32_t index = ro_slot_index(data->hash_val, slot_mask);
+    while (slots[index].entry_offset != 0) {
+      index = (index + 1) & slot_mask;
+    }
+
+    slots[index].hash = data->hash_val;
+    slots[index].entry_offset = offset;
+    slots[index].key_size = data->key_pair->size;
+    slots[index].val_size = entry_val_size(data);
+
+    offset = align_to_8(offset + data->key_pair->size + entry_val_size(data));
+    tracker = tracker->next;
+  }
+
+  return offset - data_offset;
+}
+
+// Writes the entries in the same order 'place_elements' has laid them out.
+bool write_elements(chashmap* chmap, chmap_writer* writer) {
+  static const unsigned char padding[8] = {0};
+
+  void* val_buf = NULL;
+  uint32_t val_capacity = 0;
+  bool result = true;
+
+  dllist_ref_node* tracker = chmap->head_of_all_elems;
+  while (tracker && result) {
+    chmap_entry* data = &tracker->host->data;
+    chmap_pair val_pair;
+    result = load_entry_val(data, &val_pair, &val_buf, &val_capacity);
+    uint64_t len = data->key_pair->size + val_pair.size;
+    result = result &&
+             writer_append(writer, data->key_pair->ptr, data->key_pair->size) &&
+             writer_append(writer, val_pair.ptr, val_pair.size) &&
+             writer_append(writer, padding, align_to_8(len) - len);
+    tracker = tracker->next;
+  }
+
+  if (val_buf) _mem_free(chmap->m_procs, val_buf);
+
+  return result;
+}
+
+chashmap_retval_t chmap_freeze_to_file(chashmap* chmap, const char* path) {
+  if (!chmap || !path) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  // At most half full, so the probe sequences stay short.
+  uint64_t wanted_slots = chmap->elem_count * 2;
+  uint32_t slot_count =
+      wanted_slots > (1U << 31)
+          ? (1U << 31)
+          : find_nearest_gte_power_of_two((uint32_t)wanted_slots);
+
+  chashmap_retval_t result = chm_success;
+  if (chmap->elem_count >= slot_count) {
+    // Would not leave an empty slot to stop the probing at
+    if (chmap->seqlock) {
+      pthread_mutex_unlock(&chmap->seqlock->write_lock);
+    }
+    return chm_invalid_arguments;
+  }
+
+  chmap_ro_slot* slots = (chmap_ro_slot*)_mem_calloc(
+      chmap->m_procs, slot_count, sizeof(chmap_ro_slot));
+  chmap_writer* writer =
+      (chmap_writer*)_mem_alloc(chmap->m_procs, sizeof(chmap_writer));
+  char* tmp_path = NULL;
+  int fd = -1;
+
+  if (!slots || !writer) {
+    result = chm_not_enough_memory;
+    goto cleanup;
+  }
+
+  chmap_ro_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ro_magic, sizeof(header.magic));
+  header.format_version = ro_format_version;
+  header.hash_function_id = snapshot_hash_function_id;
+  header.byte_order_mark = snapshot_byte_order_mark;
+  header.slot_count = slot_count;
+  header.elem_count = chmap->elem_count;
+  header.data_offset =
+      sizeof(chmap_ro_header) + (uint64_t)slot_count * sizeof(chmap_ro_slot);
+  header.file_size = header.data_offset + place_elements(chmap, slots,
+                                                         slot_count,
+                                                         header.data_offset);
+
+  // Written next to the file and renamed over it, so a failure halfway
+  // leaves the previous file in place.
+  tmp_path = copy_path(chmap->m_procs, path, ".tmp");
+  if (!tmp_path) {
+    result = chm_not_enough_memory;
+    goto cleanup;
+  }
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    result = chm_io_error;
+    goto cleanup;
+  }
+
+  writer_init(writer, fd);
+  writer->checksummed = false;
+  if (!writer_append(writer, &header, sizeof(header)) ||
+      !writer_append(writer, slots,
+                     (size_t)slot_count * sizeof(chmap_ro_slot)) ||
+      !write_elements(chmap, writer) || !writer_flush(writer) ||
+      fsync(fd) != 0) {
+    result = chm_io_error;
+  }
+
+cleanup:
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+  if (fd >= 0 && close(fd) != 0) {
+    result = chm_io_error;
+  }
+  if (fd >= 0 && result == chm_success &&
+      (rename(tmp_path, path) != 0 ||
+       !sync_parent_dir(path, chmap->m_procs))) {
+    result = chm_io_error;
+  }
+  if (fd >= 0 && result != chm_success) {
+    unlink(tmp_path);
+  }
+  if (tmp_path) _mem_free(chmap->m_procs, tmp_path);
+  if (slots) _mem_free(chmap->m_procs, slots);
+  if (writer) _mem_free(chmap->m_procs, writer);
+
+  return result;
+}
+
+const char* check_ro_header(const chmap_ro_header* header, size_t size) {
+  if (size < sizeof(chmap_ro_header) ||
+      memcmp(header->magic, ro_magic, sizeof(header->magic)) != 0) {
+    return CERR_STR("Not a read-only chashmap file");
+  }
+  if (header->byte_order_mark != snapshot_byte_order_mark) {
+    return CERR_STR("The file was written with a different byte order");
+  }
+  if (header->format_version != ro_format_version) {
+    return CERR_STR("Unsupported read-only file format version");
+  }
+  if (header->hash_function_id != snapshot_hash_function_id) {
+    return CERR_STR("The file was written with a different hash function");
+  }
+  if (header->slot_count == 0 ||
+      (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->elem_count >= header->slot_count) {
+    return CERR_STR("Invalid slot count");
+  }
+  if (header->file_size != size ||
+      header->data_offset != sizeof(chmap_ro_header) +
+                                 (uint64_t)header->slot_count *
+                                     sizeof(chmap_ro_slot) ||
+      header->data_offset > size) {
+    return CERR_STR("The file is truncated or corrupted");
+  }
+  return NULL;
+}
+
+chmap_ro* chmap_ro_open(const char* path, char** err) {
+  if (!path) {
+    if (err) {
+      *err = CERR_STR("Invalid path");
+    }
+    return NULL;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (err) {
+      *err = CERR_STR("Failed to open the file");
+    }
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    if (err) {
+      *err = CERR_STR("Failed to stat the file");
+    }
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor gets closed.
+  close(fd);
+  if (base == MAP_FAILED) {
+    if (err) {
+      *err = CERR_STR("Failed to map the file");
+    }
+    return NULL;
+  }
+
+  const chmap_ro_header* header = (const chmap_ro_header*)base;
+  const char* header_err = check_ro_header(header, size);
+  if (header_err) {
+    if (err) {
+      *err = (char*)header_err;
+    }
+    munmap(base, size);
+    return NULL;
+  }
+
+  chmap_ro* ro = (chmap_ro*)mem_alloc(sizeof(chmap_ro));
+  if (!ro) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    munmap(base, size);
+    return NULL;
+  }
+
+  ro->base = (const unsigned char*)base;
+  ro->size = size;
+  ro->slots = (const chmap_ro_slot*)(ro->base + sizeof(chmap_ro_header));
+  ro->slot_mask = header->slot_count - 1;
+  ro->elem_count = header->elem_count;
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return ro;
+}
+
+uint64_t chmap_ro_elem_count(chmap_ro* ro) {
+  if (!ro) {
+    return 0;
+  }
+
+  return ro->elem_count;
+}
+
+chashmap_retval_t chmap_ro_get_elem_ref(chmap_ro* ro,
+                                        const chmap_pair* key_pair,
+                                        chmap_pair* val_pair) {
+  if (!ro || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
+      !val_pair) {
+    return chm_invalid_arguments;
+  }
+
+  unsigned long hash = calculate_hash(key_pair);
+  uint32_t index = ro_slot_index(hash, ro->slot_mask);
+
+  // A valid file always has an empty slot to stop at, the bound only matters
+  // for a corrupted one.
+  for (uint64_t step = 0; step <= ro->slot_mask; ++step) {
+    const chmap_ro_slot* slot = &ro->slots[index];
+    if (slot->entry_offset == 0) {
+      return chm_key_not_found;
+    }
+
+    if (slot->hash == hash && slot->key_size == key_pair->size &&
+        slot->entry_offset + slot->key_size + slot->val_size <= ro->size) {
+      const unsigned char* entry = ro->base + slot->entry_offset;
+      if (memcmp(entry, key_pair->ptr, key_pair->size) == 0) {
+        val_pair->ptr = (void*)(entry + slot->key_size);
+        val_pair->size = slot->val_size;
+        return chm_success;
+      }
+    }
+
+    index = (index + 1) & ro->slot_mask;
+  }
+
+  return chm_key_not_found;
+}
+
+chashmap_retval_t chmap_ro_get_elem_copy(chmap_ro* ro,
+                                         const chmap_pair* key_pair,
+                                         void* target_buf,
+                                         uint32_t target_buf_size) {
+  if (!target_buf || target_buf_size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_pair val_pair;
+  chashmap_retval_t result = chmap_ro_get_elem_ref(ro, key_pair, &val_pair);
+  if (result != chm_success) {
+    return result;
+  }
+
+  uint32_t min_size = target_buf_size;
+  if (val_pair.size < min_size) {
+    min_size = val_pair.size;
+  }
+  mem_assign(target_buf, val_pair.ptr, min_size);
+
+  return chm_success;
+}
+
+void __chmap_ro_close(chmap_ro* ro) {
+  if (!ro) {
+    return;
+  }
+
+  munmap((void*)ro->base, ro->size);
+  mem_free(ro);
+}
@@ -0,0 +1,506 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_internal.h"
+
+// A map that lives entirely inside a region provided by the caller, e.g. a
+// MAP_SHARED mapping of a shm_open or memfd_create descriptor. Every
+// reference inside the region is an offset from its start, so each process
+// can map it at a different address. The region carries its own allocator
+// and a process-shared rwlock, the handles returned to the processes are
+// the only things outside of it.
+//
+// The allocator hands out node blocks from size class free lists, four
+// classes per power of two, and carves a new block when a list is empty.
+// Every node block starts with the index of its class so it can be returned
+// to the right list. Bucket arrays carry no such header, their size is known
+// from the map, and a released array goes back to the top of the region or
+// to a list of free extents that later node blocks are carved from.
+
+#define SHM_MAGIC 0x4d485343  // "CSHM"
+#define SHM_FORMAT_VERSION 2
+#define SHM_MIN_BLOCK_SIZE 32
+#define SHM_CLASSES_PER_DOUBLING 4
+#define SHM_CLASS_COUNT 128
+#define SHM_ALIGNMENT 8
+
+typedef uint64_t shm_offset;
+
+typedef struct shm_header {
+  uint32_t magic;
+  uint32_t format_version;
+  uint64_t region_size;
+  pthread_rwlock_t lock;
+  // Allocator
+  shm_offset top;
+  shm_offset free_lists[SHM_CLASS_COUNT];
+  shm_offset free_extents;
+  // Map
+  shm_offset bucket_arr;
+  uint32_t bucket_arr_size;
+  uint32_t elem_count;
+  uint32_t elem_count_to_scale_up;
+} shm_header;
+
+typedef struct shm_node {
+  shm_offset next;
+  unsigned long hash_val;
+  uint32_t key_size;
+  uint32_t val_size;
+  // The key bytes follow, and then the value bytes
+} shm_node;
+
+// A released bucket array, or what is left of it
+typedef struct shm_extent {
+  shm_offset next;
+  uint64_t size;
+} shm_extent;
+
+struct chmap_shm {
+  unsigned char* base;
+  shm_header* header;
+};
+
+static inline void* shm_ptr(const chmap_shm* shm, shm_offset offset) {
+  return offset ? shm->base + offset : NULL;
+}
+
+static inline unsigned char* shm_node_key(shm_node* node) {
+  return (unsigned char*)(node + 1);
+}
+
+static inline unsigned char* shm_node_val(shm_node* node) {
+  return shm_node_key(node) + node->key_size;
+}
+
+static inline shm_offset* shm_buckets(const chmap_shm* shm) {
+  return (shm_offset*)shm_ptr(shm, shm->header->bucket_arr);
+}
+
+static inline uint64_t shm_align(uint64_t value) {
+  return (value + SHM_ALIGNMENT - 1) & ~(uint64_t)(SHM_ALIGNMENT - 1);
+}
+
+// Takes 'size' bytes from the first free extent that can spare them, or
+// from the top of the region.
+shm_offset shm_carve(chmap_shm* shm, uint64_t size) {
+  shm_header* header = shm->header;
+
+  shm_offset* link = &header->free_extents;
+  while (*link) {
+    shm_extent* extent = (shm_extent*)shm_ptr(shm, *link);
+    if (extent->size == size) {
+      shm_offset block = *link;
+      *link = extent->next;
+      return block;
+    }
+    // Whatever is left has to be able to hold the extent itself
+    if (extent->size >= size + sizeof(shm_extent)) {
+      extent->size -= size;
+      return *link + extent->size;
+    }
+    link = &extent->next;
+  }
+
+  if (header->top + size > header->region_size) {
+    return 0;
+  }
+  shm_offset block = header->top;
+  header->top += size;
+
+  return block;
+}
+
+shm_offset shm_alloc(chmap_shm* shm, uint64_t size) {
+  shm_header* header = shm->header;
+  uint64_t needed = size + sizeof(uint64_t);
+
+  uint32_t class_index = 0;
+  uint64_t base_size = SHM_MIN_BLOCK_SIZE;
+  uint64_t block_size = base_size;
+  while (block_size < needed) {
+    if (++class_index == SHM_CLASS_COUNT) {
+      return 0;
+    }
+    if (class_index % SHM_CLASSES_PER_DOUBLING == 0) {
+      base_size <<= 1;
+      block_size = base_size;
+    } else {
+      block_size += base_size / SHM_CLASSES_PER_DOUBLING;
+    }
+  }
+
+  shm_offset block = header->free_lists[class_index];
+  if (block) {
+    header->free_lists[class_index] = *(shm_offset*)shm_ptr(shm, block + 8);
+  } else {
+    block = shm_carve(shm, block_size);
+    if (!block) {
+      return 0;
+    }
+  }
+
+  *(uint64_t*)shm_ptr(shm, block) = class_index;
+
+  return block + sizeof(uint64_t);
+}
+
+void shm_free(chmap_shm* shm, shm_offset offset) {
+  shm_offset block = offset - sizeof(uint64_t);
+  uint64_t class_index = *(uint64_t*)shm_ptr(shm, block);
+
+  *(shm_offset*)shm_ptr(shm, offset) = shm->header->free_lists[class_index];
+  shm->header->free_lists[class_index] = block;
+}
+
+static inline uint64_t shm_bucket_arr_bytes(uint64_t bucket_arr_size) {
+  return bucket_arr_size * sizeof(shm_offset);
+}
+
+shm_offset shm_alloc_bucket_arr(chmap_shm* shm, uint64_t bucket_arr_size) {
+  return shm_carve(shm, shm_bucket_arr_bytes(bucket_arr_size));
+}
+
+void shm_free_bucket_arr(chmap_shm* shm, shm_offset offset,
+                         uint64_t bucket_arr_size) {
+  shm_header* header = shm->header;
+  uint64_t size = shm_bucket_arr_bytes(bucket_arr_size);
+
+  if (offset + size == header->top) {
+    header->top = offset;
+    return;
+  }
+
+  shm_extent* extent = (shm_extent*)shm_ptr(shm, offset);
+  extent->next = header->free_extents;
+  extent->size = size;
+  header->free_extents = offset;
+}
+
+void shm_set_scaling_limit(shm_header* header) {
+  header->elem_count_to_scale_up =
+      (uint64_t)header->bucket_arr_size * 6 / 4 > UINT32_MAX
+          ? UINT32_MAX
+          : header->bucket_arr_size * 6 / 4;
+}
+
+chmap_shm* chmap_shm_create(void* region, size_t region_size,
+                            uint32_t initial_bucket_array_size, char** err) {
+  if (!region || ((uintptr_t)region % SHM_ALIGNMENT) != 0 ||
+      region_size < sizeof(shm_header)) {
+    if (err) {
+      *err = CERR_STR("Invalid region");
+    }
+    return NULL;
+  }
+
+  chmap_shm* shm = (chmap_shm*)mem_alloc(sizeof(chmap_shm));
+  if (!shm) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    return NULL;
+  }
+  shm->base = (unsigned char*)region;
+  shm->header = (shm_header*)region;
+
+  shm_header* header = shm->header;
+  memset(header, 0, sizeof(shm_header));
+  header->region_size = region_size;
+  header->top = shm_align(sizeof(shm_header));
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  int lock_result = pthread_rwlock_init(&header->lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  if (lock_result != 0) {
+    if (err) {
+      *err = CERR_STR("Failed to initialize the process-shared lock");
+    }
+    mem_free(shm);
+    return NULL;
+  }
+
+  if (initial_bucket_array_size <= minimum_allowed_bucket_array_size) {
+    initial_bucket_array_size = minimum_allowed_bucket_array_size;
+  } else {
+    initial_bucket_array_size =
+        find_nearest_gte_power_of_two(initial_bucket_array_size);
+  }
+
+  header->bucket_arr = shm_alloc_bucket_arr(shm, initial_bucket_array_size);
+  if (!header->bucket_arr) {
+    if (err) {
+      *err = CERR_STR("The region is too small for the bucket array");
+    }
+    pthread_rwlock_destroy(&header->lock);
+    mem_free(shm);
+    return NULL;
+  }
+  memset(shm_buckets(shm), 0,
+         (size_t)initial_bucket_array_size * sizeof(shm_offset));
+  header->bucket_arr_size = initial_bucket_array_size;
+  shm_set_scaling_limit(header);
+
+  // Publish the magic last, so that an attach can't see a half built map
+  header->format_version = SHM_FORMAT_VERSION;
+  __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return shm;
+}
+
+chmap_shm* chmap_shm_attach(void* region, size_t region_size, char** err) {
+  if (!region || ((uintptr_t)region % SHM_ALIGNMENT) != 0 ||
+      region_size < sizeof(shm_header)) {
+    if (err) {
+      *err = CERR_STR("Invalid region");
+    }
+    return NULL;
+  }
+
+  shm_header* header = (shm_header*)region;
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+      header->format_version != SHM_FORMAT_VERSION) {
+    if (err) {
+      *err = CERR_STR("The region does not hold a shared map");
+    }
+    return NULL;
+  }
+
+  if (header->region_size > region_size) {
+    if (err) {
+      *err = CERR_STR("The region is smaller than the shared map");
+    }
+    return NULL;
+  }
+
+  chmap_shm* shm = (chmap_shm*)mem_alloc(sizeof(chmap_shm));
+  if (!shm) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    return NULL;
+  }
+  shm->base = (unsigned char*)region;
+  shm->header = header;
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return shm;
+}
+
+shm_node* shm_find(chmap_shm* shm, const chmap_pair* key_pair,
+                   unsigned long hash, shm_offset** link_ptr) {
+  shm_offset* link =
+      &shm_buckets(shm)[hash & (shm->header->bucket_arr_size - 1)];
+
+  while (*link) {
+    shm_node* node = (shm_node*)shm_ptr(shm, *link);
+    if (node->hash_val == hash && node->key_size == key_pair->size &&
+        memcmp(shm_node_key(node), key_pair->ptr, key_pair->size) == 0) {
+      if (link_ptr) {
+        *link_ptr = link;
+      }
+      return node;
+    }
+    link = &node->next;
+  }
+
+  if (link_ptr) {
+    *link_ptr = link;
+  }
+
+  return NULL;
+}
+
+// Grows the bucket array by scale_factor, a failure to allocate only leaves
+// the chains longer than they should be.
+void shm_scale_up(chmap_shm* shm) {
+  shm_header* header = shm->header;
+  uint64_t new_size = (uint64_t)header->bucket_arr_size * scale_factor;
+  if (new_size > (1U << 31)) {
+    return;
+  }
+
+  shm_offset new_arr = shm_alloc_bucket_arr(shm, new_size);
+  if (!new_arr) {
+    return;
+  }
+
+  shm_offset* new_buckets = (shm_offset*)shm_ptr(shm, new_arr);
+  memset(new_buckets, 0, new_size * sizeof(shm_offset));
+
+  shm_offset* old_buckets = shm_buckets(shm);
+  for (uint32_t i = 0; i < header->bucket_arr_size; ++i) {
+    shm_offset tracker = old_buckets[i];
+    while (tracker) {
+      shm_node* node = (shm_node*)shm_ptr(shm, tracker);
+      shm_offset next = node->next;
+      uint32_t index = node->hash_val & (new_size - 1);
+      node->next = new_buckets[index];
+      new_buckets[index] = tracker;
+      tracker = next;
+    }
+  }
+
+  shm_free_bucket_arr(shm, header->bucket_arr, header->bucket_arr_size);
+  header->bucket_arr = new_arr;
+  header->bucket_arr_size = (uint32_t)new_size;
+  shm_set_scaling_limit(header);
+}
+
+chashmap_retval_t chmap_shm_insert_elem(chmap_shm* shm,
+                                        const chmap_pair* key_pair,
+                                        const chmap_pair* val_pair) {
+  if (!shm || !key_pair || !val_pair || !key_pair->ptr || !val_pair->ptr ||
+      key_pair->size == 0 || val_pair->size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  unsigned long hash = calculate_hash(key_pair);
+  uint64_t node_size = sizeof(shm_node) + key_pair->size + val_pair->size;
+
+  pthread_rwlock_wrlock(&shm->header->lock);
+
+  chashmap_retval_t result = chm_success;
+  shm_offset* link = NULL;
+  shm_node* node = shm_find(shm, key_pair, hash, &link);
+
+  if (node && node->val_size == val_pair->size) {
+    memcpy(shm_node_val(node), val_pair->ptr, val_pair->size);
+  } else {
+    shm_offset new_offset = shm_alloc(shm, node_size);
+    if (!new_offset) {
+      result = chm_not_enough_memory;
+    } else {
+      shm_node* new_node = (shm_node*)shm_ptr(shm, new_offset);
+      new_node->hash_val = hash;
+      new_node->key_size = key_pair->size;
+      new_node->val_size = val_pair->size;
+      memcpy(shm_node_key(new_node), key_pair->ptr, key_pair->size);
+      memcpy(shm_node_val(new_node), val_pair->ptr, val_pair->size);
+
+      if (node) {
+        // Replace the node in place in its chain
+        shm_offset old_offset = *link;
+        new_node->next = node->next;
+        *link = new_offset;
+        shm_free(shm, old_offset);
+      } else {
+        new_node->next = 0;
+        *link = new_offset;
+        if (++shm->header->elem_count >=
+            shm->header->elem_count_to_scale_up) {
+          shm_scale_up(shm);
+        }
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&shm->header->lock);
+
+  return result;
+}
+
+chashmap_retval_t chmap_shm_get_elem_copy(chmap_shm* shm,
+                                          const chmap_pair* key_pair,
+                                          void* target_buf,
+                                          uint32_t target_buf_size) {
+  if (!shm || !key_pair || !key_pair->ptr || key_pair->size == 0 ||
+      !target_buf || target_buf_size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  unsigned long hash = calculate_hash(key_pair);
+  chashmap_retval_t result = chm_key_not_found;
+
+  pthread_rwlock_rdlock(&shm->header->lock);
+
+  shm_node* node = shm_find(shm, key_pair, hash, NULL);
+  if (node) {
+    uint32_t min_size = target_buf_size;
+    if (node->val_size < min_size) {
+      min_size = node->val_size;
+    }
+    mem_assign(target_buf, shm_node_val(node), min_size);
+    result = chm_success;
+  }
+
+  pthread_rwlock_unlock(&shm->header->lock);
+
+  return result;
+}
+
+chashmap_retval_t chmap_shm_delete_elem(chmap_shm* shm,
+                                        const chmap_pair* key_pair) {
+  if (!shm || !key_pair || !key_pair->ptr || key_pair->size == 0) {
+    return chm_invalid_arguments;
+  }
+
+  unsigned long hash = calculate_hash(key_pair);
+  chashmap_retval_t result = chm_key_not_found;
+
+  pthread_rwlock_wrlock(&shm->header->lock);
+
+  shm_offset* link = NULL;
+  shm_node* node = shm_find(shm, key_pair, hash, &link);
+  if (node) {
+    shm_offset offset = *link;
+    *link = node->next;
+    shm_free(shm, offset);
+    --shm->header->elem_count;
+    result = chm_success;
+  }
+
+  pthread_rwlock_unlock(&shm->header->lock);
+
+  return result;
+}
+
+uint32_t chmap_shm_elem_count(chmap_shm* shm) {
+  if (!shm) {
+    return 0;
+  }
+
+  pthread_rwlock_rdlock(&shm->header->lock);
+  uint32_t elem_count = shm->header->elem_count;
+  pthread_rwlock_unlock(&shm->header->lock);
+
+  return elem_count;
+}
+
+void __chmap_shm_detach(chmap_shm* shm) {
+  if (!shm) {
+    return;
+  }
+
+  mem_free(shm);
+}
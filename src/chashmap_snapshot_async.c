@@ -0,0 +1,371 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Streams a point-in-time image of the map to a file from a background
+// thread, in the format of 'chmap_save'. Every bucket has a mark, and it
+// gets copied into the snapshot by whoever claims it first: the background
+// thread on its way through the bucket array, or a writer that is about to
+// modify the bucket. Either way the bucket gets copied before its first
+// modification, so the image is the one the map had when the snapshot got
+// started. The map doesn't scale while the snapshot is running, so the
+// bucket indices stay put.
+
+#define BUCKET_PENDING 0
+#define BUCKET_CLAIMED 1
+#define BUCKET_DONE 2
+
+// How many buckets the background thread copies between two checks of the
+// buckets the writers copied.
+#define ASYNC_SNAPSHOT_DRAIN_INTERVAL 256
+
+struct chmap_async_snapshot {
+  chashmap* chmap;
+  chashmap_memmgmt_procs_t* m_procs;
+  int fd;
+  char* path;
+  char* tmp_path;
+  void (*done_cb)(chashmap_retval_t result, void* args);
+  void* args;
+
+  uint64_t elem_count;
+  uint32_t bucket_count;
+  uint8_t* bucket_marks;
+  uint32_t done_count;
+
+  // The records of the buckets the writers copied, waiting to be written
+  pthread_mutex_t side_lock;
+  unsigned char* side;
+  size_t side_len;
+  size_t side_capacity;
+  // Swapped with side, so that the writers don't wait for the disk
+  unsigned char* spare;
+  size_t spare_capacity;
+
+  chmap_snapshot_writer writer;
+  // Where the background thread copies the buckets it claims
+  unsigned char* stage;
+  size_t stage_len;
+  size_t stage_capacity;
+  pthread_t thread;
+  bool finished;
+};
+
+// Serializes the records of a bucket at the end of a growing buffer.
+bool encode_bucket(chmap_async_snapshot* job, llist_node* bucket,
+                   unsigned char** buf, size_t* buf_len, size_t* capacity) {
+  size_t len = 0;
+  for (llist_node* tracker = bucket; tracker; tracker = tracker->next) {
+    len += sizeof(chmap_record_header) + tracker->data.key_pair->size +
+           entry_val_size(&tracker->data);
+  }
+  if (len == 0) {
+    return true;
+  }
+
+  if (*buf_len + len > *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+    while (new_capacity < *buf_len + len) {
+      new_capacity *= 2;
+    }
+    unsigned char* new_buf =
+        (unsigned char*)_mem_realloc(job->m_procs, *buf, new_capacity);
+    if (!new_buf) {
+      return false;
+    }
+    *buf = new_buf;
+    *capacity = new_capacity;
+  }
+
+  bool result = true;
+  size_t new_len = *buf_len;
+  for (llist_node* tracker = bucket; tracker && result;
+       tracker = tracker->next) {
+    chmap_record_header header = {.hash = tracker->data.hash_val,
+                                  .key_size = tracker->data.key_pair->size,
+                                  .val_size = entry_val_size(&tracker->data)};
+    unsigned char* dest = *buf + new_len;
+    memcpy(dest, &header, sizeof(header));
+    memcpy(dest + sizeof(header), tracker->data.key_pair->ptr,
+           header.key_size);
+    result = read_entry_val(&tracker->data,
+                            dest + sizeof(header) + header.key_size,
+                            header.val_size);
+    new_len += sizeof(header) + header.key_size + header.val_size;
+  }
+  if (result) {
+    *buf_len = new_len;
+  }
+
+  return result;
+}
+
+// Serializes the records of a bucket a writer is about to modify.
+bool copy_bucket_to_side(chmap_async_snapshot* job, llist_node* bucket) {
+  pthread_mutex_lock(&job->side_lock);
+  bool result = encode_bucket(job, bucket, &job->side, &job->side_len,
+                              &job->side_capacity);
+  pthread_mutex_unlock(&job->side_lock);
+
+  return result;
+}
+
+static inline bool claim_bucket(chmap_async_snapshot* job, uint32_t index) {
+  uint8_t expected = BUCKET_PENDING;
+  return __atomic_compare_exchange_n(&job->bucket_marks[index], &expected,
+                                     BUCKET_CLAIMED, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_ACQUIRE);
+}
+
+static inline void release_bucket(chmap_async_snapshot* job, uint32_t index) {
+  __atomic_store_n(&job->bucket_marks[index], BUCKET_DONE, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&job->done_count, 1, __ATOMIC_RELEASE);
+}
+
+// Returns once the bucket is in the snapshot, copies it if nobody did yet.
+bool ensure_bucket_copied(chmap_async_snapshot* job, uint32_t index) {
+  if (claim_bucket(job, index)) {
+    bool copied = copy_bucket_to_side(job, job->chmap->bucket_arr[index]);
+    if (!copied) {
+      // Let the background thread have another go at it
+      __atomic_store_n(&job->bucket_marks[index], BUCKET_PENDING,
+                       __ATOMIC_RELEASE);
+      return false;
+    }
+    release_bucket(job, index);
+    return true;
+  }
+
+  // The background thread is copying it right now
+  while (__atomic_load_n(&job->bucket_marks[index], __ATOMIC_ACQUIRE) !=
+         BUCKET_DONE) {
+    if (__atomic_load_n(&job->bucket_marks[index], __ATOMIC_ACQUIRE) ==
+        BUCKET_PENDING) {
+      return ensure_bucket_copied(job, index);
+    }
+    sched_yield();
+  }
+
+  return true;
+}
+
+bool drain_side(chmap_async_snapshot* job) {
+  pthread_mutex_lock(&job->side_lock);
+  unsigned char* data = job->side;
+  size_t len = job->side_len;
+  size_t capacity = job->side_capacity;
+  job->side = job->spare;
+  job->side_capacity = job->spare_capacity;
+  job->side_len = 0;
+  job->spare = data;
+  job->spare_capacity = capacity;
+  pthread_mutex_unlock(&job->side_lock);
+
+  return snapshot_writer_append_encoded(&job->writer, data, len);
+}
+
+// Copies the bucket into memory and releases it before writing anything, so
+// a writer waiting for the bucket never waits for the disk.
+bool copy_bucket_to_file(chmap_async_snapshot* job, uint32_t index) {
+  job->stage_len = 0;
+  bool result = encode_bucket(job, job->chmap->bucket_arr[index], &job->stage,
+                              &job->stage_len, &job->stage_capacity);
+  release_bucket(job, index);
+
+  return result &&
+         snapshot_writer_append_encoded(&job->writer, job->stage,
+                                        job->stage_len);
+}
+
+void* async_snapshot_thread(void* arg) {
+  chmap_async_snapshot* job = (chmap_async_snapshot*)arg;
+  bool result = snapshot_writer_init(&job->writer, job->fd, job->m_procs,
+                                     job->elem_count);
+
+  for (uint32_t i = 0; i < job->bucket_count && result; ++i) {
+    if (claim_bucket(job, i)) {
+      result = copy_bucket_to_file(job, i);
+    }
+    if (i % ASYNC_SNAPSHOT_DRAIN_INTERVAL == 0 && result) {
+      result = drain_side(job);
+    }
+  }
+
+  // The writers might still be copying the last few buckets, or might have
+  // given up on some of them for lack of memory
+  while (result &&
+         __atomic_load_n(&job->done_count, __ATOMIC_ACQUIRE) !=
+             job->bucket_count) {
+    for (uint32_t i = 0; i < job->bucket_count && result; ++i) {
+      if (__atomic_load_n(&job->bucket_marks[i], __ATOMIC_RELAXED) ==
+              BUCKET_PENDING &&
+          claim_bucket(job, i)) {
+        result = copy_bucket_to_file(job, i);
+      }
+    }
+    sched_yield();
+  }
+
+  result = result && drain_side(job) && snapshot_writer_finish(&job->writer) &&
+           fsync(job->fd) == 0;
+  snapshot_writer_release(&job->writer);
+  result = (close(job->fd) == 0) && result;
+  result = result && rename(job->tmp_path, job->path) == 0 &&
+           sync_parent_dir(job->path, job->m_procs);
+  if (!result) {
+    unlink(job->tmp_path);
+  }
+
+  if (job->done_cb) {
+    job->done_cb(result ? chm_success : chm_io_error, job->args);
+  }
+
+  __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+void destroy_async_snapshot(chmap_async_snapshot* job) {
+  chashmap_memmgmt_procs_t* m_procs = job->m_procs;
+
+  pthread_mutex_destroy(&job->side_lock);
+  if (job->side) _mem_free(m_procs, job->side);
+  if (job->spare) _mem_free(m_procs, job->spare);
+  if (job->stage) _mem_free(m_procs, job->stage);
+  if (job->bucket_marks) _mem_free(m_procs, job->bucket_marks);
+  if (job->path) _mem_free(m_procs, job->path);
+  if (job->tmp_path) _mem_free(m_procs, job->tmp_path);
+  _mem_free(m_procs, job);
+}
+
+void async_snapshot_finish(chashmap* chmap) {
+  chmap_async_snapshot* job = chmap->async_snapshot;
+
+  pthread_join(job->thread, NULL);
+  chmap->async_snapshot = NULL;
+  destroy_async_snapshot(job);
+}
+
+bool async_snapshot_before_write(chashmap* chmap, uint32_t index) {
+  chmap_async_snapshot* job = chmap->async_snapshot;
+
+  if (__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+    async_snapshot_finish(chmap);
+    return true;
+  }
+
+  if (index == ASYNC_SNAPSHOT_ALL_BUCKETS) {
+    for (uint32_t i = 0; i < job->bucket_count; ++i) {
+      if (!ensure_bucket_copied(job, i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (index >= job->bucket_count) {
+    // Everything got copied before the bucket array got resized by a reset
+    return true;
+  }
+
+  return ensure_bucket_copied(job, index);
+}
+
+chashmap_retval_t chmap_snapshot_async(
+    chashmap* chmap, const char* path,
+    void (*done_cb)(chashmap_retval_t result, void* args), void* args) {
+  if (!chmap || !path) {
+    return chm_invalid_arguments;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  chashmap_retval_t result = chm_success;
+  chmap_async_snapshot* job = NULL;
+
+  if (chmap->async_snapshot) {
+    if (!__atomic_load_n(&chmap->async_snapshot->finished,
+                         __ATOMIC_ACQUIRE)) {
+      // One at a time
+      result = chm_invalid_arguments;
+      goto unlock;
+    }
+    async_snapshot_finish(chmap);
+  }
+
+  job = (chmap_async_snapshot*)_mem_calloc(chmap->m_procs, 1,
+                                           sizeof(chmap_async_snapshot));
+  if (!job) {
+    result = chm_not_enough_memory;
+    goto unlock;
+  }
+  pthread_mutex_init(&job->side_lock, NULL);
+  job->chmap = chmap;
+  job->m_procs = chmap->m_procs;
+  job->done_cb = done_cb;
+  job->args = args;
+  job->elem_count = chmap->elem_count;
+  job->bucket_count = chmap->bucket_arr_size;
+  job->bucket_marks =
+      (uint8_t*)_mem_calloc(chmap->m_procs, job->bucket_count, sizeof(uint8_t));
+  job->path = copy_path(chmap->m_procs, path, "");
+  job->tmp_path = copy_path(chmap->m_procs, path, ".tmp");
+  if (!job->bucket_marks || !job->path || !job->tmp_path) {
+    destroy_async_snapshot(job);
+    result = chm_not_enough_memory;
+    goto unlock;
+  }
+
+  job->fd = open(job->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (job->fd < 0) {
+    destroy_async_snapshot(job);
+    result = chm_io_error;
+    goto unlock;
+  }
+
+  if (pthread_create(&job->thread, NULL, async_snapshot_thread, job) != 0) {
+    close(job->fd);
+    unlink(job->tmp_path);
+    destroy_async_snapshot(job);
+    result = chm_not_enough_memory;
+    goto unlock;
+  }
+
+  chmap->async_snapshot = job;
+
+unlock:
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  return result;
+}
@@ -0,0 +1,148 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Records the API calls made on a map. The public entry points append a
+// record once the call returns, so the gets made by the optimistic readers
+// come in concurrently, and the records get collected under a mutex. The
+// buffer gets written out by the caller that fills it up.
+
+#define TRACE_BUF_RECORDS (CHMAP_IO_BUF_SIZE / sizeof(chmap_trace_record))
+
+struct chmap_trace {
+  chashmap_memmgmt_procs_t* m_procs;
+  int fd;
+  uint64_t start_nsec;
+  pthread_mutex_t lock;
+  // A write failed, the records that come after it get dropped.
+  bool failed;
+  uint32_t record_count;
+  chmap_trace_record records[TRACE_BUF_RECORDS];
+};
+
+static inline uint64_t trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline uint64_t fnv1a_64(const void* data, uint32_t size) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Should be called with the lock held.
+static inline void trace_flush(chmap_trace* trace) {
+  if (!trace->failed && trace->record_count) {
+    trace->failed =
+        !write_fully(trace->fd, trace->records,
+                     trace->record_count * sizeof(chmap_trace_record));
+  }
+  trace->record_count = 0;
+}
+
+void trace_record(chmap_trace* trace, chmap_trace_op op,
+                  const chmap_pair* key_pair, uint32_t val_size,
+                  chashmap_retval_t result) {
+  chmap_trace_record record = {.op = op, .result = result,
+                               .val_size = val_size};
+  if (key_pair && key_pair->ptr) {
+    record.key_hash = fnv1a_64(key_pair->ptr, key_pair->size);
+    record.key_size = key_pair->size;
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  record.nsec = trace_now() - trace->start_nsec;
+  trace->records[trace->record_count++] = record;
+  if (trace->record_count == TRACE_BUF_RECORDS) {
+    trace_flush(trace);
+  }
+  pthread_mutex_unlock(&trace->lock);
+}
+
+bool trace_close(chmap_trace* trace) {
+  trace_flush(trace);
+  bool success = !trace->failed;
+  success = close(trace->fd) == 0 && success;
+  pthread_mutex_destroy(&trace->lock);
+  _mem_free(trace->m_procs, trace);
+
+  return success;
+}
+
+chashmap_retval_t chmap_start_trace(chashmap* chmap, const char* path) {
+  if (!chmap || !path || chmap->trace) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_trace* trace =
+      (chmap_trace*)_mem_alloc(chmap->m_procs, sizeof(chmap_trace));
+  if (!trace) {
+    return chm_not_enough_memory;
+  }
+
+  trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace->fd < 0) {
+    _mem_free(chmap->m_procs, trace);
+    return chm_io_error;
+  }
+
+  chmap_trace_header header = {.version = CHMAP_TRACE_VERSION,
+                               .record_size = sizeof(chmap_trace_record)};
+  memcpy(header.magic, CHMAP_TRACE_MAGIC, sizeof(header.magic));
+  if (!write_fully(trace->fd, &header, sizeof(header))) {
+    close(trace->fd);
+    _mem_free(chmap->m_procs, trace);
+    return chm_io_error;
+  }
+
+  trace->m_procs = chmap->m_procs;
+  trace->start_nsec = trace_now();
+  pthread_mutex_init(&trace->lock, NULL);
+  trace->failed = false;
+  trace->record_count = 0;
+  chmap->trace = trace;
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_stop_trace(chashmap* chmap) {
+  if (!chmap || !chmap->trace) {
+    return chm_invalid_arguments;
+  }
+
+  bool success = trace_close(chmap->trace);
+  chmap->trace = NULL;
+
+  return success ? chm_success : chm_io_error;
+}
@@ -0,0 +1,630 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Keeps the large values out of memory, by separating them from the keys
+// (as in WiscKey). The values get appended to segment files, and the nodes
+// only hold a handle, which the handle table maps to the segment and the
+// offset the value currently lives at. Thanks to that indirection, the
+// garbage collector can move the live values out of a segment without
+// touching the map: it copies them to the active segment, repoints their
+// handles, and deletes the segment.
+//
+// The segment files get unlinked as soon as they're created. The log only
+// extends the memory of the map, it doesn't make the map durable.
+
+#define VLOG_DEFAULT_SPILL_THRESHOLD 1024
+#define VLOG_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define VLOG_DEFAULT_GC_GARBAGE_PERCENT 50
+#define VLOG_NONE UINT32_MAX
+
+typedef struct vlog_record_header {
+  uint32_t handle;
+  uint32_t size;
+} vlog_record_header;
+
+typedef struct vlog_segment {
+  int fd;
+  // The bytes appended so far, and the ones still referenced by a handle.
+  uint64_t size;
+  uint64_t live_bytes;
+  // The appends and the reads in flight, the segment can't be deleted while
+  // there are any.
+  uint32_t writers;
+  uint32_t readers;
+  // The collector failed to empty it, and won't try again.
+  bool uncollectable;
+} vlog_segment;
+
+typedef struct vlog_slot {
+  // VLOG_NONE while the slot is free or the value is being written.
+  uint32_t segment;
+  uint32_t next_free;
+  uint64_t offset;
+} vlog_slot;
+
+struct chmap_vlog {
+  chashmap_memmgmt_procs_t* m_procs;
+  char* dir;
+  uint32_t spill_threshold;
+  uint64_t segment_size;
+  uint32_t gc_garbage_percent;
+
+  pthread_mutex_t lock;
+  // Signaled when the writers or the readers of a segment drop to zero.
+  pthread_cond_t idle;
+  // Signaled when a segment might be worth collecting, and on close.
+  pthread_cond_t gc_wanted;
+
+  vlog_segment** segments;
+  uint32_t segment_capacity;
+  uint32_t active;
+  uint64_t next_file_id;
+
+  vlog_slot* slots;
+  uint32_t slot_capacity;
+  uint32_t free_slot;
+
+  uint64_t live_values;
+  uint64_t live_bytes;
+  uint64_t collected_segments;
+  uint64_t relocated_bytes;
+
+  pthread_t gc_thread;
+  bool stop;
+};
+
+bool pwrite_fully(int fd, const void* data, size_t len, uint64_t offset) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  while (len > 0) {
+    ssize_t written = pwrite(fd, bytes, len, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool pread_fully(int fd, void* data, size_t len, uint64_t offset) {
+  unsigned char* bytes = (unsigned char*)data;
+  while (len > 0) {
+    ssize_t n = pread(fd, bytes, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      return false;
+    }
+    bytes += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static inline uint64_t record_len(uint32_t size) {
+  return sizeof(vlog_record_header) + (uint64_t)size;
+}
+
+// Creates a new segment file, the lock should be held. Returns the index of
+// the segment, or VLOG_NONE.
+uint32_t create_segment(chmap_vlog* vlog) {
+  uint32_t index = 0;
+  while (index < vlog->segment_capacity && vlog->segments[index]) {
+    ++index;
+  }
+
+  if (index == vlog->segment_capacity) {
+    uint32_t capacity = vlog->segment_capacity ? vlog->segment_capacity * 2 : 8;
+    vlog_segment** segments = (vlog_segment**)_mem_realloc(
+        vlog->m_procs, vlog->segments, capacity * sizeof(vlog_segment*));
+    if (!segments) {
+      return VLOG_NONE;
+    }
+    memset(segments + vlog->segment_capacity, 0,
+           (capacity - vlog->segment_capacity) * sizeof(vlog_segment*));
+    vlog->segments = segments;
+    vlog->segment_capacity = capacity;
+  }
+
+  vlog_segment* segment =
+      (vlog_segment*)_mem_calloc(vlog->m_procs, 1, sizeof(vlog_segment));
+  if (!segment) {
+    return VLOG_NONE;
+  }
+
+  size_t path_len = strlen(vlog->dir) + 64;
+  char* path = (char*)_mem_alloc(vlog->m_procs, path_len);
+  if (!path) {
+    _mem_free(vlog->m_procs, segment);
+    return VLOG_NONE;
+  }
+  snprintf(path, path_len, "%s/chashmap-vlog-%ld-%p-%lu", vlog->dir,
+           (long)getpid(), (void*)vlog, (unsigned long)vlog->next_file_id++);
+
+  segment->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (segment->fd >= 0) {
+    unlink(path);
+  }
+  _mem_free(vlog->m_procs, path);
+  if (segment->fd < 0) {
+    _mem_free(vlog->m_procs, segment);
+    return VLOG_NONE;
+  }
+
+  vlog->segments[index] = segment;
+
+  return index;
+}
+
+void destroy_segment(chmap_vlog* vlog, uint32_t index) {
+  close(vlog->segments[index]->fd);
+  _mem_free(vlog->m_procs, vlog->segments[index]);
+  vlog->segments[index] = NULL;
+}
+
+// Takes a free handle, the lock should be held.
+uint32_t alloc_slot(chmap_vlog* vlog) {
+  if (vlog->free_slot == VLOG_NONE) {
+    uint32_t capacity = vlog->slot_capacity ? vlog->slot_capacity * 2 : 1024;
+    if (capacity <= vlog->slot_capacity || capacity == VLOG_NONE) {
+      return VLOG_NONE;
+    }
+    vlog_slot* slots = (vlog_slot*)_mem_realloc(
+        vlog->m_procs, vlog->slots, capacity * sizeof(vlog_slot));
+    if (!slots) {
+      return VLOG_NONE;
+    }
+    // Chained so that the lower handles get handed out first
+    for (uint32_t i = capacity; i > vlog->slot_capacity; --i) {
+      slots[i - 1].segment = VLOG_NONE;
+      slots[i - 1].next_free = vlog->free_slot;
+      vlog->free_slot = i - 1;
+    }
+    vlog->slots = slots;
+    vlog->slot_capacity = capacity;
+  }
+
+  uint32_t handle = vlog->free_slot;
+  vlog->free_slot = vlog->slots[handle].next_free;
+
+  return handle;
+}
+
+void free_slot(chmap_vlog* vlog, uint32_t handle) {
+  vlog->slots[handle].segment = VLOG_NONE;
+  vlog->slots[handle].next_free = vlog->free_slot;
+  vlog->free_slot = handle;
+}
+
+static inline bool worth_collecting(const chmap_vlog* vlog,
+                                    const vlog_segment* segment) {
+  uint64_t garbage = segment->size - segment->live_bytes;
+  return segment->size > 0 && !segment->uncollectable &&
+         garbage * 100 >= segment->size * vlog->gc_garbage_percent;
+}
+
+// Finds room for len bytes in the active segment, moving on to a new one if
+// it's full. The lock should be held, and the segment stays pinned until
+// 'end_append' gets called.
+bool begin_append(chmap_vlog* vlog, uint64_t len, uint32_t* index,
+                  uint64_t* offset) {
+  vlog_segment* active = vlog->segments[vlog->active];
+  if (active->size > 0 && active->size + len > vlog->segment_size) {
+    uint32_t new_index = create_segment(vlog);
+    if (new_index == VLOG_NONE) {
+      return false;
+    }
+    if (worth_collecting(vlog, active)) {
+      pthread_cond_signal(&vlog->gc_wanted);
+    }
+    vlog->active = new_index;
+    active = vlog->segments[new_index];
+  }
+
+  *index = vlog->active;
+  *offset = active->size;
+  active->size += len;
+  active->live_bytes += len;
+  ++active->writers;
+
+  return true;
+}
+
+void end_append(chmap_vlog* vlog, uint32_t index) {
+  if (--vlog->segments[index]->writers == 0) {
+    pthread_cond_broadcast(&vlog->idle);
+  }
+}
+
+bool write_record(int fd, uint64_t offset, uint32_t handle,
+                  const void* val, uint32_t size) {
+  vlog_record_header header = {.handle = handle, .size = size};
+  return pwrite_fully(fd, &header, sizeof(header), offset) &&
+         pwrite_fully(fd, val, size, offset + sizeof(header));
+}
+
+bool vlog_should_spill(chmap_vlog* vlog, uint32_t size) {
+  return size >= vlog->spill_threshold;
+}
+
+bool vlog_append(chmap_vlog* vlog, const chmap_pair* val_pair,
+                 chmap_vlog_ref* ref) {
+  uint64_t len = record_len(val_pair->size);
+  uint32_t index = 0;
+  uint64_t offset = 0;
+
+  pthread_mutex_lock(&vlog->lock);
+  uint32_t handle = alloc_slot(vlog);
+  if (handle != VLOG_NONE && !begin_append(vlog, len, &index, &offset)) {
+    free_slot(vlog, handle);
+    handle = VLOG_NONE;
+  }
+  int fd = handle != VLOG_NONE ? vlog->segments[index]->fd : -1;
+  pthread_mutex_unlock(&vlog->lock);
+
+  if (handle == VLOG_NONE) {
+    return false;
+  }
+
+  bool result = write_record(fd, offset, handle, val_pair->ptr, val_pair->size);
+
+  pthread_mutex_lock(&vlog->lock);
+  end_append(vlog, index);
+  if (result) {
+    vlog->slots[handle].segment = index;
+    vlog->slots[handle].offset = offset;
+    ++vlog->live_values;
+    vlog->live_bytes += val_pair->size;
+  } else {
+    vlog->segments[index]->live_bytes -= len;
+    free_slot(vlog, handle);
+  }
+  pthread_mutex_unlock(&vlog->lock);
+
+  if (result) {
+    ref->vlog = vlog;
+    ref->handle = handle;
+    ref->size = val_pair->size;
+  }
+
+  return result;
+}
+
+bool vlog_read(const chmap_vlog_ref* ref, void* buf, uint32_t len) {
+  chmap_vlog* vlog = ref->vlog;
+
+  pthread_mutex_lock(&vlog->lock);
+  uint32_t index = vlog->slots[ref->handle].segment;
+  uint64_t offset = vlog->slots[ref->handle].offset;
+  vlog_segment* segment = vlog->segments[index];
+  ++segment->readers;
+  pthread_mutex_unlock(&vlog->lock);
+
+  bool result = pread_fully(segment->fd, buf, len,
+                            offset + sizeof(vlog_record_header));
+
+  pthread_mutex_lock(&vlog->lock);
+  if (--segment->readers == 0) {
+    pthread_cond_broadcast(&vlog->idle);
+  }
+  pthread_mutex_unlock(&vlog->lock);
+
+  return result;
+}
+
+void vlog_release(const chmap_vlog_ref* ref) {
+  chmap_vlog* vlog = ref->vlog;
+
+  pthread_mutex_lock(&vlog->lock);
+  uint32_t index = vlog->slots[ref->handle].segment;
+  vlog_segment* segment = vlog->segments[index];
+  segment->live_bytes -= record_len(ref->size);
+  --vlog->live_values;
+  vlog->live_bytes -= ref->size;
+  free_slot(vlog, ref->handle);
+  if (index != vlog->active && worth_collecting(vlog, segment)) {
+    pthread_cond_signal(&vlog->gc_wanted);
+  }
+  pthread_mutex_unlock(&vlog->lock);
+}
+
+bool load_entry_val(const chmap_entry* entry, chmap_pair* val_pair,
+                    void** buf, uint32_t* capacity) {
+  if (!entry_spilled(entry)) {
+    *val_pair = *entry->val_pair;
+    return true;
+  }
+
+  const chmap_vlog_ref* ref = (const chmap_vlog_ref*)entry->val_pair->ptr;
+  if (ref->size > *capacity) {
+    void* new_buf = _mem_realloc(ref->vlog->m_procs, *buf, ref->size);
+    if (!new_buf) {
+      return false;
+    }
+    *buf = new_buf;
+    *capacity = ref->size;
+  }
+
+  if (!vlog_read(ref, *buf, ref->size)) {
+    return false;
+  }
+
+  val_pair->ptr = *buf;
+  val_pair->size = ref->size;
+
+  return true;
+}
+
+// Picks the sealed segment with the most garbage, as long as there's enough
+// of it. The lock should be held.
+uint32_t pick_victim(chmap_vlog* vlog) {
+  uint32_t victim = VLOG_NONE;
+  uint64_t most_garbage = 0;
+
+  for (uint32_t i = 0; i < vlog->segment_capacity; ++i) {
+    vlog_segment* segment = vlog->segments[i];
+    if (!segment || i == vlog->active || !worth_collecting(vlog, segment)) {
+      continue;
+    }
+    uint64_t garbage = segment->size - segment->live_bytes;
+    if (victim == VLOG_NONE || garbage > most_garbage) {
+      victim = i;
+      most_garbage = garbage;
+    }
+  }
+
+  return victim;
+}
+
+// Moves a live value to the active segment, unless it stops being live in
+// the meantime. The lock should be held, it gets dropped for the I/O.
+bool relocate_value(chmap_vlog* vlog, uint32_t victim, uint64_t victim_offset,
+                    uint32_t handle, const void* val, uint32_t size) {
+  uint64_t len = record_len(size);
+  uint32_t index = 0;
+  uint64_t offset = 0;
+
+  if (!begin_append(vlog, len, &index, &offset)) {
+    return false;
+  }
+  int fd = vlog->segments[index]->fd;
+  pthread_mutex_unlock(&vlog->lock);
+
+  bool result = write_record(fd, offset, handle, val, size);
+
+  pthread_mutex_lock(&vlog->lock);
+  end_append(vlog, index);
+  vlog_slot* slot = &vlog->slots[handle];
+  if (result && slot->segment == victim && slot->offset == victim_offset) {
+    slot->segment = index;
+    slot->offset = offset;
+    vlog->segments[victim]->live_bytes -= len;
+    vlog->relocated_bytes += size;
+  } else {
+    // Either the write failed, or the value got released while being copied
+    vlog->segments[index]->live_bytes -= len;
+  }
+
+  return result;
+}
+
+// Copies the live values of a segment elsewhere, and deletes it. The lock
+// should be held, it gets dropped for the I/O.
+void collect_segment(chmap_vlog* vlog, uint32_t victim) {
+  vlog_segment* segment = vlog->segments[victim];
+  while (segment->writers > 0) {
+    pthread_cond_wait(&vlog->idle, &vlog->lock);
+  }
+
+  void* buf = NULL;
+  uint32_t capacity = 0;
+  uint64_t offset = 0;
+  bool result = true;
+
+  while (result && offset < segment->size && segment->live_bytes > 0 &&
+         !vlog->stop) {
+    pthread_mutex_unlock(&vlog->lock);
+    vlog_record_header header;
+    result = pread_fully(segment->fd, &header, sizeof(header), offset);
+    pthread_mutex_lock(&vlog->lock);
+    if (!result || offset + record_len(header.size) > segment->size) {
+      result = false;
+      break;
+    }
+
+    bool live = header.handle < vlog->slot_capacity &&
+                vlog->slots[header.handle].segment == victim &&
+                vlog->slots[header.handle].offset == offset;
+    if (live) {
+      if (header.size > capacity) {
+        void* new_buf = _mem_realloc(vlog->m_procs, buf, header.size);
+        if (!new_buf) {
+          result = false;
+          break;
+        }
+        buf = new_buf;
+        capacity = header.size;
+      }
+      pthread_mutex_unlock(&vlog->lock);
+      result = pread_fully(segment->fd, buf, header.size,
+                           offset + sizeof(header));
+      pthread_mutex_lock(&vlog->lock);
+      result = result && relocate_value(vlog, victim, offset, header.handle,
+                                        buf, header.size);
+    }
+
+    offset += record_len(header.size);
+  }
+
+  if (buf) _mem_free(vlog->m_procs, buf);
+
+  if (segment->live_bytes == 0) {
+    while (segment->readers > 0) {
+      pthread_cond_wait(&vlog->idle, &vlog->lock);
+    }
+    destroy_segment(vlog, victim);
+    ++vlog->collected_segments;
+  } else if (!result) {
+    segment->uncollectable = true;
+  }
+}
+
+void* vlog_gc_thread(void* arg) {
+  chmap_vlog* vlog = (chmap_vlog*)arg;
+
+  pthread_mutex_lock(&vlog->lock);
+  while (!vlog->stop) {
+    uint32_t victim = pick_victim(vlog);
+    if (victim == VLOG_NONE) {
+      pthread_cond_wait(&vlog->gc_wanted, &vlog->lock);
+    } else {
+      collect_segment(vlog, victim);
+    }
+  }
+  pthread_mutex_unlock(&vlog->lock);
+
+  return NULL;
+}
+
+void free_vlog(chmap_vlog* vlog) {
+  for (uint32_t i = 0; i < vlog->segment_capacity; ++i) {
+    if (vlog->segments[i]) {
+      destroy_segment(vlog, i);
+    }
+  }
+  if (vlog->segments) _mem_free(vlog->m_procs, vlog->segments);
+  if (vlog->slots) _mem_free(vlog->m_procs, vlog->slots);
+  if (vlog->dir) _mem_free(vlog->m_procs, vlog->dir);
+  pthread_cond_destroy(&vlog->gc_wanted);
+  pthread_cond_destroy(&vlog->idle);
+  pthread_mutex_destroy(&vlog->lock);
+  _mem_free(vlog->m_procs, vlog);
+}
+
+void vlog_close(chmap_vlog* vlog) {
+  pthread_mutex_lock(&vlog->lock);
+  vlog->stop = true;
+  pthread_cond_signal(&vlog->gc_wanted);
+  pthread_mutex_unlock(&vlog->lock);
+
+  pthread_join(vlog->gc_thread, NULL);
+  free_vlog(vlog);
+}
+
+chashmap_retval_t chmap_enable_value_log(chashmap* chmap, const char* dir,
+                                         const chmap_vlog_options* options) {
+  if (!chmap || !dir || chmap->vlog || chmap->seqlock) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_vlog* vlog =
+      (chmap_vlog*)_mem_calloc(chmap->m_procs, 1, sizeof(chmap_vlog));
+  if (!vlog) {
+    return chm_not_enough_memory;
+  }
+
+  vlog->m_procs = chmap->m_procs;
+  vlog->spill_threshold = VLOG_DEFAULT_SPILL_THRESHOLD;
+  vlog->segment_size = VLOG_DEFAULT_SEGMENT_SIZE;
+  vlog->gc_garbage_percent = VLOG_DEFAULT_GC_GARBAGE_PERCENT;
+  if (options) {
+    if (options->spill_threshold) {
+      vlog->spill_threshold = options->spill_threshold;
+    }
+    if (options->segment_size) {
+      vlog->segment_size = options->segment_size;
+    }
+    if (options->gc_garbage_percent) {
+      vlog->gc_garbage_percent = options->gc_garbage_percent;
+    }
+  }
+  vlog->free_slot = VLOG_NONE;
+  pthread_mutex_init(&vlog->lock, NULL);
+  pthread_cond_init(&vlog->idle, NULL);
+  pthread_cond_init(&vlog->gc_wanted, NULL);
+
+  size_t dir_len = strlen(dir);
+  vlog->dir = (char*)_mem_alloc(chmap->m_procs, dir_len + 1);
+  if (!vlog->dir) {
+    free_vlog(vlog);
+    return chm_not_enough_memory;
+  }
+  memcpy(vlog->dir, dir, dir_len + 1);
+
+  vlog->active = create_segment(vlog);
+  if (vlog->active == VLOG_NONE) {
+    free_vlog(vlog);
+    return chm_io_error;
+  }
+
+  if (pthread_create(&vlog->gc_thread, NULL, vlog_gc_thread, vlog) != 0) {
+    free_vlog(vlog);
+    return chm_not_enough_memory;
+  }
+
+  chmap->vlog = vlog;
+
+  return chm_success;
+}
+
+chashmap_retval_t chmap_get_value_log_stats(chashmap* chmap,
+                                            chmap_vlog_stats* stats) {
+  if (!chmap || !stats || !chmap->vlog) {
+    return chm_invalid_arguments;
+  }
+
+  chmap_vlog* vlog = chmap->vlog;
+  memset(stats, 0, sizeof(chmap_vlog_stats));
+
+  pthread_mutex_lock(&vlog->lock);
+  stats->live_values = vlog->live_values;
+  stats->live_bytes = vlog->live_bytes;
+  for (uint32_t i = 0; i < vlog->segment_capacity; ++i) {
+    if (vlog->segments[i]) {
+      ++stats->segment_count;
+      stats->disk_bytes += vlog->segments[i]->size;
+    }
+  }
+  stats->collected_segments = vlog->collected_segments;
+  stats->relocated_bytes = vlog->relocated_bytes;
+  pthread_mutex_unlock(&vlog->lock);
+
+  return chm_success;
+}
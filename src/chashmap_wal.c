@@ -0,0 +1,545 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chashmap_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// The write-ahead log. The mutations get encoded into a memory buffer by the
+// thread that makes them, and a background thread writes the buffer out and
+// fdatasyncs it once the commit interval passes or enough bytes pile up, so
+// a mutation only pays for a memcpy. Every record carries its own checksum,
+// a torn record at the end of the log marks the point of the crash.
+
+#define WAL_OP_INSERT 1
+#define WAL_OP_DELETE 2
+#define WAL_OP_RESET 3
+
+#define WAL_DEFAULT_COMMIT_INTERVAL_US 1000
+#define WAL_DEFAULT_COMMIT_BYTES (1024 * 1024)
+
+typedef struct wal_record_header {
+  uint32_t checksum;  // Of the rest of the header, the key and the value
+  uint8_t op;
+  uint8_t padding[3];
+  uint32_t key_size;
+  uint32_t val_size;
+} wal_record_header;
+
+typedef struct wal_buffer {
+  unsigned char* data;
+  size_t len;
+  size_t capacity;
+} wal_buffer;
+
+struct chmap_wal {
+  chmap_mutation_hook hook;
+  chashmap* chmap;
+  chashmap_memmgmt_procs_t* m_procs;
+  int fd;
+  uint32_t commit_interval_us;
+  uint32_t commit_bytes;
+
+  pthread_mutex_t lock;
+  pthread_cond_t flush_needed;
+  pthread_cond_t flushed;
+  pthread_t flusher;
+  // The records waiting for the flusher, and the ones it is writing out
+  wal_buffer pending;
+  wal_buffer writing;
+  // Byte counts since the log got opened, durable <= appended
+  uint64_t appended;
+  uint64_t durable;
+  uint32_t sync_waiters;
+  bool stop;
+  bool failed;
+};
+
+uint32_t wal_record_checksum(const wal_record_header* header,
+                             const void* key, const void* val) {
+  chmap_checksum checksum;
+  checksum_init(&checksum);
+  checksum_update(&checksum, &header->op,
+                  sizeof(wal_record_header) - sizeof(header->checksum));
+  if (key) checksum_update(&checksum, key, header->key_size);
+  if (val) checksum_update(&checksum, val, header->val_size);
+  return (uint32_t)checksum_final(&checksum);
+}
+
+bool wal_buffer_reserve(chmap_wal* wal, wal_buffer* buffer, size_t len) {
+  if (buffer->len + len <= buffer->capacity) {
+    return true;
+  }
+
+  size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+  while (capacity < buffer->len + len) {
+    capacity *= 2;
+  }
+
+  unsigned char* data =
+      (unsigned char*)_mem_realloc(wal->m_procs, buffer->data, capacity);
+  if (!data) {
+    return false;
+  }
+
+  buffer->data = data;
+  buffer->capacity = capacity;
+
+  return true;
+}
+
+// Whether the pending records should be written out without waiting for
+// the rest of the interval.
+static inline bool wal_flush_due(const chmap_wal* wal) {
+  return !wal->failed && wal->pending.len > 0 &&
+         (wal->pending.len >= wal->commit_bytes || wal->sync_waiters > 0 ||
+          wal->commit_interval_us == 0);
+}
+
+void wal_append(chmap_wal* wal, uint8_t op, const chmap_pair* key_pair,
+                const chmap_pair* val_pair) {
+  wal_record_header header = {.op = op,
+                              .key_size = key_pair ? key_pair->size : 0,
+                              .val_size = val_pair ? val_pair->size : 0};
+  const void* key = key_pair ? key_pair->ptr : NULL;
+  const void* val = val_pair ? val_pair->ptr : NULL;
+  header.checksum = wal_record_checksum(&header, key, val);
+  size_t len = sizeof(header) + header.key_size + header.val_size;
+
+  pthread_mutex_lock(&wal->lock);
+
+  if (!wal_buffer_reserve(wal, &wal->pending, len)) {
+    // A lost record would make the log silently diverge from the map
+    wal->failed = true;
+    pthread_cond_broadcast(&wal->flushed);
+  } else {
+    unsigned char* dest = wal->pending.data + wal->pending.len;
+    memcpy(dest, &header, sizeof(header));
+    if (key) memcpy(dest + sizeof(header), key, header.key_size);
+    if (val) memcpy(dest + sizeof(header) + header.key_size, val,
+                    header.val_size);
+    // The flusher starts timing the interval with the first record
+    bool was_empty = wal->pending.len == 0;
+    wal->pending.len += len;
+    wal->appended += len;
+    if (was_empty || wal_flush_due(wal)) {
+      pthread_cond_signal(&wal->flush_needed);
+    }
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_on_insert(void* ctx, const chmap_pair* key_pair,
+                   const chmap_pair* val_pair) {
+  wal_append((chmap_wal*)ctx, WAL_OP_INSERT, key_pair, val_pair);
+}
+
+void wal_on_delete(void* ctx, const chmap_pair* key_pair) {
+  wal_append((chmap_wal*)ctx, WAL_OP_DELETE, key_pair, NULL);
+}
+
+void wal_on_reset(void* ctx) {
+  wal_append((chmap_wal*)ctx, WAL_OP_RESET, NULL, NULL);
+}
+
+void close_wal(chmap_wal* wal);
+
+void wal_release(void* ctx) { close_wal((chmap_wal*)ctx); }
+
+void deadline_after_us(struct timespec* deadline, uint32_t us) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += us / 1000000;
+  deadline->tv_nsec += (long)(us % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec += 1;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+void* wal_flusher(void* arg) {
+  chmap_wal* wal = (chmap_wal*)arg;
+
+  pthread_mutex_lock(&wal->lock);
+
+  while (true) {
+    // The interval starts with the first record that comes in
+    bool timing = false;
+    struct timespec deadline;
+
+    while (!wal->stop && !wal_flush_due(wal)) {
+      if (wal->failed || wal->pending.len == 0) {
+        pthread_cond_wait(&wal->flush_needed, &wal->lock);
+        continue;
+      }
+      if (!timing) {
+        deadline_after_us(&deadline, wal->commit_interval_us);
+        timing = true;
+      }
+      if (pthread_cond_timedwait(&wal->flush_needed, &wal->lock, &deadline) ==
+          ETIMEDOUT) {
+        break;
+      }
+    }
+
+    if (wal->pending.len > 0 && !wal->failed) {
+      wal_buffer tmp = wal->writing;
+      wal->writing = wal->pending;
+      wal->pending = tmp;
+      wal->pending.len = 0;
+      uint64_t target = wal->appended;
+
+      pthread_mutex_unlock(&wal->lock);
+      bool ok = write_fully(wal->fd, wal->writing.data, wal->writing.len) &&
+                fdatasync(wal->fd) == 0;
+      wal->writing.len = 0;
+      pthread_mutex_lock(&wal->lock);
+
+      if (ok) {
+        wal->durable = target;
+      } else {
+        wal->failed = true;
+      }
+      pthread_cond_broadcast(&wal->flushed);
+    }
+
+    if (wal->stop && (wal->pending.len == 0 || wal->failed)) {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+
+  return NULL;
+}
+
+chmap_wal* chmap_wal_open(chashmap* chmap, const char* log_path,
+                          const chmap_wal_options* options, char** err) {
+  if (!chmap || !log_path) {
+    if (err) {
+      *err = CERR_STR("Invalid arguments");
+    }
+    return NULL;
+  }
+
+  chmap_wal* wal = (chmap_wal*)_mem_calloc(chmap->m_procs, 1, sizeof(chmap_wal));
+  if (!wal) {
+    if (err) {
+      *err = CERR_STR("Failed to allocate buffer");
+    }
+    return NULL;
+  }
+
+  wal->chmap = chmap;
+  wal->m_procs = chmap->m_procs;
+  wal->commit_interval_us =
+      options ? options->commit_interval_us : WAL_DEFAULT_COMMIT_INTERVAL_US;
+  wal->commit_bytes = options && options->commit_bytes
+                          ? options->commit_bytes
+                          : WAL_DEFAULT_COMMIT_BYTES;
+
+  wal->fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (wal->fd < 0) {
+    if (err) {
+      *err = CERR_STR("Failed to open the log");
+    }
+    _mem_free(wal->m_procs, wal);
+    return NULL;
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->flush_needed, &cond_attr);
+  pthread_cond_init(&wal->flushed, NULL);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (pthread_create(&wal->flusher, NULL, wal_flusher, wal) != 0) {
+    if (err) {
+      *err = CERR_STR("Failed to start the flusher thread");
+    }
+    pthread_cond_destroy(&wal->flushed);
+    pthread_cond_destroy(&wal->flush_needed);
+    pthread_mutex_destroy(&wal->lock);
+    close(wal->fd);
+    _mem_free(wal->m_procs, wal);
+    return NULL;
+  }
+
+  wal->hook.on_insert = wal_on_insert;
+  wal->hook.on_delete = wal_on_delete;
+  wal->hook.on_reset = wal_on_reset;
+  wal->hook.release = wal_release;
+  wal->hook.ctx = wal;
+  chmap_add_mutation_hook(chmap, &wal->hook);
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return wal;
+}
+
+// The flusher is already running, so it only needs to be asked to hurry.
+chashmap_retval_t wal_sync(chmap_wal* wal) {
+  pthread_mutex_lock(&wal->lock);
+
+  uint64_t target = wal->appended;
+  ++wal->sync_waiters;
+  pthread_cond_signal(&wal->flush_needed);
+  while (wal->durable < target && !wal->failed) {
+    pthread_cond_wait(&wal->flushed, &wal->lock);
+  }
+  --wal->sync_waiters;
+  bool failed = wal->failed;
+
+  pthread_mutex_unlock(&wal->lock);
+
+  return failed ? chm_io_error : chm_success;
+}
+
+chashmap_retval_t chmap_wal_sync(chmap_wal* wal) {
+  if (!wal) {
+    return chm_invalid_arguments;
+  }
+
+  return wal_sync(wal);
+}
+
+chashmap_retval_t chmap_wal_checkpoint(chmap_wal* wal,
+                                       const char* snapshot_path) {
+  if (!wal || !snapshot_path) {
+    return chm_invalid_arguments;
+  }
+
+  char* tmp_path = copy_path(wal->m_procs, snapshot_path, ".tmp");
+  if (!tmp_path) {
+    return chm_not_enough_memory;
+  }
+
+  chashmap* chmap = wal->chmap;
+  if (chmap->seqlock) {
+    pthread_mutex_lock(&chmap->seqlock->write_lock);
+  }
+
+  // Nothing can get logged from here on, so once the log is synced, the
+  // snapshot covers every record in it.
+  chashmap_retval_t result = wal_sync(wal);
+
+  int fd = -1;
+  if (result == chm_success) {
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      result = chm_io_error;
+    }
+  }
+  if (result == chm_success) {
+    result = save_chmap(chmap, fd);
+  }
+  if (result == chm_success && fsync(fd) != 0) {
+    result = chm_io_error;
+  }
+  if (fd >= 0 && close(fd) != 0 && result == chm_success) {
+    result = chm_io_error;
+  }
+  if (result == chm_success &&
+      (rename(tmp_path, snapshot_path) != 0 ||
+       !sync_parent_dir(snapshot_path, wal->m_procs))) {
+    result = chm_io_error;
+  }
+  // Replaying the log over the new snapshot would be harmless, so a crash
+  // right before the truncation loses nothing
+  if (result == chm_success &&
+      (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0)) {
+    result = chm_io_error;
+  }
+
+  if (chmap->seqlock) {
+    pthread_mutex_unlock(&chmap->seqlock->write_lock);
+  }
+
+  if (result != chm_success) {
+    unlink(tmp_path);
+  }
+  _mem_free(wal->m_procs, tmp_path);
+
+  return result;
+}
+
+void close_wal(chmap_wal* wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stop = true;
+  pthread_cond_signal(&wal->flush_needed);
+  pthread_mutex_unlock(&wal->lock);
+  pthread_join(wal->flusher, NULL);
+
+  close(wal->fd);
+  pthread_cond_destroy(&wal->flushed);
+  pthread_cond_destroy(&wal->flush_needed);
+  pthread_mutex_destroy(&wal->lock);
+  if (wal->pending.data) _mem_free(wal->m_procs, wal->pending.data);
+  if (wal->writing.data) _mem_free(wal->m_procs, wal->writing.data);
+  _mem_free(wal->m_procs, wal);
+}
+
+void __chmap_wal_close(chmap_wal* wal) {
+  if (!wal) {
+    return;
+  }
+
+  chmap_remove_mutation_hook(wal->chmap, &wal->hook);
+  close_wal(wal);
+}
+
+// Applies the records in the log to chmap, and cuts the log at the first
+// torn or corrupted record.
+const char* replay_log(chashmap* chmap, int fd) {
+  chmap_reader* reader =
+      (chmap_reader*)_mem_alloc(chmap->m_procs, sizeof(chmap_reader));
+  if (!reader) {
+    return CERR_STR("Failed to allocate the read buffer");
+  }
+  reader_init(reader, fd);
+  reader->checksummed = false;
+
+  void* key_buf = NULL;
+  void* val_buf = NULL;
+  uint32_t key_capacity = 0;
+  uint32_t val_capacity = 0;
+  uint64_t valid_len = 0;
+  const char* replay_err = NULL;
+
+  while (!replay_err) {
+    wal_record_header header;
+    if (!reader_read(reader, &header, sizeof(header))) {
+      break;
+    }
+
+    bool well_formed =
+        (header.op == WAL_OP_INSERT && header.key_size && header.val_size) ||
+        (header.op == WAL_OP_DELETE && header.key_size && !header.val_size) ||
+        (header.op == WAL_OP_RESET && !header.key_size && !header.val_size);
+    if (!well_formed) {
+      break;
+    }
+
+    if (!reserve_scratch(chmap, &key_buf, &key_capacity, header.key_size) ||
+        !reserve_scratch(chmap, &val_buf, &val_capacity, header.val_size)) {
+      replay_err = CERR_STR("Failed to allocate a record buffer");
+      break;
+    }
+
+    if (!reader_read(reader, key_buf, header.key_size) ||
+        !reader_read(reader, val_buf, header.val_size) ||
+        wal_record_checksum(&header, header.key_size ? key_buf : NULL,
+                            header.val_size ? val_buf : NULL) !=
+            header.checksum) {
+      break;
+    }
+
+    chmap_pair key_pair = {.ptr = key_buf, .size = header.key_size};
+    chmap_pair val_pair = {.ptr = val_buf, .size = header.val_size};
+    chashmap_retval_t result = chm_success;
+    if (header.op == WAL_OP_INSERT) {
+      result = chmap_insert_elem(chmap, &key_pair, &val_pair);
+    } else if (header.op == WAL_OP_DELETE) {
+      chmap_delete_elem(chmap, &key_pair);
+    } else {
+      result = chmap_reset(chmap, 0);
+    }
+    if (result != chm_success) {
+      replay_err = CERR_STR("Failed to apply a record");
+    }
+
+    valid_len += sizeof(header) + header.key_size + header.val_size;
+  }
+
+  if (key_buf) _mem_free(chmap->m_procs, key_buf);
+  if (val_buf) _mem_free(chmap->m_procs, val_buf);
+  _mem_free(chmap->m_procs, reader);
+
+  if (!replay_err && ftruncate(fd, valid_len) != 0) {
+    replay_err = CERR_STR("Failed to cut the torn tail of the log");
+  }
+
+  return replay_err;
+}
+
+chashmap* chmap_wal_recover(const char* snapshot_path, const char* log_path,
+                            chashmap_memmgmt_procs_t* mmgmt_procs,
+                            char** err) {
+  if (!snapshot_path || !log_path) {
+    if (err) {
+      *err = CERR_STR("Invalid arguments");
+    }
+    return NULL;
+  }
+
+  chashmap* chmap = NULL;
+  int snapshot_fd = open(snapshot_path, O_RDONLY);
+  if (snapshot_fd >= 0) {
+    chmap = chmap_load(snapshot_fd, mmgmt_procs, err);
+    close(snapshot_fd);
+  } else if (errno == ENOENT) {
+    // Nothing got checkpointed yet
+    chmap = chmap_create_mp(1, mmgmt_procs, err);
+  } else if (err) {
+    *err = CERR_STR("Failed to open the snapshot");
+  }
+  if (!chmap) {
+    return NULL;
+  }
+
+  int log_fd = open(log_path, O_RDWR);
+  if (log_fd < 0) {
+    if (errno != ENOENT) {
+      if (err) {
+        *err = CERR_STR("Failed to open the log");
+      }
+      chmap_destroy(chmap);
+      return NULL;
+    }
+  } else {
+    const char* replay_err = replay_log(chmap, log_fd);
+    close(log_fd);
+    if (replay_err) {
+      if (err) {
+        *err = (char*)replay_err;
+      }
+      chmap_destroy(chmap);
+      return NULL;
+    }
+  }
+
+  if (err) {
+    *err = NULL;
+  }
+
+  return chmap;
+}
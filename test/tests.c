@@ -620,7 +620,6 @@ TEST(chash_maps, for_each_elem_rd) {
   chmap_destroy(chmap);
 }
 
-extern uint32_t chmap_get_bucket_arr_size(chashmap* chmap);
 extern uint32_t chmap_get_elem_count_to_scale_up(chashmap* chmap);
 extern uint32_t chmap_get_elem_count_to_scale_down(chashmap* chmap);
 
@@ -631,6 +630,7 @@ TEST(chash_maps, scaling) {
   uint32_t first_up_threshold = chmap_get_elem_count_to_scale_up(chmap);
   uint32_t first_down_threshold = chmap_get_elem_count_to_scale_down(chmap);
   uint32_t first_capacity = chmap_get_bucket_arr_size(chmap);
+  REQUIRE_EQ(chmap_get_bucket_arr_size(NULL), 0);
 
   char key_buf[16] = {0};
   for (uint32_t i = 0; i <= first_up_threshold; ++i) {
@@ -659,3 +659,1616 @@ TEST(chash_maps, scaling) {
 
   chmap_destroy(chmap);
 }
+
+TEST(chash_maps, optimistic_reads_basic) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  REQUIRE_EQ(chmap_enable_optimistic_reads(NULL), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_enable_optimistic_reads(chmap), chm_success);
+  REQUIRE_EQ(chmap_enable_optimistic_reads(chmap), chm_success);
+
+  int val = -1;
+  REQUIRE_EQ(get_int_from_string(chmap, "key1", &val), chm_key_not_found);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 3), chm_success);
+  REQUIRE_EQ(get_int_from_string(chmap, "key1", &val), chm_success);
+  REQUIRE_EQ(val, 3);
+
+  // A value with a different size gets published as a new pair
+  unsigned long long_val = 0xabcdef0123;
+  unsigned long long_target = 0;
+  REQUIRE_EQ(
+      chmap_insert_elem(
+          chmap, &(chmap_pair){.ptr = "key1", .size = strlen("key1")},
+          &(chmap_pair){.ptr = &long_val, .size = sizeof(long_val)}),
+      chm_success);
+  REQUIRE_EQ(chmap_get_elem_copy(
+                 chmap, &(chmap_pair){.ptr = "key1", .size = strlen("key1")},
+                 &long_target, sizeof(long_target)),
+             chm_success);
+  REQUIRE_EQ(long_target, long_val);
+
+  // Scale up and down while retiring the old bucket arrays
+  char key_buf[16] = {0};
+  for (uint32_t i = 0; i < 1000; ++i) {
+    snprintf(key_buf, 16, "key%u", i + 2);
+    REQUIRE_EQ(insert_string_to_int(chmap, key_buf, i), chm_success);
+  }
+  for (uint32_t i = 0; i < 1000; ++i) {
+    snprintf(key_buf, 16, "key%u", i + 2);
+    REQUIRE_EQ(get_int_from_string(chmap, key_buf, &val), chm_success);
+    REQUIRE_EQ(val, (int)i);
+    REQUIRE_EQ(delete_int_from_string(chmap, key_buf), chm_success);
+  }
+  REQUIRE_EQ(chmap_elem_count(chmap), 1);
+
+  chmap_reclaim_retired(chmap);
+
+  REQUIRE_EQ(chmap_reset(chmap, 1024), chm_success);
+  REQUIRE_EQ(chmap_elem_count(chmap), 0);
+  REQUIRE_EQ(get_int_from_string(chmap, "key1", &val), chm_key_not_found);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 5), chm_success);
+  REQUIRE_EQ(get_int_from_string(chmap, "key1", &val), chm_success);
+  REQUIRE_EQ(val, 5);
+
+  chmap_destroy(chmap);
+}
+
+#include <pthread.h>
+
+typedef struct optimistic_test_val {
+  unsigned long first;
+  unsigned long second;
+  unsigned long padding[6];
+} optimistic_test_val;
+
+typedef struct optimistic_test_args {
+  chashmap* chmap;
+  volatile int stop;
+  int torn_reads;
+  int hits;
+} optimistic_test_args;
+
+void* optimistic_reader(void* arg) {
+  optimistic_test_args* args = (optimistic_test_args*)arg;
+  char key_buf[16] = {0};
+  optimistic_test_val val;
+  uint32_t i = 0;
+
+  while (!args->stop) {
+    snprintf(key_buf, 16, "key%u", i++ % 512);
+    if (chmap_get_elem_copy(
+            args->chmap,
+            &(chmap_pair){.ptr = key_buf, .size = strlen(key_buf)}, &val,
+            sizeof(val)) == chm_success) {
+      ++args->hits;
+      if (val.first != val.second) {
+        ++args->torn_reads;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+TEST(chash_maps, optimistic_reads_concurrent) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ(chmap_enable_optimistic_reads(chmap), chm_success);
+
+  optimistic_test_args args[2] = {{.chmap = chmap}, {.chmap = chmap}};
+  pthread_t readers[2];
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE_EQ(pthread_create(&readers[i], NULL, optimistic_reader, &args[i]),
+               0);
+  }
+
+  char key_buf[16] = {0};
+  optimistic_test_val val = {0};
+  for (unsigned long round = 0; round < 20; ++round) {
+    for (uint32_t i = 0; i < 512; ++i) {
+      snprintf(key_buf, 16, "key%u", i);
+      val.first = val.second = round * 512 + i;
+      // Alternate the value sizes to exercise the replacement path too
+      uint32_t size = (round % 2) ? sizeof(val) : sizeof(val) - sizeof(long);
+      REQUIRE_EQ(chmap_insert_elem(
+                     chmap,
+                     &(chmap_pair){.ptr = key_buf, .size = strlen(key_buf)},
+                     &(chmap_pair){.ptr = &val, .size = size}),
+                 chm_success);
+    }
+    if (round % 5 == 4) {
+      for (uint32_t i = 0; i < 512; ++i) {
+        snprintf(key_buf, 16, "key%u", i);
+        REQUIRE_EQ(delete_int_from_string(chmap, key_buf), chm_success);
+      }
+    }
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    args[i].stop = 1;
+    pthread_join(readers[i], NULL);
+    REQUIRE_EQ(args[i].torn_reads, 0);
+  }
+
+  chmap_reclaim_retired(chmap);
+  chmap_destroy(chmap);
+}
+
+void add_elem_to_atomic_sum(const chmap_pair* key_pair, chmap_pair* val_pair,
+                            void* args) {
+  // This if block is there to make the compiler happy, it's meaningless.
+  if (!key_pair) {
+    *(long*)args = 0;
+  }
+
+  __atomic_fetch_add((long*)args, *(int*)val_pair->ptr, __ATOMIC_RELAXED);
+}
+
+void add_elem_to_local_sum(const chmap_pair* key_pair, chmap_pair* val_pair,
+                           void* local, void* args) {
+  // This if block is there to make the compiler happy, it's meaningless.
+  if (!key_pair) {
+    *(long*)args = 0;
+  }
+
+  *(long*)local += *(int*)val_pair->ptr;
+}
+
+void combine_local_sum(void* local, void* args) {
+  *(long*)args += *(long*)local;
+}
+
+TEST(chash_maps, for_each_elem_parallel) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  long expected = 0;
+  for (int i = 0; i < 20000; ++i) {
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+               chm_success);
+    expected += i;
+  }
+
+  long sum = 0;
+  REQUIRE_EQ(chmap_for_each_elem_parallel(NULL, 4, add_elem_to_atomic_sum,
+                                          &sum),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_for_each_elem_parallel(chmap, 4, add_elem_to_atomic_sum,
+                                          &sum),
+             chm_success);
+  REQUIRE_EQ(sum, expected);
+
+  chmap_reducer reducer = {.local_size = sizeof(long),
+                           .init = NULL,
+                           .combine = combine_local_sum};
+  for (uint32_t threads = 0; threads <= 8; threads += 4) {
+    sum = 0;
+    REQUIRE_EQ(chmap_for_each_elem_parallel_reduce(
+                   chmap, threads, add_elem_to_local_sum, &reducer, &sum),
+               chm_success);
+    REQUIRE_EQ(sum, expected);
+  }
+
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, scaling_with_resize_threads) {
+  chashmap* chmap = chmap_create(65536, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  REQUIRE_EQ(chmap_set_resize_threads(chmap, 0), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_set_resize_threads(chmap, 4), chm_success);
+
+  uint32_t first_capacity = chmap_get_bucket_arr_size(chmap);
+  uint32_t count = chmap_get_elem_count_to_scale_up(chmap) + 1;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+               chm_success);
+  }
+  REQUIRE_TRUE(first_capacity < chmap_get_bucket_arr_size(chmap));
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t val = 0;
+    REQUIRE_EQ(chmap_get_elem_copy(chmap,
+                                   &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                   &val, sizeof(val)),
+               chm_success);
+    REQUIRE_EQ(val, i);
+  }
+
+  // Delete until the map scales back down
+  uint32_t i = 0;
+  uint32_t grown_capacity = chmap_get_bucket_arr_size(chmap);
+  while (chmap_get_bucket_arr_size(chmap) == grown_capacity) {
+    REQUIRE_EQ(
+        chmap_delete_elem(chmap, &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+        chm_success);
+    ++i;
+  }
+
+  for (; i < count; ++i) {
+    uint32_t val = 0;
+    REQUIRE_EQ(chmap_get_elem_copy(chmap,
+                                   &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                   &val, sizeof(val)),
+               chm_success);
+    REQUIRE_EQ(val, i);
+  }
+
+  chmap_destroy(chmap);
+}
+
+void add_snapshot_elem_to_sum(const chmap_pair* key_pair,
+                              const chmap_pair* val_pair, void* args) {
+  // This if block is there to make the compiler happy, it's meaningless.
+  if (!key_pair) {
+    *(int*)args = 0;
+  }
+
+  *(int*)args += *(int*)val_pair->ptr;
+}
+
+int get_int_from_snapshot(chashmap_snapshot* snap, const char* key,
+                          int* target) {
+  return chmap_snapshot_get_elem_copy(
+      snap, &(chmap_pair){.ptr = (void*)key, .size = strlen(key)}, target,
+      sizeof(int));
+}
+
+TEST(chash_maps, snapshots) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 1), chm_success);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key2", 2), chm_success);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key3", 3), chm_success);
+
+  chashmap_snapshot* snap1 = chmap_snapshot(chmap);
+  REQUIRE_NE((void*)snap1, NULL);
+  REQUIRE_EQ(chmap_snapshot_elem_count(snap1), 3);
+
+  // Modify, delete and insert after the snapshot
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 10), chm_success);
+  REQUIRE_EQ(delete_int_from_string(chmap, "key2"), chm_success);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key4", 4), chm_success);
+
+  chashmap_snapshot* snap2 = chmap_snapshot(chmap);
+  REQUIRE_NE((void*)snap2, NULL);
+  REQUIRE_EQ(chmap_snapshot_elem_count(snap2), 3);
+
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 100), chm_success);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key2", 20), chm_success);
+  REQUIRE_EQ(delete_int_from_string(chmap, "key4"), chm_success);
+
+  int val = -1;
+  REQUIRE_EQ(get_int_from_snapshot(snap1, "key1", &val), chm_success);
+  REQUIRE_EQ(val, 1);
+  REQUIRE_EQ(get_int_from_snapshot(snap1, "key2", &val), chm_success);
+  REQUIRE_EQ(val, 2);
+  REQUIRE_EQ(get_int_from_snapshot(snap1, "key4", &val), chm_key_not_found);
+
+  REQUIRE_EQ(get_int_from_snapshot(snap2, "key1", &val), chm_success);
+  REQUIRE_EQ(val, 10);
+  REQUIRE_EQ(get_int_from_snapshot(snap2, "key2", &val), chm_key_not_found);
+  REQUIRE_EQ(get_int_from_snapshot(snap2, "key4", &val), chm_success);
+  REQUIRE_EQ(val, 4);
+
+  int sum = 0;
+  chmap_snapshot_for_each_elem(snap1, add_snapshot_elem_to_sum, &sum);
+  REQUIRE_EQ(sum, 1 + 2 + 3);
+  sum = 0;
+  chmap_snapshot_for_each_elem(snap2, add_snapshot_elem_to_sum, &sum);
+  REQUIRE_EQ(sum, 10 + 3 + 4);
+
+  chmap_snapshot_release(snap1);
+  REQUIRE_EQ((void*)snap1, NULL);
+
+  // The second snapshot survives a reset of the map
+  REQUIRE_EQ(chmap_reset(chmap, 0), chm_success);
+  REQUIRE_EQ(chmap_elem_count(chmap), 0);
+  sum = 0;
+  chmap_snapshot_for_each_elem(snap2, add_snapshot_elem_to_sum, &sum);
+  REQUIRE_EQ(sum, 10 + 3 + 4);
+
+  chmap_snapshot_release(snap2);
+
+  // The live map is intact
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 5), chm_success);
+  REQUIRE_EQ(get_int_from_string(chmap, "key1", &val), chm_success);
+  REQUIRE_EQ(val, 5);
+
+  // An unreleased snapshot gets cleaned up along with the map
+  REQUIRE_NE((void*)chmap_snapshot(chmap), NULL);
+  REQUIRE_EQ(insert_string_to_int(chmap, "key1", 6), chm_success);
+
+  chmap_destroy(chmap);
+}
+
+typedef struct published_test_args {
+  chmap_published* pub;
+  volatile int stop;
+  int inconsistent_reads;
+  int last_seen;
+} published_test_args;
+
+void* published_reader(void* arg) {
+  published_test_args* args = (published_test_args*)arg;
+  chmap_pub_reader* reader = chmap_pub_register_reader(args->pub);
+
+  while (!args->stop) {
+    chashmap* chmap = chmap_pub_read_lock(reader);
+    int version = -1;
+    int other = -2;
+    get_int_from_string(chmap, "version", &version);
+    get_int_from_string(chmap, "other", &other);
+    if (version != other || version < args->last_seen) {
+      ++args->inconsistent_reads;
+    }
+    args->last_seen = version;
+    chmap_pub_read_unlock(reader);
+  }
+
+  chmap_pub_unregister_reader(reader);
+
+  return NULL;
+}
+
+chashmap* create_published_test_map(int version) {
+  chashmap* chmap = chmap_create(1, NULL);
+  insert_string_to_int(chmap, "version", version);
+  insert_string_to_int(chmap, "other", version);
+  return chmap;
+}
+
+TEST(chash_maps, published_map) {
+  char* err = NULL;
+  REQUIRE_EQ((void*)chmap_pub_create(NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  chmap_published* pub = chmap_pub_create(create_published_test_map(0), &err);
+  REQUIRE_NE((void*)pub, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+
+  published_test_args args[2] = {{.pub = pub}, {.pub = pub}};
+  pthread_t readers[2];
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE_EQ(pthread_create(&readers[i], NULL, published_reader, &args[i]),
+               0);
+  }
+
+  for (int version = 1; version <= 100; ++version) {
+    REQUIRE_EQ(chmap_pub_publish(pub, create_published_test_map(version)),
+               chm_success);
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    args[i].stop = 1;
+    pthread_join(readers[i], NULL);
+    REQUIRE_EQ(args[i].inconsistent_reads, 0);
+  }
+
+  chmap_pub_reader* reader = chmap_pub_register_reader(pub);
+  int version = -1;
+  REQUIRE_EQ(get_int_from_string(chmap_pub_read_lock(reader), "version",
+                                 &version),
+             chm_success);
+  REQUIRE_EQ(version, 100);
+  chmap_pub_read_unlock(reader);
+
+  chmap_pub_destroy(pub);
+  REQUIRE_EQ((void*)pub, NULL);
+}
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+TEST(chash_maps, save_and_load) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  char val[64];
+  memset(val, 'v', sizeof(val));
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = i % sizeof(val) + 1};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  REQUIRE_EQ(insert_string_to_int(chmap, "a rather long string key", 42),
+             chm_success);
+
+  REQUIRE_EQ(chmap_save(NULL, 0), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_save(chmap, -1), chm_invalid_arguments);
+
+  FILE* file = tmpfile();
+  REQUIRE_NE((void*)file, NULL);
+  int fd = fileno(file);
+  REQUIRE_EQ(chmap_save(chmap, fd), chm_success);
+  off_t file_size = lseek(fd, 0, SEEK_CUR);
+
+  char* err = NULL;
+  REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+  chashmap* loaded = chmap_load(fd, NULL, &err);
+  REQUIRE_NE((void*)loaded, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+  REQUIRE_EQ(chmap_elem_count(loaded), chmap_elem_count(chmap));
+
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair* val_pair = NULL;
+    REQUIRE_EQ(chmap_get_elem_ref(loaded, &key_pair, &val_pair), chm_success);
+    REQUIRE_EQ(val_pair->size, i % sizeof(val) + 1);
+    REQUIRE_EQ(memcmp(val_pair->ptr, val, val_pair->size), 0);
+  }
+  int int_val = 0;
+  REQUIRE_EQ(get_int_from_string(loaded, "a rather long string key", &int_val),
+             chm_success);
+  REQUIRE_EQ(int_val, 42);
+  chmap_destroy(loaded);
+
+  // Flip a byte of a value, the checksum should catch it
+  char byte = 0;
+  REQUIRE_EQ(pread(fd, &byte, 1, file_size / 2), 1);
+  byte ^= 0x5a;
+  REQUIRE_EQ(pwrite(fd, &byte, 1, file_size / 2), 1);
+  REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+  REQUIRE_EQ((void*)chmap_load(fd, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  // The element count of the header sizes the bucket array, an absurd one
+  // should be refused before anything gets allocated for it
+  byte ^= 0x5a;
+  REQUIRE_EQ(pwrite(fd, &byte, 1, file_size / 2), 1);
+  uint64_t elem_count = 0;
+  uint64_t huge_count = UINT32_MAX;
+  REQUIRE_EQ(pread(fd, &elem_count, sizeof(elem_count), 16), 8);
+  REQUIRE_EQ(pwrite(fd, &huge_count, sizeof(huge_count), 16), 8);
+  REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+  REQUIRE_EQ((void*)chmap_load(fd, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+  REQUIRE_EQ(pwrite(fd, &elem_count, sizeof(elem_count), 16), 8);
+
+  // A truncated stream should fail as well
+  REQUIRE_EQ(ftruncate(fd, file_size - 1), 0);
+  REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+  REQUIRE_EQ((void*)chmap_load(fd, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  fclose(file);
+  chmap_destroy(chmap);
+
+  // A pipe has no size to check the element count against, the map gets
+  // presized for a part of it and grows for the rest
+  chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+  for (int i = 0; i < 100000; ++i) {
+    REQUIRE_EQ(
+        chmap_insert_elem(chmap, &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                          &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+        chm_success);
+  }
+  int pipe_fds[2];
+  REQUIRE_EQ(pipe(pipe_fds), 0);
+  pid_t pid = fork();
+  REQUIRE_GE(pid, 0);
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    _exit(chmap_save(chmap, pipe_fds[1]) == chm_success ? 0 : 1);
+  }
+  close(pipe_fds[1]);
+  loaded = chmap_load(pipe_fds[0], NULL, &err);
+  close(pipe_fds[0]);
+  int status = 0;
+  REQUIRE_EQ(waitpid(pid, &status, 0), pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE_EQ(WEXITSTATUS(status), 0);
+  REQUIRE_NE((void*)loaded, NULL);
+  REQUIRE_EQ(chmap_elem_count(loaded), 100000);
+  for (int i = 0; i < 100000; i += 997) {
+    int loaded_val = -1;
+    REQUIRE_EQ(chmap_get_elem_copy(loaded,
+                                   &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                   &loaded_val, sizeof(loaded_val)),
+               chm_success);
+    REQUIRE_EQ(loaded_val, i);
+  }
+  chmap_destroy(loaded);
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, freeze_to_file_and_open_read_only) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  for (int i = 0; i < 1000; ++i) {
+    long val = i * 3L;
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  REQUIRE_EQ(insert_string_to_int(chmap, "a rather long string key", 42),
+             chm_success);
+
+  char path[] = "/tmp/chashmap_ro_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE_GE(fd, 0);
+  close(fd);
+
+  REQUIRE_EQ(chmap_freeze_to_file(NULL, path), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_freeze_to_file(chmap, path), chm_success);
+
+  char* err = NULL;
+  REQUIRE_EQ((void*)chmap_ro_open("/nonexistent/chashmap", &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  chmap_ro* ro = chmap_ro_open(path, &err);
+  REQUIRE_NE((void*)ro, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+  REQUIRE_EQ(chmap_ro_elem_count(ro), 1001);
+
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {0};
+    REQUIRE_EQ(chmap_ro_get_elem_ref(ro, &key_pair, &val_pair), chm_success);
+    REQUIRE_EQ(val_pair.size, sizeof(long));
+    REQUIRE_EQ(*(long*)val_pair.ptr, i * 3L);
+  }
+
+  int missing = 1000;
+  chmap_pair key_pair = {.ptr = &missing, .size = sizeof(missing)};
+  chmap_pair val_pair = {0};
+  REQUIRE_EQ(chmap_ro_get_elem_ref(ro, &key_pair, &val_pair),
+             chm_key_not_found);
+
+  const char* str_key = "a rather long string key";
+  int int_val = 0;
+  REQUIRE_EQ(chmap_ro_get_elem_copy(
+                 ro, &(chmap_pair){.ptr = (void*)str_key, .size = strlen(str_key)},
+                 &int_val, sizeof(int_val)),
+             chm_success);
+  REQUIRE_EQ(int_val, 42);
+
+  chmap_ro_close(ro);
+  REQUIRE_EQ((void*)ro, NULL);
+
+  // The file got renamed into place
+  char tmp_path[sizeof(path) + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  REQUIRE_NE(access(tmp_path, F_OK), 0);
+
+  // A corrupted file without any empty slots should not make a lookup spin,
+  // the slots follow the 40 byte header and their entry offsets are at 8
+  fd = open(path, O_RDWR);
+  REQUIRE_GE(fd, 0);
+  uint32_t slot_count = 0;
+  REQUIRE_EQ(pread(fd, &slot_count, sizeof(slot_count), 12),
+             (ssize_t)sizeof(slot_count));
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    uint64_t entry_offset = 0;
+    off_t pos = 40 + (off_t)i * 24 + 8;
+    REQUIRE_EQ(pread(fd, &entry_offset, sizeof(entry_offset), pos),
+               (ssize_t)sizeof(entry_offset));
+    if (entry_offset == 0) {
+      entry_offset = 1;
+      REQUIRE_EQ(pwrite(fd, &entry_offset, sizeof(entry_offset), pos),
+                 (ssize_t)sizeof(entry_offset));
+    }
+  }
+  close(fd);
+  ro = chmap_ro_open(path, &err);
+  REQUIRE_NE((void*)ro, NULL);
+  REQUIRE_EQ(chmap_ro_get_elem_ref(ro, &key_pair, &val_pair),
+             chm_key_not_found);
+  chmap_ro_close(ro);
+
+  // A truncated file should be rejected when it gets opened
+  REQUIRE_EQ(truncate(path, 100), 0);
+  REQUIRE_EQ((void*)chmap_ro_open(path, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  unlink(path);
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, frozen_map) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  char* err = NULL;
+  chmap_frozen* frozen = chmap_freeze(chmap, &err);
+  REQUIRE_NE((void*)frozen, NULL);
+  REQUIRE_EQ(chmap_frozen_elem_count(frozen), 0);
+  int missing = 0;
+  int int_val = 0;
+  REQUIRE_EQ(chmap_frozen_get_elem_copy(
+                 frozen, &(chmap_pair){.ptr = &missing, .size = sizeof(int)},
+                 &int_val, sizeof(int_val)),
+             chm_key_not_found);
+  chmap_frozen_destroy(frozen);
+  REQUIRE_EQ((void*)frozen, NULL);
+
+  for (int i = 0; i < 10000; ++i) {
+    long val = i * 7L;
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  REQUIRE_EQ(insert_string_to_int(chmap, "a rather long string key", 42),
+             chm_success);
+
+  frozen = chmap_freeze(chmap, &err);
+  REQUIRE_NE((void*)frozen, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+  chmap_destroy(chmap);
+
+  REQUIRE_EQ(chmap_frozen_elem_count(frozen), 10001);
+  for (int i = 0; i < 10000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {0};
+    REQUIRE_EQ(chmap_frozen_get_elem_ref(frozen, &key_pair, &val_pair),
+               chm_success);
+    REQUIRE_EQ(val_pair.size, sizeof(long));
+    REQUIRE_EQ(*(long*)val_pair.ptr, i * 7L);
+  }
+
+  const char* str_key = "a rather long string key";
+  REQUIRE_EQ(chmap_frozen_get_elem_copy(
+                 frozen,
+                 &(chmap_pair){.ptr = (void*)str_key, .size = strlen(str_key)},
+                 &int_val, sizeof(int_val)),
+             chm_success);
+  REQUIRE_EQ(int_val, 42);
+
+  // The keys that were never inserted should not be found
+  for (int i = 10000; i < 11000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {0};
+    REQUIRE_EQ(chmap_frozen_get_elem_ref(frozen, &key_pair, &val_pair),
+               chm_key_not_found);
+  }
+
+  chmap_frozen_stats stats;
+  REQUIRE_EQ(chmap_frozen_get_stats(frozen, &stats), chm_success);
+  REQUIRE_EQ(stats.elem_count, 10001);
+  REQUIRE_LT(stats.frozen_bytes, stats.source_bytes);
+  REQUIRE_LT(stats.frozen_bytes_per_entry, stats.source_bytes_per_entry);
+
+  chmap_frozen_destroy(frozen);
+}
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+TEST(chash_maps, shared_memory_map) {
+  size_t region_size = 1 << 20;
+  void* region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  REQUIRE_NE(region, MAP_FAILED);
+
+  char* err = NULL;
+  REQUIRE_EQ((void*)chmap_shm_attach(region, region_size, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  chmap_shm* shm = chmap_shm_create(region, region_size, 1, &err);
+  REQUIRE_NE((void*)shm, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+
+  // The child inserts through its own mapping of the region
+  pid_t pid = fork();
+  REQUIRE_GE(pid, 0);
+  if (pid == 0) {
+    chmap_shm* child_shm = chmap_shm_attach(region, region_size, NULL);
+    int failures = child_shm ? 0 : 1;
+    for (int i = 0; i < 1000 && child_shm; ++i) {
+      long val = i * 5L;
+      if (chmap_shm_insert_elem(
+              child_shm, &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+              &(chmap_pair){.ptr = &val, .size = sizeof(val)}) !=
+          chm_success) {
+        ++failures;
+      }
+    }
+    chmap_shm_detach(child_shm);
+    _exit(failures);
+  }
+
+  int status = 0;
+  REQUIRE_EQ(waitpid(pid, &status, 0), pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE_EQ(WEXITSTATUS(status), 0);
+
+  REQUIRE_EQ(chmap_shm_elem_count(shm), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    long val = -1;
+    REQUIRE_EQ(chmap_shm_get_elem_copy(
+                   shm, &(chmap_pair){.ptr = &i, .size = sizeof(i)}, &val,
+                   sizeof(val)),
+               chm_success);
+    REQUIRE_EQ(val, i * 5L);
+  }
+
+  // Replacing with a different size, and deleting
+  int key = 7;
+  const char* long_val = "a value longer than a long";
+  REQUIRE_EQ(chmap_shm_insert_elem(
+                 shm, &(chmap_pair){.ptr = &key, .size = sizeof(key)},
+                 &(chmap_pair){.ptr = (void*)long_val,
+                               .size = strlen(long_val) + 1}),
+             chm_success);
+  char buf[64];
+  REQUIRE_EQ(chmap_shm_get_elem_copy(
+                 shm, &(chmap_pair){.ptr = &key, .size = sizeof(key)}, buf,
+                 sizeof(buf)),
+             chm_success);
+  REQUIRE_EQ(strcmp(buf, long_val), 0);
+  REQUIRE_EQ(chmap_shm_delete_elem(
+                 shm, &(chmap_pair){.ptr = &key, .size = sizeof(key)}),
+             chm_success);
+  REQUIRE_EQ(chmap_shm_delete_elem(
+                 shm, &(chmap_pair){.ptr = &key, .size = sizeof(key)}),
+             chm_key_not_found);
+  REQUIRE_EQ(chmap_shm_elem_count(shm), 999);
+
+  // The region fills up eventually
+  chashmap_retval_t result = chm_success;
+  for (int i = 1000; result == chm_success; ++i) {
+    result = chmap_shm_insert_elem(
+        shm, &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+        &(chmap_pair){.ptr = buf, .size = sizeof(buf)});
+  }
+  REQUIRE_EQ(result, chm_not_enough_memory);
+  // Apart from the last bucket array the region is left to the node blocks,
+  // the arrays released on growth are carved up for them
+  REQUIRE_GT(chmap_shm_elem_count(shm), 8000);
+
+  chmap_shm_detach(shm);
+  REQUIRE_EQ((void*)shm, NULL);
+  munmap(region, region_size);
+}
+
+TEST(chash_maps, write_ahead_log) {
+  char dir[] = "/tmp/chashmap_wal_XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(dir), NULL);
+  char log_path[64];
+  char snapshot_path[64];
+  snprintf(log_path, sizeof(log_path), "%s/log", dir);
+  snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot", dir);
+
+  char* err = NULL;
+  chashmap* chmap = chmap_wal_recover(snapshot_path, log_path, NULL, &err);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ(chmap_elem_count(chmap), 0);
+
+  chmap_wal_options options = {.commit_interval_us = 100};
+  chmap_wal* wal = chmap_wal_open(chmap, log_path, &options, &err);
+  REQUIRE_NE((void*)wal, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+
+  for (int i = 0; i < 1000; ++i) {
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+               chm_success);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    REQUIRE_EQ(
+        chmap_delete_elem(chmap, &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+        chm_success);
+  }
+  REQUIRE_EQ(chmap_wal_sync(wal), chm_success);
+  REQUIRE_EQ(chmap_wal_checkpoint(wal, snapshot_path), chm_success);
+
+  // These only live in the log
+  REQUIRE_EQ(insert_string_to_int(chmap, "after the checkpoint", 7),
+             chm_success);
+  int deleted = 1;
+  REQUIRE_EQ(chmap_delete_elem(
+                 chmap, &(chmap_pair){.ptr = &deleted, .size = sizeof(int)}),
+             chm_success);
+  chmap_wal_close(wal);
+  REQUIRE_EQ((void*)wal, NULL);
+  chmap_destroy(chmap);
+
+  // A torn record at the end of the log should be dropped
+  FILE* log = fopen(log_path, "ab");
+  REQUIRE_NE((void*)log, NULL);
+  fwrite("torn", 1, 4, log);
+  fclose(log);
+
+  chmap = chmap_wal_recover(snapshot_path, log_path, NULL, &err);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ((void*)err, NULL);
+  REQUIRE_EQ(chmap_elem_count(chmap), 500);
+  for (int i = 0; i < 1000; ++i) {
+    int val = -1;
+    chashmap_retval_t expected =
+        (i % 2 == 0 || i == deleted) ? chm_key_not_found : chm_success;
+    REQUIRE_EQ(chmap_get_elem_copy(chmap,
+                                   &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                   &val, sizeof(val)),
+               expected);
+  }
+  int val = 0;
+  REQUIRE_EQ(get_int_from_string(chmap, "after the checkpoint", &val),
+             chm_success);
+  REQUIRE_EQ(val, 7);
+
+  // Logging resumes after the dropped tail, destroying the map closes it
+  wal = chmap_wal_open(chmap, log_path, NULL, &err);
+  REQUIRE_NE((void*)wal, NULL);
+  REQUIRE_EQ(chmap_reset(chmap, 0), chm_success);
+  REQUIRE_EQ(insert_string_to_int(chmap, "after the reset", 8), chm_success);
+  chmap_destroy(chmap);
+
+  chmap = chmap_wal_recover(snapshot_path, log_path, NULL, &err);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ(chmap_elem_count(chmap), 1);
+  REQUIRE_EQ(get_int_from_string(chmap, "after the reset", &val), chm_success);
+  REQUIRE_EQ(val, 8);
+  chmap_destroy(chmap);
+
+  unlink(log_path);
+  unlink(snapshot_path);
+  rmdir(dir);
+}
+
+#include <sched.h>
+
+typedef struct async_snapshot_test_args {
+  int done;
+  chashmap_retval_t result;
+} async_snapshot_test_args;
+
+void async_snapshot_done(chashmap_retval_t result, void* args) {
+  async_snapshot_test_args* test_args = (async_snapshot_test_args*)args;
+  test_args->result = result;
+  __atomic_store_n(&test_args->done, 1, __ATOMIC_RELEASE);
+}
+
+TEST(chash_maps, async_snapshot) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  for (int i = 0; i < 20000; ++i) {
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+               chm_success);
+  }
+  uint32_t bucket_arr_size = chmap_get_bucket_arr_size(chmap);
+
+  char path[] = "/tmp/chashmap_async_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE_GE(fd, 0);
+  close(fd);
+
+  async_snapshot_test_args args = {0};
+  REQUIRE_EQ(chmap_snapshot_async(chmap, path, async_snapshot_done, &args),
+             chm_success);
+  REQUIRE_EQ(chmap_snapshot_async(chmap, path, NULL, NULL),
+             chm_invalid_arguments);
+
+  // Keep modifying the map while the snapshot is being written
+  for (int i = 0; i < 20000; i += 2) {
+    int val = -i;
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &val, .size = sizeof(val)}),
+               chm_success);
+  }
+  for (int i = 1; i < 20000; i += 4) {
+    REQUIRE_EQ(
+        chmap_delete_elem(chmap, &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+        chm_success);
+  }
+  for (int i = 20000; i < 60000; ++i) {
+    REQUIRE_EQ(chmap_insert_elem(chmap,
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                 &(chmap_pair){.ptr = &i, .size = sizeof(i)}),
+               chm_success);
+  }
+
+  while (!__atomic_load_n(&args.done, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  REQUIRE_EQ(args.result, chm_success);
+
+  // The map scales again once the snapshot is done
+  int key = 60000;
+  REQUIRE_EQ(chmap_insert_elem(chmap,
+                               &(chmap_pair){.ptr = &key, .size = sizeof(key)},
+                               &(chmap_pair){.ptr = &key, .size = sizeof(key)}),
+             chm_success);
+  REQUIRE_GT(chmap_get_bucket_arr_size(chmap), bucket_arr_size);
+
+  fd = open(path, O_RDONLY);
+  REQUIRE_GE(fd, 0);
+  char* err = NULL;
+  chashmap* loaded = chmap_load(fd, NULL, &err);
+  close(fd);
+  REQUIRE_NE((void*)loaded, NULL);
+  REQUIRE_EQ(chmap_elem_count(loaded), 20000);
+  for (int i = 0; i < 20000; ++i) {
+    int val = -1;
+    REQUIRE_EQ(chmap_get_elem_copy(loaded,
+                                   &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                                   &val, sizeof(val)),
+               chm_success);
+    REQUIRE_EQ(val, i);
+  }
+
+  chmap_destroy(loaded);
+  chmap_destroy(chmap);
+  unlink(path);
+}
+
+TEST(chash_maps, load_parallel) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  // Big enough values to spread the records over several chunks
+  int val[16];
+  memset(val, 0, sizeof(val));
+  int expected_sum = 0;
+  for (int i = 0; i < 50000; ++i) {
+    val[0] = i;
+    expected_sum += i;
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+
+  char path[] = "/tmp/chashmap_load_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE_GE(fd, 0);
+  REQUIRE_EQ(chmap_save(chmap, fd), chm_success);
+  off_t file_size = lseek(fd, 0, SEEK_CUR);
+  REQUIRE_GT(file_size, 4 * 1024 * 1024);
+
+  char* err = NULL;
+  REQUIRE_EQ((void*)chmap_load_parallel(path, 0, NULL, &err), NULL);
+  REQUIRE_EQ((void*)chmap_load_parallel(NULL, 4, NULL, &err), NULL);
+
+  for (uint32_t thread_count = 1; thread_count <= 8; thread_count *= 2) {
+    chashmap* loaded = chmap_load_parallel(path, thread_count, NULL, &err);
+    REQUIRE_NE((void*)loaded, NULL);
+    REQUIRE_EQ((void*)err, NULL);
+    REQUIRE_EQ(chmap_elem_count(loaded), 50000);
+
+    for (int i = 0; i < 50000; ++i) {
+      int loaded_val[16];
+      REQUIRE_EQ(chmap_get_elem_copy(
+                     loaded, &(chmap_pair){.ptr = &i, .size = sizeof(i)},
+                     loaded_val, sizeof(loaded_val)),
+                 chm_success);
+      REQUIRE_EQ(loaded_val[0], i);
+    }
+
+    // All the per-thread lists should have been spliced together
+    int sum = 0;
+    chmap_for_each_elem(loaded, add_elem_to_sum, (void*)&sum);
+    REQUIRE_EQ(sum, expected_sum);
+
+    chmap_destroy(loaded);
+  }
+
+  // Flip a byte in the middle, the chunk checksum should catch it
+  char byte = 0;
+  REQUIRE_EQ(pread(fd, &byte, 1, file_size / 2), 1);
+  byte ^= 0x5a;
+  REQUIRE_EQ(pwrite(fd, &byte, 1, file_size / 2), 1);
+  REQUIRE_EQ((void*)chmap_load_parallel(path, 4, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  // So should an element count the file can't hold
+  byte ^= 0x5a;
+  REQUIRE_EQ(pwrite(fd, &byte, 1, file_size / 2), 1);
+  uint64_t elem_count = 0;
+  uint64_t huge_count = UINT32_MAX;
+  REQUIRE_EQ(pread(fd, &elem_count, sizeof(elem_count), 16), 8);
+  REQUIRE_EQ(pwrite(fd, &huge_count, sizeof(huge_count), 16), 8);
+  REQUIRE_EQ((void*)chmap_load_parallel(path, 4, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+  REQUIRE_EQ(pwrite(fd, &elem_count, sizeof(elem_count), 16), 8);
+
+  // A truncated file should fail as well
+  REQUIRE_EQ(ftruncate(fd, file_size - 1), 0);
+  REQUIRE_EQ((void*)chmap_load_parallel(path, 4, NULL, &err), NULL);
+  REQUIRE_NE((void*)err, NULL);
+
+  close(fd);
+  unlink(path);
+  chmap_destroy(chmap);
+}
+
+void check_val_of_key(const chmap_pair* key_pair, chmap_pair* val_pair,
+                      void* args) {
+  int key = *(int*)key_pair->ptr;
+  uint32_t expected_size = key % 2 == 0 ? 1000 : 16;
+  if (val_pair->size != expected_size ||
+      ((unsigned char*)val_pair->ptr)[val_pair->size - 1] !=
+          (unsigned char)key) {
+    ++*(int*)args;
+  }
+}
+
+TEST(chash_maps, value_log) {
+  chashmap* chmap = chmap_create(1, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  chmap_vlog_options options = {.spill_threshold = 256,
+                                .segment_size = 64 * 1024,
+                                .gc_garbage_percent = 50};
+  REQUIRE_EQ(chmap_enable_value_log(NULL, "/tmp", &options),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_enable_value_log(chmap, "/nonexistent/dir", &options),
+             chm_io_error);
+  REQUIRE_EQ(chmap_enable_value_log(chmap, "/tmp", &options), chm_success);
+  REQUIRE_EQ(chmap_enable_value_log(chmap, "/tmp", &options),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_enable_optimistic_reads(chmap), chm_invalid_arguments);
+
+  // The even keys get large values, which get spilled
+  unsigned char val[1000];
+  for (int i = 0; i < 1000; ++i) {
+    memset(val, i, sizeof(val));
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = i % 2 == 0 ? 1000 : 16};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+
+  chmap_vlog_stats stats;
+  REQUIRE_EQ(chmap_get_value_log_stats(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.live_values, 500);
+  REQUIRE_EQ(stats.live_bytes, 500 * 1000);
+  REQUIRE_GT(stats.segment_count, 1);
+
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    memset(val, 0xff, sizeof(val));
+    REQUIRE_EQ(chmap_get_elem_copy(chmap, &key_pair, val, sizeof(val)),
+               chm_success);
+    REQUIRE_EQ(val[i % 2 == 0 ? 999 : 15], (unsigned char)i);
+    chmap_pair* val_ref = NULL;
+    REQUIRE_EQ(chmap_get_elem_ref(chmap, &key_pair, &val_ref),
+               i % 2 == 0 ? chm_value_spilled : chm_success);
+  }
+
+  int mismatches = 0;
+  chmap_for_each_elem(chmap, check_val_of_key, &mismatches);
+  REQUIRE_EQ(mismatches, 0);
+
+  // Leave most of the early segments as garbage: delete some of the large
+  // values, and move the rest to the end of the log
+  for (int i = 0; i < 1000; i += 2) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    if (i % 4 == 0) {
+      REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_success);
+    } else if (i < 500) {
+      memset(val, i, sizeof(val));
+      chmap_pair val_pair = {.ptr = val, .size = 1000};
+      REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+    }
+  }
+
+  // The collector runs in the background
+  for (int i = 0; i < 5000; ++i) {
+    REQUIRE_EQ(chmap_get_value_log_stats(chmap, &stats), chm_success);
+    if (stats.collected_segments > 0) {
+      break;
+    }
+    usleep(1000);
+  }
+  REQUIRE_GT(stats.collected_segments, 0);
+  REQUIRE_EQ(stats.live_values, 250);
+
+  mismatches = 0;
+  chmap_for_each_elem(chmap, check_val_of_key, &mismatches);
+  REQUIRE_EQ(mismatches, 0);
+  REQUIRE_EQ(chmap_elem_count(chmap), 750);
+
+  // A spilled value becoming a small one and the other way around
+  int key = 2;
+  chmap_pair key_pair = {.ptr = &key, .size = sizeof(key)};
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = 8}),
+             chm_success);
+  chmap_pair* val_ref = NULL;
+  REQUIRE_EQ(chmap_get_elem_ref(chmap, &key_pair, &val_ref), chm_success);
+  memset(val, 2, sizeof(val));
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = 1000}),
+             chm_success);
+  REQUIRE_EQ(chmap_get_elem_ref(chmap, &key_pair, &val_ref),
+             chm_value_spilled);
+
+  // A spilled entry replaced while a snapshot can see it
+  chashmap_snapshot* snap = chmap_snapshot(chmap);
+  REQUIRE_NE((void*)snap, NULL);
+  memset(val, 7, sizeof(val));
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = 1000}),
+             chm_success);
+  REQUIRE_EQ(chmap_get_elem_ref(chmap, &key_pair, &val_ref),
+             chm_value_spilled);
+  REQUIRE_EQ(chmap_snapshot_get_elem_copy(snap, &key_pair, val, sizeof(val)),
+             chm_success);
+  REQUIRE_EQ(val[999], 2);
+  REQUIRE_EQ(chmap_get_elem_copy(chmap, &key_pair, val, sizeof(val)),
+             chm_success);
+  REQUIRE_EQ(val[999], 7);
+  chmap_snapshot_release(snap);
+  memset(val, 2, sizeof(val));
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = 1000}),
+             chm_success);
+
+  // The saved snapshot holds the values themselves
+  FILE* file = tmpfile();
+  REQUIRE_NE((void*)file, NULL);
+  int fd = fileno(file);
+  REQUIRE_EQ(chmap_save(chmap, fd), chm_success);
+  REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+  char* err = NULL;
+  chashmap* loaded = chmap_load(fd, NULL, &err);
+  REQUIRE_NE((void*)loaded, NULL);
+  fclose(file);
+
+  mismatches = 0;
+  chmap_for_each_elem(loaded, check_val_of_key, &mismatches);
+  REQUIRE_EQ(mismatches, 0);
+  REQUIRE_EQ(chmap_elem_count(loaded), 750);
+
+  chmap_destroy(loaded);
+  chmap_destroy(chmap);
+}
+
+int evict_everything(const chmap_pair* key_pair, const chmap_pair* val_pair,
+                     void* args) {
+  (void)key_pair;
+  (void)val_pair;
+  ++*(int*)args;
+  return 1;
+}
+
+TEST(chash_maps, memory_limit) {
+  chashmap* chmap = chmap_create(1024, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ(chmap_set_memory_limit(NULL, 1, NULL, NULL),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_set_memory_limit(chmap, 64 * 1024, NULL, NULL),
+             chm_success);
+
+  // Without a callback, the inserts fail once the limit is reached
+  unsigned char val[64] = {0};
+  int inserted = 0;
+  for (; inserted < 10000; ++inserted) {
+    chmap_pair key_pair = {.ptr = &inserted, .size = sizeof(inserted)};
+    chmap_pair val_pair = {.ptr = val, .size = sizeof(val)};
+    if (chmap_insert_elem(chmap, &key_pair, &val_pair) != chm_success) {
+      break;
+    }
+  }
+  REQUIRE_GT(inserted, 100);
+  REQUIRE_LT(inserted, 10000);
+  REQUIRE_EQ(chmap_elem_count(chmap), (uint32_t)inserted);
+
+  // Overwriting a value with one of the same size needs no room
+  int key = 0;
+  chmap_pair key_pair = {.ptr = &key, .size = sizeof(key)};
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = sizeof(val)}),
+             chm_success);
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = 1024}),
+             chm_not_enough_memory);
+
+  // Deleting makes room again
+  REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_success);
+  key = inserted;
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = sizeof(val)}),
+             chm_success);
+
+  // With a callback, the old entries make room for the new ones
+  int evicted = 0;
+  REQUIRE_EQ(chmap_set_memory_limit(chmap, 64 * 1024, evict_everything,
+                                    &evicted),
+             chm_success);
+  for (int i = 100000; i < 110000; ++i) {
+    chmap_pair new_key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &new_key_pair, &val_pair),
+               chm_success);
+    REQUIRE_EQ(chmap_get_elem_copy(chmap, &new_key_pair, val, sizeof(val)),
+               chm_success);
+  }
+  REQUIRE_GE(evicted, 10000);
+  REQUIRE_LE(chmap_elem_count(chmap), (uint32_t)inserted);
+
+  // The entries a snapshot can see would free nothing, so they are left alone
+  chmap_mem_stats stats;
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_EQ(chmap_set_memory_limit(chmap, stats.total_bytes + 10,
+                                    evict_everything, &evicted),
+             chm_success);
+  uint32_t elem_count = chmap_elem_count(chmap);
+  chashmap_snapshot* snap = chmap_snapshot(chmap);
+  REQUIRE_NE((void*)snap, NULL);
+  evicted = 0;
+  key = -1;
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = sizeof(val)}),
+             chm_not_enough_memory);
+  REQUIRE_EQ(evicted, 0);
+  REQUIRE_EQ(chmap_elem_count(chmap), elem_count);
+  chmap_snapshot_release(snap);
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair,
+                               &(chmap_pair){.ptr = val, .size = sizeof(val)}),
+             chm_success);
+  REQUIRE_GT(evicted, 0);
+
+  // Lifting the limit
+  REQUIRE_EQ(chmap_set_memory_limit(chmap, 0, NULL, NULL), chm_success);
+  for (int i = 0; i < 10000; ++i) {
+    chmap_pair new_key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &new_key_pair, &val_pair),
+               chm_success);
+  }
+
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, memory_limit_with_optimistic_reads) {
+  chashmap* chmap = chmap_create(1024, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+  REQUIRE_EQ(chmap_enable_optimistic_reads(chmap), chm_success);
+  int evicted = 0;
+  REQUIRE_EQ(chmap_set_memory_limit(chmap, 20 * 1024, evict_everything,
+                                    &evicted),
+             chm_success);
+
+  // The evicted entries only get retired, which should not count against
+  // the limit
+  unsigned char val[64] = {0};
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  REQUIRE_GT(evicted, 0);
+  REQUIRE_GT(chmap_elem_count(chmap), 1U);
+
+  chmap_mem_stats stats;
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_GT(stats.total_bytes, 20 * 1024U);
+  chmap_reclaim_retired(chmap);
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_LE(stats.total_bytes, 20 * 1024U);
+
+  chmap_destroy(chmap);
+}
+
+uint64_t counted_allocs = 0;
+uint64_t counted_reallocs = 0;
+uint64_t counted_frees = 0;
+
+void* counting_malloc(size_t size) {
+  ++counted_allocs;
+  return malloc(size);
+}
+
+void* counting_calloc(size_t elem_count, size_t elem_size) {
+  ++counted_allocs;
+  return calloc(elem_count, elem_size);
+}
+
+void* counting_realloc(void* ptr, size_t size) {
+  ++counted_reallocs;
+  return realloc(ptr, size);
+}
+
+void counting_free(void* ptr) {
+  ++counted_frees;
+  free(ptr);
+}
+
+TEST(chash_maps, memory_usage) {
+  chashmap* chmap = chmap_create_mp(
+      1,
+      &(chashmap_memmgmt_procs_t){.malloc = counting_malloc,
+                                  .free = counting_free,
+                                  .calloc = counting_calloc,
+                                  .realloc = counting_realloc},
+      NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+  // The map itself and its copy of the procs are not a part of the stats,
+  // only its bucket array is
+  uint64_t untracked_allocs = counted_allocs - 1;
+
+  chmap_mem_stats stats;
+  REQUIRE_EQ(chmap_memory_usage(NULL, &stats), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_memory_usage(chmap, NULL), chm_invalid_arguments);
+
+  long val = 0;
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+
+  // Some values grow, some get deleted
+  char big_val[100] = {0};
+  for (int i = 0; i < 1000; i += 2) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    if (i % 4 == 0) {
+      REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_success);
+    } else {
+      chmap_pair val_pair = {.ptr = big_val, .size = sizeof(big_val)};
+      REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+    }
+  }
+
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.key_bytes, 750 * sizeof(int));
+  REQUIRE_EQ(stats.val_bytes, 500 * sizeof(long) + 250 * sizeof(big_val));
+  REQUIRE_EQ(stats.node_bytes % 750, 0);
+  REQUIRE_GT(stats.node_bytes, 750 * 2 * sizeof(chmap_pair));
+  REQUIRE_GE(stats.bucket_bytes, 512 * sizeof(void*));
+  REQUIRE_EQ(stats.total_bytes, stats.bucket_bytes + stats.node_bytes +
+                                    stats.key_bytes + stats.val_bytes);
+  REQUIRE_EQ(stats.alloc_calls, counted_allocs - untracked_allocs);
+  REQUIRE_EQ(stats.realloc_calls, counted_reallocs);
+  REQUIRE_EQ(stats.free_calls, counted_frees);
+  REQUIRE_EQ(stats.alloc_calls - stats.free_calls, 750 * 5 + 1);
+
+  // The entries written while there is a snapshot carry their versions,
+  // which get accounted for along with them
+  chashmap_snapshot* snap = chmap_snapshot(chmap);
+  REQUIRE_NE((void*)snap, NULL);
+  for (int i = 1; i < 100; i += 2) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  for (int i = 1000; i < 1050; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_pair val_pair = {.ptr = &val, .size = sizeof(val)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &val_pair), chm_success);
+  }
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_GT(stats.node_bytes, 850 * 2 * sizeof(chmap_pair));
+  chmap_snapshot_release(snap);
+
+  REQUIRE_EQ(chmap_reset(chmap, 0), chm_success);
+  REQUIRE_EQ(chmap_memory_usage(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.node_bytes + stats.key_bytes + stats.val_bytes, 0);
+  REQUIRE_EQ(stats.total_bytes, stats.bucket_bytes);
+  REQUIRE_EQ(stats.alloc_calls - stats.free_calls, 1);
+
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, stats) {
+  chashmap* chmap = chmap_create(64, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  chmap_stats stats;
+  REQUIRE_EQ(chmap_get_stats(NULL, &stats), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_get_stats(chmap, NULL), chm_invalid_arguments);
+
+  REQUIRE_EQ(chmap_get_stats(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.bucket_count, 64);
+  REQUIRE_EQ(stats.chain_histogram[0], 64);
+  REQUIRE_EQ(stats.max_chain_len, 0);
+  REQUIRE_EQ(stats.empty_bucket_ratio, 1.0);
+
+  // The small integer keys are hashed to themselves, so the multiples of the
+  // bucket count all end up in the first bucket.
+  for (int i = 0; i < 20; ++i) {
+    int key = i * 64;
+    chmap_pair key_pair = {.ptr = &key, .size = sizeof(key)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  }
+
+  REQUIRE_EQ(chmap_get_stats(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.elem_count, 20);
+  REQUIRE_EQ(stats.max_chain_len, 20);
+  REQUIRE_EQ(stats.chain_histogram[0], 63);
+  REQUIRE_EQ(stats.chain_histogram[CHMAP_CHAIN_HISTOGRAM_LEN - 1], 1);
+  REQUIRE_EQ(stats.mean_chain_len, 20.0);
+  REQUIRE_EQ(stats.scale_up_count, 0);
+
+  for (int i = 0; i < 10000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  }
+  for (int i = 0; i < 10000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_delete_elem(chmap, &key_pair);
+  }
+
+  REQUIRE_EQ(chmap_get_stats(chmap, &stats), chm_success);
+  REQUIRE_GT(stats.scale_up_count, 0);
+  REQUIRE_GT(stats.scale_down_count, 0);
+  REQUIRE_GT(stats.scale_nsec, 0);
+  uint64_t bucket_total = 0;
+  for (uint32_t i = 0; i < CHMAP_CHAIN_HISTOGRAM_LEN; ++i) {
+    bucket_total += stats.chain_histogram[i];
+  }
+  REQUIRE_EQ(bucket_total, stats.bucket_count);
+
+#ifdef CHMAP_PROBE_STATS
+  int val = 0;
+  int key = 5;
+  chmap_pair key_pair = {.ptr = &key, .size = sizeof(key)};
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  REQUIRE_EQ(chmap_get_elem_copy(chmap, &key_pair, &val, sizeof(val)),
+             chm_success);
+  key = 7;
+  REQUIRE_EQ(chmap_get_elem_copy(chmap, &key_pair, &val, sizeof(val)),
+             chm_key_not_found);
+  REQUIRE_EQ(chmap_get_stats(chmap, &stats), chm_success);
+  REQUIRE_EQ(stats.hit_lookups, 1);
+  REQUIRE_EQ(stats.miss_lookups, 1);
+  REQUIRE_GE(stats.compares_per_hit, 1.0);
+#endif
+
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, latency_histograms) {
+  chashmap* chmap = chmap_create(64, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  chmap_latency_stats stats;
+  REQUIRE_EQ(chmap_get_latency_stats(NULL, chmap_latency_get, &stats),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_get_latency_stats(chmap, chmap_latency_op_count, &stats),
+             chm_invalid_arguments);
+  REQUIRE_EQ(chmap_get_latency_stats(chmap, chmap_latency_get, NULL),
+             chm_invalid_arguments);
+
+  for (int i = 0; i < 1000; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  }
+  for (int i = 0; i < 2000; ++i) {
+    int val = 0;
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    chmap_get_elem_copy(chmap, &key_pair, &val, sizeof(val));
+  }
+  for (int i = 0; i < 500; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_success);
+  }
+
+#ifdef CHMAP_INSTRUMENT
+  uint64_t expected_counts[] = {1000, 2000, 500};
+  for (uint32_t op = chmap_latency_insert; op <= chmap_latency_delete; ++op) {
+    REQUIRE_EQ(chmap_get_latency_stats(chmap, op, &stats), chm_success);
+    REQUIRE_EQ(stats.count, expected_counts[op]);
+    REQUIRE_LE(stats.p50_nsec, stats.p99_nsec);
+    REQUIRE_LE(stats.p99_nsec, stats.p999_nsec);
+    REQUIRE_LE(stats.mean_nsec, stats.max_nsec);
+    // The percentiles are the upper bounds of their buckets
+    REQUIRE_LE(stats.p999_nsec, stats.max_nsec + stats.max_nsec / 8);
+  }
+  REQUIRE_EQ(chmap_get_latency_stats(chmap, chmap_latency_resize, &stats),
+             chm_success);
+  REQUIRE_GT(stats.count, 0);
+#else
+  REQUIRE_EQ(chmap_get_latency_stats(chmap, chmap_latency_insert, &stats),
+             chm_success);
+  REQUIRE_EQ(stats.count, 0);
+#endif
+
+  FILE* file = tmpfile();
+  REQUIRE_NE((void*)file, NULL);
+  REQUIRE_EQ(chmap_dump_latency(chmap, fileno(file)), chm_success);
+  char line[256];
+  REQUIRE_EQ(lseek(fileno(file), 0, SEEK_SET), 0);
+  REQUIRE_NE((void*)fgets(line, sizeof(line), file), NULL);
+  REQUIRE_EQ(strncmp(line, "insert count=", 13), 0);
+  fclose(file);
+
+  chmap_destroy(chmap);
+}
+
+TEST(chash_maps, trace) {
+  chashmap* chmap = chmap_create(64, NULL);
+  REQUIRE_NE((void*)chmap, NULL);
+
+  char path[] = "/tmp/chashmap_trace_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE_GE(fd, 0);
+  close(fd);
+
+  REQUIRE_EQ(chmap_start_trace(NULL, path), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_stop_trace(chmap), chm_invalid_arguments);
+  REQUIRE_EQ(chmap_start_trace(chmap, "/nonexistent/chashmap"), chm_io_error);
+  REQUIRE_EQ(chmap_start_trace(chmap, path), chm_success);
+  REQUIRE_EQ(chmap_start_trace(chmap, path), chm_invalid_arguments);
+
+  // More calls than the trace buffers, so that it gets written out midway
+  const int insert_count = 5000;
+  for (int i = 0; i < insert_count; ++i) {
+    chmap_pair key_pair = {.ptr = &i, .size = sizeof(i)};
+    REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  }
+  int val = 0;
+  int missing = insert_count;
+  chmap_pair key_pair = {.ptr = &missing, .size = sizeof(missing)};
+  REQUIRE_EQ(chmap_get_elem_copy(chmap, &key_pair, &val, sizeof(val)),
+             chm_key_not_found);
+  int key = 7;
+  key_pair.ptr = &key;
+  chmap_pair* val_ref = NULL;
+  REQUIRE_EQ(chmap_get_elem_ref(chmap, &key_pair, &val_ref), chm_success);
+  REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_success);
+  REQUIRE_EQ(chmap_reset(chmap, 128), chm_success);
+  REQUIRE_EQ(chmap_stop_trace(chmap), chm_success);
+  // Not traced any more
+  REQUIRE_EQ(chmap_delete_elem(chmap, &key_pair), chm_key_not_found);
+
+  FILE* file = fopen(path, "rb");
+  REQUIRE_NE((void*)file, NULL);
+  chmap_trace_header header;
+  REQUIRE_EQ(fread(&header, sizeof(header), 1, file), 1);
+  REQUIRE_EQ(memcmp(header.magic, CHMAP_TRACE_MAGIC, sizeof(header.magic)), 0);
+  REQUIRE_EQ(header.version, CHMAP_TRACE_VERSION);
+  REQUIRE_EQ(header.record_size, sizeof(chmap_trace_record));
+
+  chmap_trace_record record;
+  uint64_t last_nsec = 0;
+  uint64_t first_key_hash = 0;
+  for (int i = 0; i < insert_count; ++i) {
+    REQUIRE_EQ(fread(&record, sizeof(record), 1, file), 1);
+    REQUIRE_EQ((int)record.op, chmap_trace_insert);
+    REQUIRE_EQ((int)record.result, chm_success);
+    REQUIRE_EQ(record.key_size, sizeof(int));
+    REQUIRE_EQ(record.val_size, sizeof(int));
+    REQUIRE_GE(record.nsec, last_nsec);
+    REQUIRE_NE(record.key_hash, first_key_hash);
+    last_nsec = record.nsec;
+    if (i == 0) {
+      first_key_hash = record.key_hash;
+    }
+  }
+
+  chmap_trace_op ops[] = {chmap_trace_get_copy, chmap_trace_get_ref,
+                          chmap_trace_delete, chmap_trace_reset};
+  chashmap_retval_t results[] = {chm_key_not_found, chm_success, chm_success,
+                      chm_success};
+  uint32_t val_sizes[] = {sizeof(val), 0, 0, 128};
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE_EQ(fread(&record, sizeof(record), 1, file), 1);
+    REQUIRE_EQ((int)record.op, ops[i]);
+    REQUIRE_EQ((int)record.result, results[i]);
+    REQUIRE_EQ(record.val_size, val_sizes[i]);
+  }
+  REQUIRE_EQ(record.key_hash, 0);
+  REQUIRE_EQ(record.key_size, 0);
+  REQUIRE_EQ(fread(&record, sizeof(record), 1, file), 0);
+  fclose(file);
+
+  // Destroying the map stops the trace as well
+  REQUIRE_EQ(chmap_start_trace(chmap, path), chm_success);
+  REQUIRE_EQ(chmap_insert_elem(chmap, &key_pair, &key_pair), chm_success);
+  chmap_destroy(chmap);
+  file = fopen(path, "rb");
+  REQUIRE_NE((void*)file, NULL);
+  REQUIRE_EQ(fseek(file, 0, SEEK_END), 0);
+  REQUIRE_EQ(ftell(file), sizeof(header) + sizeof(record));
+  fclose(file);
+
+  unlink(path);
+}